@@ -0,0 +1,339 @@
+#include "GBase.h"
+#include "GArgs.h"
+#include "gcdb.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifndef __WIN32__
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#endif
+
+#define USAGE "Usage:\n\
+  cdbbench [-b <cdbfasta>] [-d <data_dir>] [-s <size_MB>] [-r <runs>]\n\
+   \n\
+   Indexing throughput benchmark: generates (once) deterministic synthetic\n\
+   data sets and times cdbfasta on each of them, in each key mode\n\
+   (default, -m, -C, -A, -D, -i) and with the w64 key hash (--hash=w64).\n\
+   The data sets are: short-read FASTQ, protein FASTA with nrdb-style\n\
+   (^|^ concatenated) deflines and chromosome-scale genomic FASTA.\n\
+   Results are written to stdout as tab delimited lines with the fields:\n\
+   dataset, mode, bytes, seconds, MB/s, records, keys, keys/s, maxRSS(KB),\n\
+   probes (average number of hash slots read for finding a key)\n\
+   \n\
+   -b the cdbfasta program to test (default: ./cdbfasta)\n\
+   -d directory for the generated data and the index files\n\
+      (default: bench_data)\n\
+   -s approximate size of each data set, in MB (default: 64)\n\
+   -r number of runs for each test, the fastest one is reported (default: 1)\n"
+
+//-- deterministic pseudo-random numbers (xorshift64*)
+static uint64 rng_state=0x9E3779B97F4A7C15ULL;
+
+static inline uint64 rng_next() {
+  rng_state^=rng_state>>12;
+  rng_state^=rng_state<<25;
+  rng_state^=rng_state>>27;
+  return rng_state*0x2545F4914F6CDD1DULL;
+}
+
+static inline int rng_int(int n) { //0..n-1
+  return (int)((rng_next()>>33)%(uint64)n);
+}
+
+static const char* nucl="ACGT";
+static const char* aminos="ACDEFGHIKLMNPQRSTVWY";
+static const char* quals="#+5:?@ABCDEFGHIJ";
+static const char* words[]={"hypothetical", "protein", "kinase", "receptor",
+   "putative", "transporter", "subunit", "alpha", "beta", "domain-containing",
+   "transcription", "factor", "ribosomal", "binding", "(fragment)", "membrane",
+   "dehydrogenase", "synthase", "family", "precursor", "isoform", "X1", "[Homo",
+   "sapiens]", "[Mus", "musculus]", "[Escherichia", "coli]", "uncharacterized",
+   "zinc", "finger", "ATP-dependent", "helicase", "like", "mitochondrial"};
+static const int numwords=sizeof(words)/sizeof(words[0]);
+static const char* dbs[]={"gb", "emb", "dbj", "ref", "sp", "pir", "prf", "pdb"};
+
+//buffered output of generated data
+class GenOut {
+  FILE* f;
+ public:
+  off_t size;
+  GenOut(const char* fname):size(0) {
+    f=fopen(fname, "wb");
+    if (f==NULL) GError("Error creating file %s\n", fname);
+    setvbuf(f, NULL, _IOFBF, 0x100000);
+    }
+  ~GenOut() { fclose(f); }
+  void put(const char* s, int len) {
+    if (fwrite(s, 1, len, f)!=(size_t)len) GError("Error writing generated data!\n");
+    size+=len;
+    }
+  void puts(const char* s) { put(s, strlen(s)); }
+  //random sequence of len letters from alphabet, in lines of linelen
+  void putSeq(const char* alphabet, int alen, int len, int linelen) {
+    char line[256];
+    while (len>0) {
+      int n=(len<linelen) ? len : linelen;
+      for (int i=0;i<n;i++) line[i]=alphabet[rng_int(alen)];
+      line[n]='\n';
+      put(line, n+1);
+      len-=n;
+      }
+    }
+};
+
+//short reads, 4-line records
+void gen_fastq(const char* fname, off_t maxsize) {
+  GenOut out(fname);
+  char buf[512];
+  for (int i=0;out.size<maxsize;i++) {
+    int rlen=100+rng_int(51);
+    sprintf(buf, "@SRR%07d.%d %d/%d length=%d\n", 1000000+(i>>3), i, i, 1+(i&1), rlen);
+    out.puts(buf);
+    out.putSeq(nucl, 4, rlen, rlen);
+    out.put("+\n", 2);
+    out.putSeq(quals, strlen(quals), rlen, rlen);
+    }
+}
+
+//protein records with nrdb-style deflines: db|accession entries
+//followed by descriptions, concatenated with ^|^
+void gen_protein(const char* fname, off_t maxsize) {
+  GenOut out(fname);
+  char buf[512];
+  for (int i=0;out.size<maxsize;i++) {
+    int nent=1+((rng_int(4)==0) ? rng_int(12) : 0);
+    for (int e=0;e<nent;e++) {
+      if (e==0) out.put(">", 1);
+        else out.put("^|^", 3);
+      sprintf(buf, "gi|%d|%s|%c%c%06d.%d|", 100000+i*16+e, dbs[rng_int(8)],
+          'A'+rng_int(26), 'A'+rng_int(26), rng_int(1000000), 1+rng_int(3));
+      out.puts(buf);
+      int nw=2+rng_int(8);
+      for (int w=0;w<nw;w++) {
+        out.put(" ", 1);
+        out.puts(words[rng_int(numwords)]);
+        }
+      }
+    out.put("\n", 1);
+    out.putSeq(aminos, 20, 80+rng_int(900), 60);
+    }
+}
+
+//a few large genomic sequences, uniform line length
+void gen_chrom(const char* fname, off_t maxsize) {
+  GenOut out(fname);
+  char buf[128];
+  const int numchr=8;
+  for (int c=1;c<=numchr;c++) {
+    sprintf(buf, ">chr%d synthetic chromosome %d\n", c, c);
+    out.puts(buf);
+    int len=(int)((maxsize/numchr)*60/61);
+    out.putSeq(nucl, 4, len, 60);
+    }
+}
+
+struct BenchSet {
+  const char* name;
+  const char* file;
+  const char* opts; //options always passed to cdbfasta for this data set
+  void (*gen)(const char*, off_t);
+};
+
+BenchSet benchSets[]={
+  {"fastq", "reads.fq", "-Q", &gen_fastq},
+  {"protein", "nrdb.fa", NULL, &gen_protein},
+  {"chrom", "genome.fa", NULL, &gen_chrom}
+  };
+
+const char* keyModes[]={"default", "-m", "-C", "-A", "-D", "-i", "--hash=w64"};
+
+double wtime() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec+tv.tv_usec/1e6;
+}
+
+//run cdbfasta, returns the elapsed time and the peak RSS of the process
+double run_cdbfasta(const char* prog, const char* data, const char* opts,
+                    const char* mode, const char* idx, long& maxrss) {
+  const char* argv[8];
+  int argc=0;
+  argv[argc++]=prog;
+  argv[argc++]=data;
+  if (opts!=NULL) argv[argc++]=opts;
+  if (strcmp(mode, "default")!=0) argv[argc++]=mode;
+  argv[argc++]="-o";
+  argv[argc++]=idx;
+  argv[argc]=NULL;
+  double t=wtime();
+  pid_t pid=fork();
+  if (pid<0) GError("Error: fork() failed!\n");
+  if (pid==0) {
+    int devnull=open("/dev/null", O_WRONLY);
+    if (devnull>=0) {
+      dup2(devnull, 1);
+      dup2(devnull, 2);
+      }
+    execv(prog, (char* const*)argv);
+    _exit(127);
+    }
+  int status=0;
+  struct rusage ru;
+  if (wait4(pid, &status, 0, &ru)!=pid)
+    GError("Error: wait4() failed!\n");
+  t=wtime()-t;
+  if (!WIFEXITED(status) || WEXITSTATUS(status)!=0)
+    GError("Error: %s %s %s %s failed (exit status %d)\n", prog, data,
+         opts ? opts : "", mode, WEXITSTATUS(status));
+  maxrss=ru.ru_maxrss;
+  return t;
+}
+
+//number of records and keys, from the index file summary
+void idx_counts(const char* idx, int& numrecs, int& numkeys) {
+  int fd=open(idx, O_RDONLY);
+  cdbInfo info;
+  if (fd<0 || lseek(fd, -cdbInfoSIZE, SEEK_END)<0 ||
+      read(fd, &info, cdbInfoSIZE)!=cdbInfoSIZE ||
+      (strncmp(info.tag, "CDBX", 4)!=0 && strncmp(info.tag, "CD64", 4)!=0))
+    GError("Error reading the summary of index file %s\n", idx);
+  close(fd);
+  gcvt_endian_setup();
+  numrecs=gcvt_uint(&info.num_records);
+  numkeys=gcvt_uint(&info.num_keys);
+}
+
+//average number of slots probed for finding a key, from the hash tables
+double idx_probes(const char* idx) {
+  int fd=open(idx, O_RDONLY);
+  if (fd<0) GError("Error opening index file %s\n", idx);
+  char tag[4];
+  char hdr[2048];
+  if (lseek(fd, -4, SEEK_END)<0 || read(fd, tag, 4)!=4 ||
+      lseek(fd, 0, SEEK_SET)<0 || read(fd, hdr, 2048)!=2048)
+    GError("Error reading index file %s\n", idx);
+  bool is64=(strncmp(tag, "CD64", 4)==0);
+  uint32 tbits=8;
+  uint64 dirpos=0;
+  uint32 slotsize=8;
+  if (is64) {
+    uint64_unpack(hdr+CDB64_HEADER_DIR, &dirpos);
+    uint32_unpack(hdr+CDB64_HEADER_TBITS, &tbits);
+    uint32_unpack(hdr+CDB64_HEADER_SLOT, &slotsize);
+    if (slotsize==0) slotsize=16;
+    }
+  uint64 nkeys=0, nprobes=0;
+  char* tbuf=NULL;
+  uint64 tcap=0;
+  for (uint32 t=0;t<(1u<<tbits);t++) {
+    uint64 tpos=0, len=0;
+    if (is64) {
+      char d[16];
+      if (lseek(fd, dirpos+t*16, SEEK_SET)<0 || read(fd, d, 16)!=16)
+        GError("Error reading the table directory of %s\n", idx);
+      uint64_unpack(d, &tpos);
+      uint64_unpack(d+8, &len);
+      }
+    else {
+      uint32 p32, n32;
+      uint32_unpack(hdr+t*8, &p32);
+      uint32_unpack(hdr+t*8+4, &n32);
+      tpos=p32;
+      len=n32;
+      }
+    if (len==0) continue;
+    if (len*slotsize>tcap) {
+      tcap=len*slotsize;
+      GREALLOC(tbuf, tcap);
+      }
+    if (lseek(fd, tpos, SEEK_SET)<0 || read(fd, tbuf, len*slotsize)!=(ssize_t)(len*slotsize))
+      GError("Error reading the hash tables of %s\n", idx);
+    for (uint64 u=0;u<len;u++) {
+      char* slot=tbuf+u*slotsize;
+      uint32 h;
+      uint64 pos;
+      uint32_unpack(slot, &h);
+      if (is64) {
+        uint64_unpack(slot+8, &pos);
+        pos&=CDB_LOC_POSMASK; //locator slots: the top byte is the data length
+        }
+        else {
+          uint32 p32;
+          uint32_unpack(slot+4, &p32);
+          pos=p32;
+          }
+      if (pos==0) continue;
+      uint64 home=(h>>tbits)%len;
+      nprobes+=(u+len-home)%len+1;
+      nkeys++;
+      }
+    }
+  GFREE(tbuf);
+  close(fd);
+  return nkeys ? (double)nprobes/nkeys : 0;
+}
+
+int main(int argc, char** argv) {
+#ifdef __WIN32__
+  GError("Error: cdbbench is not supported on this platform.\n");
+#endif
+  GArgs args(argc, argv, "hb:d:s:r:");
+  if (args.isError())
+    GError("%s\nInvalid argument: %s\n", USAGE, argv[args.isError()]);
+  if (args.getOpt('h')!=NULL) {
+    GMessage("%s", USAGE);
+    return 0;
+    }
+  const char* prog=args.getOpt('b');
+  if (prog==NULL) prog="./cdbfasta";
+  if (fileExists(prog)!=2)
+    GError("Error: cannot find the cdbfasta program (%s)\n", prog);
+  const char* datadir=args.getOpt('d');
+  if (datadir==NULL) datadir="bench_data";
+  int sizemb=64;
+  if (args.getOpt('s')!=NULL) sizemb=atoi(args.getOpt('s'));
+  if (sizemb<=0) GError("Error: invalid data set size (-s)\n");
+  int runs=1;
+  if (args.getOpt('r')!=NULL) runs=atoi(args.getOpt('r'));
+  if (runs<=0) GError("Error: invalid number of runs (-r)\n");
+  off_t maxsize=((off_t)sizemb)<<20;
+  if (fileExists(datadir)!=1 && mkdir(datadir, 0755)!=0)
+    GError("Error creating directory %s\n", datadir);
+  char fname[1024];
+  char idxname[1024];
+  sprintf(idxname, "%s/bench.cidx", datadir);
+  printf("#dataset\tmode\tbytes\tseconds\tMB/s\trecords\tkeys\tkeys/s\tmaxRSS_KB\tprobes\n");
+  for (unsigned int d=0;d<sizeof(benchSets)/sizeof(BenchSet);d++) {
+    BenchSet& bs=benchSets[d];
+    //the data set size is part of the name, so it's regenerated if needed
+    sprintf(fname, "%s/%dM_%s", datadir, sizemb, bs.file);
+    if (fileExists(fname)!=2) {
+      GMessage("Generating %s..\n", fname);
+      rng_state=0x9E3779B97F4A7C15ULL+d;
+      bs.gen(fname, maxsize);
+      }
+    struct stat st;
+    if (stat(fname, &st)!=0) GError("Error: cannot stat %s\n", fname);
+    for (unsigned int m=0;m<sizeof(keyModes)/sizeof(char*);m++) {
+      double best=0;
+      long bestrss=0;
+      for (int r=0;r<runs;r++) {
+        long rss=0;
+        double t=run_cdbfasta(prog, fname, bs.opts, keyModes[m], idxname, rss);
+        if (r==0 || t<best) best=t;
+        if (rss>bestrss) bestrss=rss;
+        }
+      int numrecs=0, numkeys=0;
+      idx_counts(idxname, numrecs, numkeys);
+      double probes=idx_probes(idxname);
+      if (best<=0) best=1e-6;
+      printf("%s\t%s\t%lld\t%.3f\t%.2f\t%d\t%d\t%.0f\t%ld\t%.3f\n", bs.name, keyModes[m],
+         (long long)st.st_size, best, st.st_size/1048576.0/best, numrecs, numkeys,
+         numkeys/best, bestrss, probes);
+      fflush(stdout);
+      }
+    }
+  remove(idxname);
+  return 0;
+}
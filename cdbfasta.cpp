@@ -2,10 +2,16 @@
 #include <fcntl.h>
 #include <string.h>
 #include <sys/stat.h>
+#ifndef __WIN32__
+#include <pthread.h>
+#endif
 #include "GBase.h"
 #include "GArgs.h"
-#include "GHash.hh"
+#include "gmphset.h"
+#include "gkeypat.h"
 #include "gcdb.h"
+#include "gfascan.h"
+#include "gbgzf.h"
 #ifdef ENABLE_COMPRESSION
 #include "gcdbz.h"
 #endif
@@ -16,15 +22,22 @@
 #endif
 
 #define USAGE "Usage:\n\
-  cdbfasta <fastafile> [-o <index_file>] [-r <record_delimiter>]\n\
-   [-z <compressed_db>] [-i] [-m|-n <numkeys>|-f<LIST>]|-c|-C]\n\
-    [-w <stopwords_list>] [-s <stripendchars>] [{-Q|-G}]  [-v]\n\
+  cdbfasta <fastafile> [<fastafile2>..] [-o <index_file>] [-r <record_delimiter>]\n\
+   [-z <compressed_db>] [-i|-I] [-m|-n <numkeys>|-f<LIST>]|-c|-C|-k <pattern>]\n\
+    [-w <stopwords_list>] [-s <stripendchars>] [{-Q|-G}] [-p <threads>]\n\
+    [-M <GB>] [--hugepages] [-B <MB>] [--bgwrite] [--nosync]\n\
+    [--hash={djb|w64}] [--append] [--cdb64] [--locators]\n\
+    [--mph [--fpbits=<bits>] [--keyless]] [-v]\n\
    \n\
    Creates an index file for records from a multi-fasta file.\n\
    By default (without -m/-n/-c/-C option), only the first \n\
    space-delimited token from the defline is used as a key.\n\
   \n\
-   <fastafile> is the multi-fasta file to index; \n\
+   <fastafile> is the multi-fasta file to index; it can be \"-\" or\n\
+      \"stdin\" in order to get the input records from stdin (-o is\n\
+      required in this case); if multiple files are given, a single index\n\
+      is created for all of them (-o is required); BGZF compressed\n\
+      files (e.g. created by bgzip) are indexed directly\n\
    -o the index file will be named <index_file>; if not given,\n\
       the index filename is database name plus the suffix '.cidx'\n\
    -r <record_delimiter> a string of characters at the beginning of line\n\
@@ -49,6 +62,9 @@
       in the file <stopwordslist> (for options -m, -n and -k)\n\
    -i do case insensitive indexing (i.e. create additional keys for \n\
       all-lowercase tokens used for indexing from the defline \n\
+   -I case-folded index: keys are stored only once, but hashed and compared\n\
+      ignoring the case, so the index answers both exact and case\n\
+      insensitive (cdbyank -i) queries, without the additional keys of -i\n\
    -c for deflines in the format: db1|accession1|db2|accession2|...,\n\
       only the first db-accession pair ('db1|accession1') is taken as key\n\
    -C like -c, but also subsequent db|accession constructs are indexed,\n\
@@ -63,9 +79,53 @@
       (e.g. >key1|key2|key3|.. )\n\
    -d same as -D but using a custom key delimiter <kdelim> instead of the pipe\n\
       character '|'\n\
+   -k <pattern> index the strings matched by the capture groups of the\n\
+      regular expression <pattern> (or the whole match, if it has no\n\
+      groups), for all the matches found in the defline; e.g. to index\n\
+      the gi numbers and the accessions of nrdb deflines:\n\
+      -k 'gi\\|(\\d+)\\|[a-z]+\\|([^|]+)'\n\
    -G FASTA records are treated as large genomic sequences (e.g. full \n\
       chromosomes/contigs) and their formatting is checked for suitability\n\
       for fast range queries (i.e. uniform line length within each record)\n\
+   -p use <threads> threads for indexing large or multiple input files, or\n\
+      for extracting the keys while reading the input (e.g. from stdin),\n\
+      and for building the hash tables of the index\n\
+      (the index created is the same as the one built with a single thread)\n\
+   -M limit the memory used for the hash table entries of the index to\n\
+      about <GB> gigabytes (e.g. -M 0.5); when needed, the entries are\n\
+      written to a temporary file next to the index and the hash tables\n\
+      are built one partition at a time; the peak memory used for the\n\
+      entries and the hash tables is reported at the end\n\
+   --hugepages use transparent huge pages for the hash table entries kept\n\
+      in memory (Linux only)\n\
+   -B size of the index output buffer, in MB (default 1); the index write\n\
+      throughput is reported at the end when -B, --bgwrite or --nosync\n\
+      are given\n\
+   --bgwrite write the index from a background thread (double buffered)\n\
+   --nosync do not fsync() the index file (e.g. for scratch builds)\n\
+   --hash the hash function for the index keys: djb (the classic cdb hash,\n\
+      default) or w64 (a faster 64bit hash over 8 byte words, which also\n\
+      spreads long common key prefixes better); cdbyank reads the choice\n\
+      from the index, older cdbyank versions only read djb indexes\n\
+   --cdb64 create the index in the 64bit format (which is otherwise only\n\
+      used if the index would exceed 4GB); cdbyank reads both formats\n\
+   --locators create a 64bit (cdb64) index whose hash table slots also hold\n\
+      a key fingerprint and the record locators, so a lookup usually reads\n\
+      a single slot of the index (larger hash tables: 32 bytes per slot)\n\
+   --mph create a compact minimal perfect hash index for a static database:\n\
+      the keys are not stored, only a key fingerprint and the bit-packed\n\
+      record locators (a few bytes per key); lookups of keys which are not\n\
+      in the database can rarely return a wrong record, and cdbyank -l\n\
+      cannot list the keys (not allowed with -G or --append)\n\
+   --fpbits the key fingerprint size for --mph, in bits (0..32, default 16):\n\
+      an absent key is wrongly found with a 1/2^<bits> probability\n\
+   --keyless (implies --mph) cdbyank verifies each key found against the\n\
+      first token of the record's defline, so absent keys are never found\n\
+      and cdbyank -l lists the keys by reading the deflines (only for the\n\
+      default keys, the first token of each defline; not with -i or -z)\n\
+   --append update the existing index of <fastafile> after new records were\n\
+      appended to it (only the new data is scanned); the same indexing\n\
+      options must be given as when the index was created\n\
    -v show program version and exit\n"
 
 /*
@@ -78,20 +138,22 @@
  #define O_BINARY 0x0000
 #endif
 #define MAX_KEYLEN 1024
-//64K input buffer
-#define GREADBUF_SIZE 0x010000
-
+//room for the largest index record data
+#define MAX_RECDATA 32
+//1MB input block
+#define GREADBUF_SIZE 0x100000
+//input range size for each thread in parallel indexing (-p)
+#define PIDX_RANGE 0x1000000
+#define MAX_THREADS 256
 
-typedef void (*addFuncType)(char*, off_t, uint32);
+typedef void (*addFuncType)(char*, off_t, uint32, void*);
 
 char ftmp[365];
 char fztmp[365];
 char record_marker[127]; //record delimiter
 int  record_marker_len=1;
-int num_recs;
-int num_keys;
-
-off_t last_cdbfpos=0;
+uint64 num_recs;
+uint64 num_keys;
 
 int compact_plus; //shortcut key and
 bool acc_mode=false;
@@ -99,6 +161,7 @@ bool acc_only=false;
 bool do_compress=false; // compression used
 bool fastq=false;
 bool gFastaSeq=false;
+bool fullDefline=false; //key functions need the whole defline
 char keyDelim=0;
 
 FILE* zf=NULL; //compressed file handle
@@ -107,16 +170,188 @@ FILE* zf=NULL; //compressed file handle
 const char* defWordJunk="'\",`.(){}/[]!:;~|><+-";
 char* wordJunk=NULL;
 bool caseInsensitive=false; //case insensitive storage
+bool foldIndex=false; //case-folded index (-I)
+int hashVersion=CDB_HASH_DJB; //key hash function (--hash)
 bool useStopWords=false;
+bool keyDedup=false; //drop duplicate keys within a record
+//character classes for key parsing, indexed by (uchar) char
+bool junkChar[256]; //wordJunk characters
+bool spaceChar[256]; //isspace() characters
+char lcChar[256]; //lowercase conversion
 unsigned int numFields=0;
 // we have fields[numFields-1]=MAX_UINT as defined in gcdb.h --
 // as an indicator of taking every single token in the defline,
 // or for open ended ranges (e.g. -f5- )
 unsigned int fields[255]; //array of numFields field indices (1-based)
-GHash<int> stopList;
+GMphSet stopList; //-w stop words
+GKeyPattern keyPattern; //-k pattern
 //static int datalen=sizeof(uint32)+sizeof(off_t);
 
-char lastKey[MAX_KEYLEN]; //keep a copy of the last valid written key
+//BGZF input: the scanner works on the uncompressed data, so the record
+//offsets it reports are converted to virtual offsets using the offsets of
+//the blocks read so far
+struct CBgzfBlocks {
+  off_t* ustart; //offset of each block in the uncompressed data
+  off_t* cofs; //file offset of each block
+  int first; //blocks before this one cannot have record starts anymore
+  int count;
+  int cap;
+  CBgzfBlocks():ustart(NULL), cofs(NULL), first(0), count(0), cap(0) { }
+  ~CBgzfBlocks() {
+    GFREE(ustart);
+    GFREE(cofs);
+    }
+  void add(off_t us, off_t co) {
+    if (count==cap) {
+      if (first>=(cap>>1) && first>0) { //drop the blocks no longer needed
+        memmove(ustart, ustart+first, (count-first)*sizeof(off_t));
+        memmove(cofs, cofs+first, (count-first)*sizeof(off_t));
+        count-=first;
+        first=0;
+        }
+      else {
+        cap=(cap==0) ? 256 : cap*2;
+        GREALLOC(ustart, cap*sizeof(off_t));
+        GREALLOC(cofs, cap*sizeof(off_t));
+        }
+      }
+    ustart[count]=us;
+    cofs[count]=co;
+    count++;
+    }
+  //virtual offset of uncompressed offset upos; upos must not be lower
+  //than the one given in the previous call
+  uint64 voffset(off_t upos) {
+    while (first+1<count && ustart[first+1]<=upos) first++;
+    return bgzf_voffset(cofs[first], (int)(upos-ustart[first]));
+    }
+};
+
+//the keys added for the current record, so duplicate keys found in the
+//same defline can be dropped (open addressing hash set, emptied for each
+//record by incrementing the generation number of the slots in use)
+struct CRecKeySet {
+  struct Slot {
+    uint32 gen; //the slot is in use if this is the current generation
+    uint32 hash;
+    uint32 ofs; //key offset in keys
+    uint32 len;
+  };
+  Slot* slots;
+  uint32 cap; //number of slots (a power of 2)
+  uint32 count;
+  uint32 gen;
+  char* keys; //copies of the keys added for the current record
+  uint32 klen;
+  uint32 kcap;
+  CRecKeySet():slots(NULL), cap(0), count(0), gen(1), keys(NULL), klen(0), kcap(0) { }
+  ~CRecKeySet() {
+    GFREE(slots);
+    GFREE(keys);
+    }
+  void clear() {
+    count=0;
+    klen=0;
+    if (++gen==0) { //wrapped around
+      for (uint32 i=0;i<cap;i++) slots[i].gen=0;
+      gen=1;
+      }
+    }
+  void grow() {
+    uint32 ncap=(cap==0) ? 64 : cap*2;
+    Slot* nslots=NULL;
+    GCALLOC(nslots, ncap*sizeof(Slot));
+    for (uint32 i=0;i<cap;i++) {
+      if (slots[i].gen!=gen) continue;
+      uint32 j=slots[i].hash & (ncap-1);
+      while (nslots[j].gen==gen) j=(j+1) & (ncap-1);
+      nslots[j]=slots[i];
+      }
+    GFREE(slots);
+    slots=nslots;
+    cap=ncap;
+    }
+  //adds key to the set; returns false if it was already there
+  bool add(const char* key, uint32 len) {
+    if ((count+1)*2>cap) grow();
+    uint32 h=(uint32)cdb_hash64(key, len);
+    uint32 i=h & (cap-1);
+    while (slots[i].gen==gen) {
+      if (slots[i].hash==h && slots[i].len==len &&
+          memcmp(keys+slots[i].ofs, key, len)==0) return false;
+      i=(i+1) & (cap-1);
+      }
+    if (klen+len>kcap) {
+      kcap=(klen+len)*2;
+      GREALLOC(keys, kcap);
+      }
+    memcpy(keys+klen, key, len);
+    slots[i].gen=gen;
+    slots[i].hash=h;
+    slots[i].ofs=klen;
+    slots[i].len=len;
+    klen+=len;
+    count++;
+    return true;
+    }
+};
+
+//key extraction state (one for each indexing thread)
+struct CKeyState {
+  uint64 num_recs;
+  uint64 num_keys;
+  int num_dups; //duplicate keys dropped
+  CRecKeySet reckeys; //keys of the current record (multi-key modes)
+  GKeyMatcher* kmatcher; //for -k
+  char* lcbuf; //buffer for lowercase keys (-i)
+  unsigned int lcbufcap;
+  int fileid; //input file index for multi-file indexes, or -1
+  GCdbWrite* cdbw; //the keys are either written directly to the index
+  GCdbRecBuf* recbuf; //or collected in memory (parallel indexing)
+  GFSeqGeom geom; //layout of the current record (-G)
+  CBgzfBlocks* bgzblocks; //for BGZF input
+  CKeyState(GCdbWrite* w=NULL, GCdbRecBuf* rb=NULL):num_recs(0), num_keys(0),
+       num_dups(0), reckeys(), kmatcher(NULL), lcbuf(NULL), lcbufcap(0), fileid(-1),
+       cdbw(w), recbuf(rb), bgzblocks(NULL) {
+    memset(&geom, 0, sizeof(GFSeqGeom));
+    }
+  ~CKeyState() {
+    delete kmatcher;
+    GFREE(lcbuf);
+    }
+  void reset() { //reuse for another input range
+    num_recs=0;
+    num_keys=0;
+    num_dups=0;
+    setFile(-1);
+    }
+  void setFile(int fid) { //a new input file starts
+    fileid=fid;
+    }
+  void newRecord() {
+    num_recs++;
+    reckeys.clear();
+    }
+  //lowercase copy of key (valid until the next call),
+  //or NULL if key has no uppercase letters
+  const char* loKey(const char* key, unsigned int klen) {
+    unsigned int i=0;
+    while (i<klen && lcChar[(uchar)key[i]]==key[i]) i++;
+    if (i==klen) return NULL;
+    if (klen>=lcbufcap) {
+      lcbufcap=klen+64;
+      GREALLOC(lcbuf, lcbufcap);
+      }
+    memcpy(lcbuf, key, i);
+    for (;i<klen;i++) lcbuf[i]=lcChar[(uchar)key[i]];
+    lcbuf[klen]=0;
+    return lcbuf;
+    }
+  int addrec(const char* key, unsigned int keylen, char* data, unsigned int datalen) {
+    return (recbuf!=NULL) ? recbuf->addrec(key, keylen, data, datalen) :
+                            cdbw->addrec(key, keylen, data, datalen);
+    }
+};
 
 GCdbWrite* cdbidx;
 addFuncType addKeyFunc;
@@ -139,111 +374,121 @@ void die_readformat(const char* infile) {
        infile);
 }
 
-void die_gseqformat(const char* seqname) {
-  GError("Error: invalid FASTA sequence format for %s (not uniform line length)\n",
-       seqname);
-}
 
-void die_fastqformat(const char* seqid, int seqlen, int qvlen) {
-  GError("Error: invalid FASTQ sequence format for %s (seqlen=%d, qvlen=%d)\n",
-       seqid);
+void setupKeyChars() {
+  for (int c=0;c<256;c++) {
+    junkChar[c]=false;
+    spaceChar[c]=(isspace(c)!=0);
+    lcChar[c]=(char)tolower(c);
+    }
+  for (const char* p=wordJunk;*p!=0;p++) junkChar[(uchar)*p]=true;
 }
 
-
-bool add_cdbkey(char* key, off_t fpos, uint32 reclen, int16_t linelen=0, byte elen=0) {
-
- unsigned int klen=strlen(key);
- if (fpos==last_cdbfpos && strcmp(key, lastKey)==0) return true;
+bool add_cdbkey(CKeyState* ks, const char* key, unsigned int klen,
+                off_t fpos, uint32 reclen) {
  if (klen<1) {
     /* GMessage("Warning: zero length key found following key '%s'\n",
               lastKey);
     */
     return false;
     }
+ if (keyDedup && !ks->reckeys.add(key, klen)) {
+   ks->num_dups++;
+   return true;
+   }
   //------------ adding record -----------------
- num_keys++;
- strncpy(lastKey, key, MAX_KEYLEN-1);
- lastKey[MAX_KEYLEN-1]='\0';
+ ks->num_keys++;
+ char recbuf[MAX_RECDATA]; //record data, file index appended if needed
+ int recsize=0;
  if ((uint64)fpos>(uint64)MAX_UINT) { //64 bit file offset
   uint64 v= (uint64) fpos; //needed for Solaris' off_t issues with gcc/32
-  /*
-  if (linelen>0) {
-     //record with line len
+  if (gFastaSeq) {
+    //record with sequence layout
     CIdxSeqData recdata;
     recdata.fpos=gcvt_offt(&v);
     recdata.reclen=gcvt_uint(&reclen);
-    recdata.linelen=gcvt_int16(&linelen);
-    recdata.elen=elen;
-    if (cdbidx->addrec(key,klen,(char*)&recdata,IdxSeqDataSIZE)==-1)
-      GError("Error adding cdb record with key '%s'\n",key);
-     }
-
-   else { //plain record */
+    recdata.deflen=gcvt_uint(&ks->geom.deflen);
+    recdata.seqlen=gcvt_uint(&ks->geom.seqlen);
+    recdata.linelen=gcvt_uint(&ks->geom.linelen);
+    recdata.elen=(byte)ks->geom.elen;
+    memcpy(recbuf, &recdata, IdxSeqDataSIZE);
+    recsize=IdxSeqDataSIZE;
+    }
+   else { //plain record
     CIdxData recdata;
     recdata.fpos=gcvt_offt(&v);
     recdata.reclen=gcvt_uint(&reclen);
-    if (cdbidx->addrec(key,klen,(char*)&recdata,IdxDataSIZE)==-1)
-      GError("Error adding cdb record with key '%s'\n",key);
-    //}
+    memcpy(recbuf, &recdata, IdxDataSIZE);
+    recsize=IdxDataSIZE;
+    }
   }
  else {//32 bit file offset is enough
-   /*
-  if (linelen>0) {
+  uint32 v=(uint32) fpos;
+  if (gFastaSeq) {
     CIdxSeqData32 recdata;
-    uint32 v=(uint32) fpos;
     recdata.fpos=gcvt_uint(&v);
     recdata.reclen=gcvt_uint(&reclen);
-    recdata.linelen=gcvt_int16(&linelen);
-    recdata.elen=elen;
-    if (cdbidx->addrec(key,klen,(char*)&recdata,IdxDataSIZE32)==-1)
-      GError("Error adding cdb record with key '%s'\n",key);
+    recdata.deflen=gcvt_uint(&ks->geom.deflen);
+    recdata.seqlen=gcvt_uint(&ks->geom.seqlen);
+    recdata.linelen=gcvt_uint(&ks->geom.linelen);
+    recdata.elen=(byte)ks->geom.elen;
+    memcpy(recbuf, &recdata, IdxSeqDataSIZE32);
+    recsize=IdxSeqDataSIZE32;
     }
-   else { */
+   else {
     CIdxData32 recdata;
-    uint32 v=(uint32) fpos;
     recdata.fpos=gcvt_uint(&v);
     recdata.reclen=gcvt_uint(&reclen);
-    if (cdbidx->addrec(key,klen,(char*)&recdata, IdxDataSIZE32)==-1)
-      GError("Error adding cdb record with key '%s'\n",key);
-    //}
+    memcpy(recbuf, &recdata, IdxDataSIZE32);
+    recsize=IdxDataSIZE32;
+    }
   }
- last_cdbfpos=fpos;
+ if (ks->fileid>=0) {
+    int16_t fid=(int16_t)ks->fileid;
+    fid=gcvt_int16(&fid);
+    memcpy(recbuf+recsize, &fid, sizeof(int16_t));
+    recsize+=sizeof(int16_t);
+    }
+ if (ks->addrec(key,klen,recbuf,recsize)==-1)
+    GError("Error adding cdb record with key '%.*s'\n", klen, key);
  return true;
 }
 
 //default indexing: key directly passed --
 // as the first space delimited token
 void addKey(char* key, off_t fpos,
-             uint32 reclen) {
- num_recs++;
- add_cdbkey(key, fpos, reclen);
+             uint32 reclen, void* kdata) {
+ CKeyState* ks=(CKeyState*)kdata;
+ ks->newRecord();
+ unsigned int klen=strlen(key);
+ add_cdbkey(ks, key, klen, fpos, reclen);
  if (caseInsensitive) {
-   char* lckey=loCase(key);
-   if (strcmp(lckey, key)!=0)
-      add_cdbkey(lckey, fpos, reclen);
-   GFREE(lckey);
+   const char* lckey=ks->loKey(key, klen);
+   if (lckey!=NULL)
+      add_cdbkey(ks, lckey, klen, fpos, reclen);
    }
 }
 
 //the whole defline is passed
 void addKeyMulti(char* defline,
-                 off_t fpos, uint32 reclen) {
+                 off_t fpos, uint32 reclen, void* kdata) {
+ CKeyState* ks=(CKeyState*)kdata;
  char* p=defline;
  unsigned int fieldno=0;
  char* pn;
- num_recs++;
+ ks->newRecord();
  bool stillParsing=true;
  unsigned int fidx=0; //index in fields[] array
  while (stillParsing) {
        while ((*p)==' ' || (*p)=='\t') p++;
        if (*p == '\0') break;
        //skip any extraneous characters at the beginning of the token
-       while (chrInStr(*p, wordJunk)) p++;
+       while (junkChar[(uchar)*p]) p++;
        //skip any padding spaces or other extraneous characters
        //at the beginning of the word
        if (*p == '\0') break;
        pn=p;
-       while (*pn!='\0' && !isspace(*pn)) pn++;
+       while (*pn!='\0' && !spaceChar[(uchar)*pn]) pn++;
        //found next space or end of string
        fieldno++;
        while (fields[fidx]<fieldno && fidx<numFields-1) fidx++;
@@ -252,24 +497,22 @@ void addKeyMulti(char* defline,
        stillParsing = (((*pn)!='\0') && (fieldno+1<=fields[numFields-1]));
        char* pend = pn-1; //pend is on the last non-space in the current token
        //--strip the ending junk, if any
-       while (chrInStr(*pend, wordJunk) && pend>p) pend--;
-       if (pend<pn-1) *(pend+1)='\0';
-                 else *pn='\0';
-
-       if (strlen(p)>0) {
+       while (junkChar[(uchar)*pend] && pend>p) pend--;
+       //the key is the [p, p+klen) slice of the defline
+       unsigned int klen=(pend<pn-1) ? pend+1-p : pn-p;
+       if (klen>0) {
          if (fields[fidx]==MAX_UINT || fields[fidx]==fieldno) {
-           if (useStopWords && stopList.hasKey(p)) {
+           if (useStopWords && stopList.has(p, klen)) {
              p=pn+1;
              continue;
              }
            //--- store this key with the same current record data:
-           add_cdbkey(p, fpos, reclen);
+           add_cdbkey(ks, p, klen, fpos, reclen);
            //---storage code ends here
            if (caseInsensitive) {
-              char* lcp=loCase(p);
-              if (strcmp(lcp,p)!=0)
-                  add_cdbkey(lcp, fpos, reclen);
-              GFREE(lcp);
+              const char* lcp=ks->loKey(p, klen);
+              if (lcp!=NULL)
+                  add_cdbkey(ks, lcp, klen, fpos, reclen);
               }
            }
          //if (isEnd) break; //if all the token were stored
@@ -334,7 +577,7 @@ char* endSpToken(char* str) {
  if (str==NULL) return NULL;
  char* p=str;
  //while (*p!=' ' && *p!='\t' && *p!='\v' && *p!=0) p++;
- while (!isspace(*p) && *p!=0) p++;
+ while (!spaceChar[(uchar)*p] && *p!=0) p++;
  *p=0;
  return p;
 }
@@ -359,9 +602,10 @@ inline void NRDB_Rec(char* &nrdbp, char* defline) {
 //-c/-C/-a/-A indexing: key up to the first space or second '|'
 //receives the full defline
 void addKeyCompact(char* defline,
-              off_t fpos, uint32 reclen) {
+              off_t fpos, uint32 reclen, void* kdata) {
+ CKeyState* ks=(CKeyState*)kdata;
  //we got the first token found on the defline
- num_recs++;
+ ks->newRecord();
  char* nrdb_end;
  //breaks defline at the next nrdb concatenation point
  NRDB_Rec(nrdb_end, defline);
@@ -374,16 +618,16 @@ void addKeyCompact(char* defline,
    char* dbacc_end=parse_dbacc(defline, end_acc1, acc1st);
    if (end_acc1!=NULL) { //has acceptable shortcut
      *end_acc1=0;
-     add_cdbkey(defline, fpos, reclen);
+     add_cdbkey(ks, defline, end_acc1-defline, fpos, reclen);
      return;
      }
    if (dbacc_end!=NULL) {
       *dbacc_end=0;
-      add_cdbkey(defline, fpos, reclen);
+      add_cdbkey(ks, defline, dbacc_end-defline, fpos, reclen);
       return;
       }
    //store this whole non-space token as key:
-   add_cdbkey(defline, fpos, reclen);
+   add_cdbkey(ks, defline, token_end-defline, fpos, reclen);
    return;
    }
  //from now on only -C/-a/-A treatment:
@@ -391,8 +635,8 @@ void addKeyCompact(char* defline,
  if (numFields>0) max_accs=numFields;
  for(;;) {
     //defline is on the first token
-    if (strlen(defline)>0) //add whole non-space token as the "full key"
-       add_cdbkey(defline, fpos, reclen);
+    if (token_end>defline) //add whole non-space token as the "full key"
+       add_cdbkey(ks, defline, token_end-defline, fpos, reclen);
     //add the db|accession constructs as keys
     char* dbacc_start=defline;
     char* firstacc_end=NULL;
@@ -404,23 +648,23 @@ void addKeyCompact(char* defline,
         char c=*firstacc_end;
         *firstacc_end=0;
         if (!acc_only)
-          add_cdbkey(dbacc_start, fpos, reclen);
+          add_cdbkey(ks, dbacc_start, firstacc_end-dbacc_start, fpos, reclen);
         if (acc_mode && accst && acc_keyed<max_accs) {
-             add_cdbkey(accst, fpos, reclen);
+             add_cdbkey(ks, accst, firstacc_end-accst, fpos, reclen);
              ++acc_keyed;
              }
         *firstacc_end=c;
         }
       if (dbacc_start==defline && dbacc_end==token_end) {
            if (acc_mode && accst!=NULL && accst!=dbacc_start)
-              add_cdbkey(accst, fpos, reclen);
+              add_cdbkey(ks, accst, dbacc_end-accst, fpos, reclen);
            break; //the whole seq_name was only one db entry
            }
       *dbacc_end=0; //end key here
       if (!acc_only)
-        add_cdbkey(dbacc_start, fpos, reclen);
+        add_cdbkey(ks, dbacc_start, dbacc_end-dbacc_start, fpos, reclen);
       if (acc_mode && accst && acc_keyed<max_accs) {
-        add_cdbkey(accst, fpos, reclen);
+        add_cdbkey(ks, accst, dbacc_end-accst, fpos, reclen);
         ++acc_keyed;
         }
       if (dbacc_end==token_end)
@@ -441,9 +685,10 @@ void addKeyCompact(char* defline,
  }
 
 void addKeyDelim(char* defline,
-              off_t fpos, uint32 reclen) {
+              off_t fpos, uint32 reclen, void* kdata) {
+ CKeyState* ks=(CKeyState*)kdata;
  //we got the first token found on the defline
- num_recs++;
+ ks->newRecord();
  char* nrdb_end;
  //breaks defline at the next nrdb concatenation point
  NRDB_Rec(nrdb_end, defline);
@@ -451,13 +696,13 @@ void addKeyDelim(char* defline,
  char* token_end=endSpToken(defline);
  for(;;) {
     //defline is on the first token
-    if (strlen(defline)==0) break;
+    if (token_end==defline) break;
     //add the db|accession constructs as keys
     char* k_start=defline;
     char* k_end=NULL;
     while ((k_end=nextKeyDelim(k_start, token_end))!=NULL) {
         *k_end=0;
-        add_cdbkey(k_start, fpos, reclen);
+        add_cdbkey(ks, k_start, k_end-k_start, fpos, reclen);
         k_start=k_end+1;
         }
     // -- get to next concatenated defline, if any:
@@ -471,7 +716,37 @@ void addKeyDelim(char* defline,
    } //for
  }
 
-int readWords(FILE* f, GHash<int>& xhash) {
+//-k indexing: the capture groups of each match of the key pattern
+//in the defline are the keys (or the whole match, without groups)
+void addKeyPattern(char* defline,
+              off_t fpos, uint32 reclen, void* kdata) {
+ CKeyState* ks=(CKeyState*)kdata;
+ ks->newRecord();
+ if (ks->kmatcher==NULL) ks->kmatcher=new GKeyMatcher(&keyPattern);
+ GKeyMatcher& m=*(ks->kmatcher);
+ int len=strlen(defline);
+ int ng=keyPattern.numGroups();
+ int from=0;
+ while (from<=len && m.find(defline, len, from)) {
+   for (int g=(ng>0) ? 1 : 0; g<=ng; g++) {
+     int kstart=m.start(g);
+     int klen=m.end(g)-kstart;
+     if (kstart<0 || klen<=0) continue;
+     char* key=defline+kstart;
+     if (useStopWords && stopList.has(key, klen)) continue;
+     add_cdbkey(ks, key, klen, fpos, reclen);
+     if (caseInsensitive) {
+       const char* lckey=ks->loKey(key, klen);
+       if (lckey!=NULL)
+         add_cdbkey(ks, lckey, klen, fpos, reclen);
+       }
+     }
+   //continue after this match (or after an empty match)
+   from=(m.end(0)>m.start(0)) ? m.end(0) : m.end(0)+1;
+   }
+}
+
+int readWords(FILE* f, GMphSet& wset) {
   int c;
   int count=0;
   char name[256];
@@ -479,8 +754,7 @@ int readWords(FILE* f, GHash<int>& xhash) {
   while ((c=getc(f))!=EOF) {
     if (isspace(c) || c==',' || c==';') {
       if (len>0) {
-        name[len]='\0';
-        xhash.Add(name, new int(1));
+        wset.add(name, len);
         count++;
         len=0;
         }
@@ -495,28 +769,600 @@ int readWords(FILE* f, GHash<int>& xhash) {
       }
     }
  if (len>0) {
-   name[len]='\0';
-   xhash.Add(name, new int(1));
+   wset.add(name, len);
    count++;
    }
  return count;
 }
 
 
+//an input file to be indexed
+struct CInputFile {
+  char* name;
+  int fd; //for memory mapped access, if it's a regular file
+  FILE* f; //buffered access (stdin, pipes)
+  bool isreg; //regular file
+  bool bgzf; //BGZF compressed file
+  off_t size; //file size (set after indexing for non-regular files)
+};
+
+//BGZF input: the record offsets are converted to virtual offsets
+void addKeyBgzf(char* defline, off_t fpos, uint32 reclen, void* kdata) {
+  CKeyState* ks=(CKeyState*)kdata;
+  addKeyFunc(defline, (off_t)ks->bgzblocks->voffset(fpos), reclen, kdata);
+}
+
+#ifndef __WIN32__
+//pipelined indexing of an input file which is read sequentially (stdin,
+//pipes, BGZF files or files which cannot be mapped): the scanning thread
+//copies the deflines, offsets and layouts of the records found into
+//batches which are handed to worker threads for key extraction, while a
+//writer thread appends the index records of each batch in input order
+//(so the index is the same as the one built by a single thread)
+#define PIPE_BATCH_RECS 4096
+#define PIPE_BATCH_DATA 0x40000
+
+struct CRecBatch {
+  enum { bFree=0, bFilled, bDone };
+  struct Rec {
+    off_t fpos;
+    uint32 reclen;
+    uint32 dofs; //defline offset in deflines
+    GFSeqGeom geom;
+  };
+  char* deflines;
+  uint32 dlen;
+  uint32 dcap;
+  Rec* recs;
+  int numrecs;
+  int fileid;
+  int state;
+  GCdbRecBuf recbuf; //index records built by the worker
+  CKeyState ks;
+  CRecBatch():deflines(NULL), dlen(0), dcap(0), recs(NULL), numrecs(0),
+       fileid(-1), state(bFree), recbuf(), ks(NULL, &recbuf) {
+    GMALLOC(recs, PIPE_BATCH_RECS*sizeof(Rec));
+    recbuf.setFoldCase(foldIndex);
+    recbuf.setHash(hashVersion);
+    }
+  ~CRecBatch() {
+    GFREE(deflines);
+    GFREE(recs);
+    }
+  bool full() { return (numrecs==PIPE_BATCH_RECS || dlen>=PIPE_BATCH_DATA); }
+  void add(const char* defline, off_t fpos, uint32 reclen, GFSeqGeom& geom) {
+    uint32 len=strlen(defline)+1;
+    if (dlen+len>dcap) {
+      dcap=(dlen+len<PIPE_BATCH_DATA) ? PIPE_BATCH_DATA+1024 : (dlen+len)*2;
+      GREALLOC(deflines, dcap);
+      }
+    memcpy(deflines+dlen, defline, len);
+    Rec& r=recs[numrecs++];
+    r.fpos=fpos;
+    r.reclen=reclen;
+    r.dofs=dlen;
+    r.geom=geom;
+    dlen+=len;
+    }
+  void index() { //key extraction (worker thread)
+    recbuf.clear();
+    ks.reset();
+    ks.setFile(fileid);
+    for (int i=0;i<numrecs;i++) {
+      if (gFastaSeq) ks.geom=recs[i].geom;
+      addKeyFunc(deflines+recs[i].dofs, recs[i].fpos, recs[i].reclen, &ks);
+      }
+    }
+};
+
+class CIdxPipe {
+  CRecBatch* batches; //used as a ring buffer
+  int numbatches;
+  pthread_t* workers;
+  int numworkers;
+  pthread_t writer;
+  pthread_mutex_t lock;
+  pthread_cond_t workcond; //batches filled (or end of input)
+  pthread_cond_t donecond; //batches indexed (or end of input)
+  pthread_cond_t freecond; //batches written
+  long nfilled; //batches filled so far
+  long ntaken; //batches taken by workers
+  long nwritten; //batches written to the index
+  bool eof;
+  CRecBatch* cur; //batch being filled
+  int fileid;
+  CKeyState& kstate; //for the totals
+  static void* workerThread(void* p);
+  static void* writerThread(void* p);
+  void push();
+ public:
+  GFSeqGeom geom; //layout of the current record (-G)
+  CBgzfBlocks* bgzblocks; //for BGZF input
+  CIdxPipe(int nworkers, CKeyState& ks);
+  ~CIdxPipe();
+  void setFile(int fid) { //a new input file starts
+    if (cur!=NULL && cur->numrecs>0) push();
+    fileid=fid;
+    }
+  void addRec(char* defline, off_t fpos, uint32 reclen) {
+    if (bgzblocks!=NULL) fpos=(off_t)bgzblocks->voffset(fpos);
+    if (cur==NULL) {
+      CRecBatch* b=&batches[nfilled % numbatches];
+      pthread_mutex_lock(&lock);
+      while (b->state!=CRecBatch::bFree) pthread_cond_wait(&freecond, &lock);
+      pthread_mutex_unlock(&lock);
+      cur=b;
+      cur->numrecs=0;
+      cur->dlen=0;
+      cur->fileid=fileid;
+      }
+    cur->add(defline, fpos, reclen, geom);
+    if (cur->full()) push();
+    }
+  //wait for all the records to be written, add the totals to kstate
+  void finish();
+};
+
+void pipeRec(char* defline, off_t fpos, uint32 reclen, void* p) {
+  ((CIdxPipe*)p)->addRec(defline, fpos, reclen);
+}
+
+CIdxPipe::CIdxPipe(int nworkers, CKeyState& ks):kstate(ks) {
+  numworkers=nworkers;
+  numbatches=2*numworkers+2;
+  batches=new CRecBatch[numbatches];
+  nfilled=0;
+  ntaken=0;
+  nwritten=0;
+  eof=false;
+  cur=NULL;
+  fileid=-1;
+  bgzblocks=NULL;
+  memset(&geom, 0, sizeof(GFSeqGeom));
+  pthread_mutex_init(&lock, NULL);
+  pthread_cond_init(&workcond, NULL);
+  pthread_cond_init(&donecond, NULL);
+  pthread_cond_init(&freecond, NULL);
+  workers=NULL;
+  GMALLOC(workers, numworkers*sizeof(pthread_t));
+  for (int i=0;i<numworkers;i++)
+    if (pthread_create(&workers[i], NULL, &workerThread, this)!=0)
+      GError("Error: failed to create indexing thread!\n");
+  if (pthread_create(&writer, NULL, &writerThread, this)!=0)
+    GError("Error: failed to create indexing thread!\n");
+}
+
+CIdxPipe::~CIdxPipe() {
+  if (!eof) finish();
+  pthread_mutex_destroy(&lock);
+  pthread_cond_destroy(&workcond);
+  pthread_cond_destroy(&donecond);
+  pthread_cond_destroy(&freecond);
+  GFREE(workers);
+  delete[] batches;
+}
+
+void CIdxPipe::push() {
+  pthread_mutex_lock(&lock);
+  cur->state=CRecBatch::bFilled;
+  nfilled++;
+  pthread_cond_signal(&workcond);
+  pthread_mutex_unlock(&lock);
+  cur=NULL;
+}
+
+void* CIdxPipe::workerThread(void* p) {
+  CIdxPipe* pipe=(CIdxPipe*)p;
+  pthread_mutex_lock(&pipe->lock);
+  for (;;) {
+    while (pipe->ntaken==pipe->nfilled && !pipe->eof)
+      pthread_cond_wait(&pipe->workcond, &pipe->lock);
+    if (pipe->ntaken==pipe->nfilled) break; //end of input
+    CRecBatch* b=&pipe->batches[pipe->ntaken % pipe->numbatches];
+    pipe->ntaken++;
+    pthread_mutex_unlock(&pipe->lock);
+    b->index();
+    pthread_mutex_lock(&pipe->lock);
+    b->state=CRecBatch::bDone;
+    pthread_cond_broadcast(&pipe->donecond);
+    }
+  pthread_mutex_unlock(&pipe->lock);
+  return NULL;
+}
+
+void* CIdxPipe::writerThread(void* p) {
+  CIdxPipe* pipe=(CIdxPipe*)p;
+  pthread_mutex_lock(&pipe->lock);
+  for (;;) {
+    CRecBatch* b=&pipe->batches[pipe->nwritten % pipe->numbatches];
+    while ((pipe->nwritten==pipe->nfilled && !pipe->eof) ||
+           (pipe->nwritten<pipe->nfilled && b->state!=CRecBatch::bDone))
+      pthread_cond_wait(&pipe->donecond, &pipe->lock);
+    if (pipe->nwritten==pipe->nfilled) break; //end of input
+    pthread_mutex_unlock(&pipe->lock);
+    if (cdbidx->addbuf(&b->recbuf)==-1)
+      GError("Error adding cdb records (index too large?)\n");
+    pipe->kstate.num_recs+=b->ks.num_recs;
+    pipe->kstate.num_keys+=b->ks.num_keys;
+    pipe->kstate.num_dups+=b->ks.num_dups;
+    b->recbuf.clear();
+    pthread_mutex_lock(&pipe->lock);
+    b->state=CRecBatch::bFree;
+    pipe->nwritten++;
+    pthread_cond_signal(&pipe->freecond);
+    }
+  pthread_mutex_unlock(&pipe->lock);
+  return NULL;
+}
+
+void CIdxPipe::finish() {
+  if (cur!=NULL && cur->numrecs>0) push();
+  pthread_mutex_lock(&lock);
+  eof=true;
+  pthread_cond_broadcast(&workcond);
+  pthread_cond_broadcast(&donecond);
+  pthread_mutex_unlock(&lock);
+  for (int i=0;i<numworkers;i++) pthread_join(workers[i], NULL);
+  pthread_join(writer, NULL);
+}
+#else
+class CIdxPipe; //no pipelined indexing
+#endif
+
+//index a BGZF compressed input file, one block at a time;
+//returns the size of the compressed file
+off_t indexBgzf(CInputFile& inf, CKeyState& ks, CIdxPipe* pipe) {
+  if (inf.f==NULL) {
+    inf.f=fdopen(inf.fd, "rb");
+    if (inf.f == NULL) die_read(inf.name);
+    inf.fd=-1;
+    }
+  CBgzfBlocks blocks;
+  ks.bgzblocks=&blocks;
+  GFRecFunc recfunc=&addKeyBgzf;
+  void* recdata=&ks;
+  GFSeqGeom* geom=&ks.geom;
+#ifndef __WIN32__
+  if (pipe!=NULL) {
+    pipe->bgzblocks=&blocks;
+    recfunc=&pipeRec;
+    recdata=pipe;
+    geom=&pipe->geom;
+    }
+#endif
+  GFastaScan fscan(record_marker, record_marker_len, fastq, gFastaSeq,
+                   fullDefline, recfunc, recdata);
+  if (gFastaSeq) fscan.setGeomData(geom);
+  GBgzfStream bgz(inf.f);
+  char* buf=NULL;
+  GMALLOC(buf, BGZF_MAX_BLOCK+record_marker_len);
+  int kept=0; //unconsumed bytes from the previous block
+  off_t pofs=0; //uncompressed data offset of buf
+  int ulen;
+  while ((ulen=bgz.readBlock(buf+kept))>=0) {
+    if (ulen==0) continue; //empty block (e.g. EOF marker)
+    blocks.add(pofs+kept, bgz.blockOfs());
+    const char* end=buf+kept+ulen;
+    const char* p=fscan.scan(buf, end, pofs, false);
+    kept=end-p;
+    pofs+=p-buf;
+    if (kept>0) memmove(buf, p, kept);
+    }
+  fscan.scan(buf, buf+kept, pofs, true);
+  fscan.finish();
+  ks.bgzblocks=NULL;
+#ifndef __WIN32__
+  if (pipe!=NULL) pipe->bgzblocks=NULL;
+#endif
+  GFREE(buf);
+  return bgz.fileOfs();
+}
+
+//index a whole input file with a single thread, or with the
+//scanning thread of an indexing pipeline
+off_t indexFile(CInputFile& inf, CKeyState& ks, CIdxPipe* pipe=NULL) {
+  if (inf.bgzf) return indexBgzf(inf, ks, pipe);
+  GFRecFunc recfunc=addKeyFunc;
+  void* recdata=&ks;
+  GFSeqGeom* geom=&ks.geom;
+#ifndef __WIN32__
+  if (pipe!=NULL) {
+    recfunc=&pipeRec;
+    recdata=pipe;
+    geom=&pipe->geom;
+    }
+#endif
+  GFastaScan fscan(record_marker, record_marker_len, fastq, gFastaSeq,
+                   fullDefline, recfunc, recdata);
+  if (gFastaSeq) fscan.setGeomData(geom);
+  off_t scanned=-1;
+  if (inf.fd>=0) scanned=fscan.scanMapped(inf.fd, inf.size);
+  if (scanned<0) {
+    if (inf.f==NULL) {
+      inf.f=fdopen(inf.fd, "rb");
+      if (inf.f == NULL) die_read(inf.name);
+      inf.fd=-1;
+      }
+    scanned=fscan.scanFile(inf.f, GREADBUF_SIZE);
+    }
+  return scanned;
+}
+
+#ifndef __WIN32__
+//a range of an input file, indexed by one thread
+struct CIdxJob {
+  const char* data; //input file mapping
+  int fidx; //input file index
+  off_t start;
+  off_t end;
+  bool last; //the range ends at the end of the file
+  bool ok; //end was confirmed as a record start
+  GCdbRecBuf recbuf;
+  CKeyState ks;
+  CIdxJob():data(NULL), fidx(0), start(0), end(0), last(false), ok(true),
+       recbuf(), ks(NULL, &recbuf) {
+    recbuf.setFoldCase(foldIndex);
+    recbuf.setHash(hashVersion);
+    }
+};
+
+void* idxRange(void* p) {
+  CIdxJob* job=(CIdxJob*)p;
+  GFastaScan fscan(record_marker, record_marker_len, fastq, gFastaSeq,
+                   fullDefline, addKeyFunc, &job->ks);
+  if (gFastaSeq) fscan.setGeomData(&job->ks.geom);
+  job->ok=fscan.scanRange(job->data, job->start, job->end, job->last);
+  return NULL;
+}
+
+//parallel indexing (-p): the memory mapped input files are split into
+//ranges starting at record boundaries, a batch of ranges (possibly from
+//different files) is indexed by separate threads and the records collected
+//for each range are then appended to the index in input order, so the
+//index is the same as the one built by a single thread;
+//input files which cannot be mapped (or are BGZF compressed) are indexed
+//through a pipeline
+void parallelIndex(CInputFile* infiles, int numfiles, bool multiFile,
+                   int numThreads, CKeyState& kstate) {
+  //for finding the record starts only:
+  GFastaScan rscan(record_marker, record_marker_len, fastq, gFastaSeq,
+                   fullDefline, addKeyFunc);
+  CIdxJob* jobs=new CIdxJob[numThreads];
+  GFileMap* fmaps=new GFileMap[numfiles];
+  pthread_t* tids=NULL;
+  GMALLOC(tids, numThreads*sizeof(pthread_t));
+  int fi=0; //next range to index is in this file
+  off_t start=0; //at this offset
+  while (fi<numfiles) {
+    int njobs=0;
+    while (njobs<numThreads && fi<numfiles) {
+      CInputFile& inf=infiles[fi];
+      if (start==0 && (inf.bgzf || !fmaps[fi].open(inf.fd, inf.size))) {
+        if (njobs>0) break; //index the previous ranges first
+        CIdxPipe pipe(numThreads, kstate);
+        pipe.setFile(multiFile ? fi : -1);
+        inf.size=indexFile(inf, kstate, &pipe);
+        pipe.finish();
+        fi++;
+        continue;
+        }
+      CIdxJob& job=jobs[njobs];
+      job.data=fmaps[fi].map;
+      job.fidx=fi;
+      job.start=start;
+      job.end=(inf.size-start>PIDX_RANGE) ?
+              rscan.nextRecStart(job.data, start+PIDX_RANGE, inf.size) : inf.size;
+      job.last=(job.end==inf.size);
+      job.ok=true;
+      job.recbuf.clear();
+      job.ks.reset();
+      job.ks.setFile(multiFile ? fi : -1);
+      if (job.last) { fi++; start=0; }
+        else start=job.end;
+      njobs++;
+      }
+    for (int i=1;i<njobs;i++) {
+      if (pthread_create(&tids[i], NULL, &idxRange, &jobs[i])!=0)
+        GError("Error: failed to create indexing thread!\n");
+      }
+    if (njobs>0) idxRange(&jobs[0]);
+    for (int i=1;i<njobs;i++) pthread_join(tids[i], NULL);
+    for (int i=0;i<njobs;i++) {
+      CIdxJob& job=jobs[i];
+      if (!job.ok) {
+        //range end was not a real record start (can only happen with
+        //unusual FASTQ files): index the rest of this file with one thread
+        kstate.setFile(multiFile ? job.fidx : -1);
+        GFastaScan fscan(record_marker, record_marker_len, fastq, gFastaSeq,
+                         fullDefline, addKeyFunc, &kstate);
+        if (gFastaSeq) fscan.setGeomData(&kstate.geom);
+        fscan.scanRange(job.data, job.start, infiles[job.fidx].size, true);
+        fi=job.fidx+1;
+        start=0;
+        break;
+        }
+      if (cdbidx->addbuf(&job.recbuf)==-1)
+        GError("Error adding cdb records (index too large?)\n");
+      kstate.num_recs+=job.ks.num_recs;
+      kstate.num_keys+=job.ks.num_keys;
+      kstate.num_dups+=job.ks.num_dups;
+      }
+    //drop the mappings (or pages) no longer needed
+    for (int i=0;i<fi && i<numfiles;i++) fmaps[i].unmap();
+    if (fi<numfiles) fmaps[fi].release(start);
+    }
+  GFREE(tids);
+  delete[] fmaps;
+  delete[] jobs;
+}
+#endif
+
+//--append support: records found before this offset were already
+//counted in the existing index
+off_t append_dbsize=0;
+
+void addKeyAppended(char* defline, off_t fpos, uint32 reclen, void* kdata) {
+  CKeyState* ks=(CKeyState*)kdata;
+  int dups=ks->num_dups;
+  addKeyFunc(defline, fpos, reclen, kdata);
+  if (fpos<append_dbsize) {
+    ks->num_recs--;
+    ks->num_dups=dups;
+    }
+}
+
+//read exactly len bytes from a buffered index file
+bool idx_get(GCDBuffer& b, char* buf, unsigned int len) {
+  while (len>0) {
+    int r=b.get(buf, len);
+    if (r<=0) return false;
+    buf+=r;
+    len-=r;
+    }
+  return true;
+}
+
+//update an existing index (oldidx) for a data file which only had data
+//appended since it was indexed: after checking the sampled checksum of the
+//previously indexed data, the old index entries are copied to the new index
+//(except for those of the last indexed record, which may have been extended)
+//and only the data starting with that last record is scanned
+void appendIndex(const char* oldidx, CInputFile& inf, uint32 idxflags,
+                 CKeyState& kstate) {
+  int fd=open(oldidx, O_RDONLY|O_BINARY);
+  if (fd==-1)
+    GError("Error: cannot open index file %s for updating!\n", oldidx);
+  cdbInfo info;
+  if (lseek(fd, -cdbInfoSIZE, SEEK_END)<0 ||
+      read(fd, &info, cdbInfoSIZE)!=cdbInfoSIZE ||
+      (strncmp(info.tag, "CDBX", 4)!=0 && strncmp(info.tag, "CD64", 4)!=0))
+    GError("Error: %s doesn't appear to be a cdbfasta index file!\n", oldidx);
+  bool old64=(strncmp(info.tag, "CD64", 4)==0);
+  uint32 oldflags=gcvt_uint(&info.idxflags);
+  off_t olddbsize=gcvt_offt(&info.dbsize);
+  uint64 oldrecs=gcvt_uint(&info.num_records);
+  int dbnamelen=gcvt_uint(&info.dbnamelen);
+  if ((oldflags & CDBMSK_OPT_DBSUM)==0)
+    GError("Error: index %s has no data checksum, it cannot be updated "
+           "(it must be rebuilt).\n", oldidx);
+  if ((oldflags|CDBMSK_OPT_KSTATS)!=(idxflags|CDBMSK_OPT_KSTATS))
+    GError("Error: the indexing options differ from the ones used for %s\n",
+           oldidx);
+  cdbDbSum dsum;
+  if (lseek(fd, -(off_t)(cdbInfoSIZE+dbnamelen+sizeof(cdbDbSum)), SEEK_END)<0 ||
+      read(fd, &dsum, sizeof(cdbDbSum))!=sizeof(cdbDbSum))
+    GError("Error reading the data checksum from %s\n", oldidx);
+  uint64 oldsum=((uint64)gcvt_uint(&dsum.sum[1])<<32) | gcvt_uint(&dsum.sum[0]);
+  int olddups=0;
+  if (oldflags & CDBMSK_OPT_KSTATS) {
+    cdbKeyStats kst;
+    if (lseek(fd, -(off_t)(cdbInfoSIZE+dbnamelen+sizeof(cdbDbSum)+sizeof(cdbKeyStats)),
+              SEEK_END)<0 || read(fd, &kst, sizeof(cdbKeyStats))!=sizeof(cdbKeyStats))
+      GError("Error reading the key statistics from %s\n", oldidx);
+    olddups=gcvt_uint(&kst.num_dups);
+    }
+  if (old64) { //the 64bit record count, and the same format for the update
+    cdbCounts64 cnt;
+    off_t tail=cdbInfoSIZE+dbnamelen+sizeof(cdbDbSum)+sizeof(cdbCounts64);
+    if (oldflags & CDBMSK_OPT_KSTATS) tail+=sizeof(cdbKeyStats);
+    if (lseek(fd, -tail, SEEK_END)<0 ||
+        read(fd, &cnt, sizeof(cdbCounts64))!=sizeof(cdbCounts64))
+      GError("Error reading the record counts from %s\n", oldidx);
+    oldrecs=gcvt_offt(&cnt.num_records);
+    cdbidx->setFormat64(true);
+    }
+  uint64 sum=0;
+  if (inf.size<olddbsize ||
+      !cdb_samplesum(inf.fd, olddbsize, sum, gcvt_uint(&dsum.samples),
+                     gcvt_uint(&dsum.blocksize)) || sum!=oldsum)
+    GError("Error: the data indexed in %s was changed (not just appended to);\n"
+           " the index must be rebuilt.\n", oldidx);
+  //-- copy the old entries, grouped by record
+  char bufspace[GCDBUFFER_INSIZE];
+  lseek(fd, 0, SEEK_SET);
+  GCDBuffer rbuf((opfunc)&read, fd, bufspace, GCDBUFFER_INSIZE);
+  char num[8];
+  uint64 eod=0;
+  uint32 klen=0, dlen=0;
+  if (!idx_get(rbuf, num, 8)) die_read(oldidx);
+  if (old64) uint64_unpack(num, &eod);
+    else {
+      uint32 eod32;
+      uint32_unpack(num, &eod32);
+      eod=eod32;
+      }
+  uint64 pos=8;
+  while (pos<2048) { //skip the rest of the header
+    if (!idx_get(rbuf, num, 4)) die_read(oldidx);
+    pos+=4;
+    }
+  char* key=NULL;
+  uint32 keycap=MAX_KEYLEN;
+  GMALLOC(key, keycap);
+  char data[MAX_RECDATA];
+  GCdbRecBuf rgroup; //entries for the current record
+  rgroup.setFoldCase(foldIndex);
+  rgroup.setHash(hashVersion);
+  off_t rgpos=-1;
+  uint64 numkept=0;
+  while (pos<eod) {
+    if (!idx_get(rbuf, num, 8)) die_read(oldidx);
+    uint32_unpack(num, &klen);
+    uint32_unpack(num+4, &dlen);
+    if (dlen>MAX_RECDATA || pos+8+klen+dlen>eod)
+      GError("Error: invalid record found in %s\n", oldidx);
+    if (klen>=keycap) {
+      keycap=klen+1;
+      GREALLOC(key, keycap);
+      }
+    if (!idx_get(rbuf, key, klen) || !idx_get(rbuf, data, dlen))
+      die_read(oldidx);
+    pos+=8+klen+dlen;
+    off_t fpos=cdb_idxdata64(dlen) ? gcvt_offt(data) : (off_t)gcvt_uint(data);
+    if (fpos!=rgpos) {
+      if (cdbidx->addbuf(&rgroup)==-1) die_write(ftmp);
+      numkept+=rgroup.getNumEntries();
+      rgroup.clear();
+      rgpos=fpos;
+      }
+    if (rgroup.addrec(key, klen, data, dlen)==-1)
+      GError("Error adding cdb record with key '%s'\n", key);
+    }
+  GFREE(key);
+  close(fd);
+  //-- the data after the last indexed record start is scanned
+  off_t lastpos=(rgpos<0) ? 0 : rgpos;
+  kstate.num_recs=oldrecs;
+  kstate.num_keys=numkept;
+  kstate.num_dups=olddups;
+  append_dbsize=olddbsize;
+  GFastaScan fscan(record_marker, record_marker_len, fastq, gFastaSeq,
+                   fullDefline, &addKeyAppended, &kstate);
+  if (gFastaSeq) fscan.setGeomData(&kstate.geom);
+  GFileMap fmap;
+  if (fmap.open(inf.fd, inf.size))
+    fscan.scanRange(fmap.map, lastpos, inf.size, true);
+  else {
+    if (lseek(inf.fd, lastpos, SEEK_SET)!=lastpos) die_read(inf.name);
+    inf.f=fdopen(inf.fd, "rb");
+    if (inf.f == NULL) die_read(inf.name);
+    inf.fd=-1;
+    fscan.scanFile(inf.f, GREADBUF_SIZE, lastpos);
+    }
+}
 
 //========================== MAIN ===============================
 int main(int argc, char **argv) {
-  FILE* f_read=NULL;
-  off_t fdbsize;
-  int ch;
+  off_t fdbsize=0;
   char* zfilename;
   char* fname;
   char* marker; //record marker
   int maxkeys=0;
   int multikey=0;
+  int numThreads=1;
   record_marker[0]='>';
   record_marker[1]=0;
-  GArgs args(argc, argv, "icvDQCaAmn:o:r:z:w:f:s:d:");
+  GArgs args(argc, argv, "append;cdb64;locators;mph;fpbits=;keyless;hugepages;bgwrite;nosync;hash=iIcvDGQCaAmn:o:r:z:w:f:s:d:p:k:M:B:");
   int e=args.isError();
   if  (e>0)
      GError("%s Invalid argument: %s\n", USAGE, argv[e] );
@@ -524,6 +1370,25 @@ int main(int argc, char **argv) {
     printf("%s\n",VERSION);
     return 0;
     }
+  if (args.getOpt('p')!=NULL) {
+    numThreads=atoi(args.getOpt('p'));
+    if (numThreads<1 || numThreads>MAX_THREADS)
+      GError("Error: invalid -p option (must be a 1..%d value)\n", MAX_THREADS);
+    }
+  double memLimit=0; //GB
+  if (args.getOpt('M')!=NULL) {
+    memLimit=atof(args.getOpt('M'));
+    if (memLimit<=0)
+      GError("Error: invalid -M option (must be a positive value)\n");
+    }
+  double wbufSize=0; //MB
+  if (args.getOpt('B')!=NULL) {
+    wbufSize=atof(args.getOpt('B'));
+    if (wbufSize<=0 || wbufSize>1024)
+      GError("Error: invalid -B option (must be a positive value, at most 1024)\n");
+    }
+  bool bgWrite=(args.getOpt("bgwrite")!=NULL);
+  bool noSync=(args.getOpt("nosync")!=NULL);
   fastq = (args.getOpt('Q')!=NULL);
   gFastaSeq=(args.getOpt('G')!=NULL);
   if (fastq && gFastaSeq)
@@ -538,11 +1403,21 @@ int main(int argc, char **argv) {
     numFields++;
     }
   caseInsensitive = (args.getOpt('i')!=NULL);
+  foldIndex = (args.getOpt('I')!=NULL);
+  if (foldIndex && caseInsensitive)
+    GError("Error: options -i and -I are mutually exclusive.\n");
+  if (args.getOpt("hash")!=NULL) {
+    const char* hname=args.getOpt("hash");
+    if (strcmp(hname, "djb")==0) hashVersion=CDB_HASH_DJB;
+      else if (strcmp(hname, "w64")==0) hashVersion=CDB_HASH_W64;
+      else GError("Error: unknown --hash function (%s), use djb or w64\n", hname);
+    }
   acc_only=(args.getOpt('a')!=NULL);
   acc_mode=(acc_only || args.getOpt('A')!=NULL);
   compact_plus=(args.getOpt('C')!=NULL || acc_mode);
   wordJunk = (char *)args.getOpt('s');
   if (wordJunk==NULL) wordJunk=(char*)defWordJunk;
+  setupKeyChars();
   int compact=(args.getOpt('c')!=NULL || compact_plus);
   if ((compact && multikey) || (multikey && keyDelim)) {
     GError("%s Error: invalid flag combination.\n", USAGE);
@@ -621,6 +1496,15 @@ int main(int argc, char **argv) {
     GMessage("%d\n",fields[numFields-1]);
     exit(0); */
     } //fields
+  const char* kpattern=args.getOpt('k');
+  if (kpattern!=NULL) {
+    if (multikey || compact || keyDelim)
+      GError("%s Error: option -k cannot be used with -m, -n, -f, -c/-C, -a/-A or -D/-d\n",
+             USAGE);
+    const char* perr=keyPattern.compile(kpattern);
+    if (perr!=NULL)
+      GError("Error: invalid key pattern '%s': %s\n", kpattern, perr);
+    }
   if (fastq) {
     record_marker[0]='@';
     record_marker_len=1;
@@ -659,7 +1543,8 @@ int main(int argc, char **argv) {
   FILE* fstopwords=NULL;
   if ((fstopwords=fopen(stopwords, "r"))==NULL)
        GError("Cannot open stop words file '%s'!\n", stopwords);
-  int c=readWords(fstopwords, stopList);
+  readWords(fstopwords, stopList);
+  int c=stopList.build();
   GMessage("Loaded %d stop words.\n", c);
   fclose(fstopwords);
   useStopWords=(c>0);
@@ -679,24 +1564,66 @@ int main(int argc, char **argv) {
   int numfiles = args.startNonOpt();
   if (numfiles==0)
     GError("%sError: no fasta file given.\n", USAGE);
-  fname=(char*) args.nextNonOpt(); //first fasta file given
-  if (do_compress)  { //-------- compression case -------------------
-     if (strcmp(fname, "-")==0 || strcmp(fname, "stdin")==0)
-           f_read=stdin;
-       else f_read= fopen(fname, "rb");
-     if (f_read == NULL) die_read(fname);
-     fname=zfilename; //forget the input file name, keep the output
-     }
-  else {//
-    int fdread= open(fname, O_RDONLY|O_BINARY);
-    if (fdread == -1) die_read(fname);
+  if (numfiles>CDB_MAX_FILES)
+    GError("Error: too many input files (maximum is %d)\n", CDB_MAX_FILES);
+  bool multiFile=(numfiles>1); //one index for all the input files
+  if (multiFile) {
+    if (do_compress)
+      GError("Error: only one input file can be given with -z.\n");
+    if (outfile==NULL)
+      GError("%sError: the index file name (-o) must be given for multiple input files.\n", USAGE);
+    }
+  CInputFile* infiles=NULL;
+  GMALLOC(infiles, numfiles*sizeof(CInputFile));
+  for (int i=0;i<numfiles;i++) {
+    CInputFile& inf=infiles[i];
+    inf.name=(char*) args.nextNonOpt();
+    inf.fd=-1;
+    inf.f=NULL;
+    inf.size=0;
+    inf.isreg=false;
+    inf.bgzf=false;
+    if (strcmp(inf.name, "-")==0 || strcmp(inf.name, "stdin")==0) {
+      //records from a pipe: only the buffered access is possible
+      if (multiFile)
+        GError("Error: stdin input cannot be used with multiple input files.\n");
+      if (outfile==NULL && !do_compress)
+        GError("%sError: the index file name (-o) must be given for stdin input.\n", USAGE);
+      inf.f=stdin;
+      continue;
+      }
+    if (do_compress) {
+      inf.f=fopen(inf.name, "rb");
+      if (inf.f == NULL) die_read(inf.name);
+      continue;
+      }
+    inf.fd=open(inf.name, O_RDONLY|O_BINARY);
+    if (inf.fd == -1) die_read(inf.name);
     struct stat dbstat;
-    fstat(fdread, &dbstat);
-    fdbsize=dbstat.st_size;
-    close(fdread);
-    f_read= fopen(fname, "rb");
-    if (f_read == NULL) die_read(fname);
+    fstat(inf.fd, &dbstat);
+    inf.size=dbstat.st_size;
+    inf.isreg=S_ISREG(dbstat.st_mode);
+    if (inf.isreg) {
+      int ftype=bgzf_filetype(inf.fd);
+      if (ftype==1)
+        GError("Error: %s is gzip compressed but not in BGZF format;\n"
+               " it should be recompressed with bgzip.\n", inf.name);
+      inf.bgzf=(ftype==2);
+      }
+    if (!inf.isreg) {
+      //named pipe or device: use buffered access
+      inf.size=0;
+      inf.f=fdopen(inf.fd, "rb");
+      if (inf.f == NULL) die_read(inf.name);
+      inf.fd=-1;
+      }
     }
+  for (int i=1;i<numfiles;i++)
+    if (infiles[i].bgzf!=infiles[0].bgzf)
+      GError("Error: either all or none of the input files must be BGZF compressed.\n");
+  fname=infiles[0].name; //first fasta file given
+  if (do_compress)
+     fname=zfilename; //forget the input file name, keep the output
 
   char idxfile[365];
   if (outfile==NULL) {
@@ -720,8 +1647,41 @@ int main(int argc, char **argv) {
     strcat(ftmp, "_tmp");
     }
 
+  bool appendMode=(args.getOpt("append")!=NULL);
+  bool keyless=(args.getOpt("keyless")!=NULL);
+  bool mphIndex=(keyless || args.getOpt("mph")!=NULL);
+  int fpBits=16;
+  if (args.getOpt("fpbits")!=NULL) {
+    if (!mphIndex) GError("Error: --fpbits requires --mph\n");
+    fpBits=atoi(args.getOpt("fpbits"));
+    if (fpBits<0 || fpBits>32)
+      GError("Error: invalid --fpbits option (must be a 0..32 value)\n");
+    }
+  if (mphIndex && (gFastaSeq || appendMode || args.getOpt("locators")!=NULL))
+    GError("Error: --mph cannot be used with -G, --append or --locators\n");
+  if (appendMode) {
+    if (multiFile || do_compress || !infiles[0].isreg || infiles[0].bgzf)
+      GError("Error: --append requires a single, uncompressed, regular input file.\n");
+    if (fileExists(idxfile)==0)
+      GError("Error: index file %s not found, it cannot be updated!\n", idxfile);
+    }
   cdbidx=new GCdbWrite(ftmp); //test if this was successful?
-  if (keyDelim>0) {
+  cdbidx->setFoldCase(foldIndex);
+  cdbidx->setHash(hashVersion);
+  cdbidx->setThreads(numThreads);
+  if (args.getOpt("cdb64")!=NULL) cdbidx->setFormat64(true);
+  bool locSlots=(args.getOpt("locators")!=NULL);
+  if (locSlots) cdbidx->setLocSlots(true);
+  if (memLimit>0) cdbidx->setMemLimit((uint64)(memLimit*1073741824.0));
+  if (args.getOpt("hugepages")!=NULL) cdbidx->setHugePages(true);
+  if (wbufSize>0 || bgWrite)
+    cdbidx->setWriteBuffer(wbufSize>0 ? (unsigned int)(wbufSize*1048576.0) : CDB_WRITE_BUF,
+                           bgWrite);
+  if (noSync) cdbidx->setSync(false);
+  if (kpattern!=NULL) {
+     addKeyFunc=&addKeyPattern;
+     }
+  else if (keyDelim>0) {
      addKeyFunc=&addKeyDelim;
      }
    else {
@@ -731,17 +1691,40 @@ int main(int argc, char **argv) {
                addKeyFunc = &addKeyMulti;
           else addKeyFunc = &addKey;
     }
-  off_t recpos=0;
   off_t r=0;
-  unsigned int recsize=0;
-  char* key=NULL;
-  bool fullDefline=(multikey || compact_plus);
-  GReadBuf *readbuf = new GReadBuf(f_read, GREADBUF_SIZE);
+  fullDefline=(multikey || compact_plus || kpattern!=NULL);
+  uint32 idxflags=0;
+  if (multikey) idxflags |= CDBMSK_OPT_MULTI;
+  if (do_compress) idxflags |= CDBMSK_OPT_COMPRESS;
+  if (compact)
+     idxflags |= (compact_plus) ? CDBMSK_OPT_CADD : CDBMSK_OPT_C;
+  if (gFastaSeq) idxflags |= CDBMSK_OPT_GSEQ;
+  if (foldIndex) idxflags |= CDBMSK_OPT_FOLD;
+  idxflags |= (hashVersion << CDBMSK_HASHV_SHIFT);
+  if (locSlots) idxflags |= CDBMSK_OPT_LOCSLOT;
+  if (keyless) {
+    //the keys must be found again in the deflines by cdbyank
+    if (addKeyFunc!=&addKey || caseInsensitive || do_compress)
+      GError("Error: --keyless can only be used for the default keys (without\n"
+             " -m, -n, -f, -c, -C, -a, -A, -D, -d, -k, -i or -z options)\n");
+    idxflags |= CDBMSK_OPT_KEYLESS;
+    }
+  if (infiles[0].bgzf) idxflags |= CDBMSK_OPT_BGZF;
+  if (multiFile) idxflags |= CDBMSK_OPT_MFILE;
+    else if (!do_compress && infiles[0].isreg) idxflags |= CDBMSK_OPT_DBSUM;
+  //multiple keys can be taken from a defline: drop the duplicates
+  keyDedup=(multikey || compact_plus || keyDelim>0 || kpattern!=NULL);
+  if (keyDedup) idxflags |= CDBMSK_OPT_KSTATS;
+  CKeyState kstate(cdbidx);
   if (do_compress) { //---------------- compression case -------------
      if (fastq) GError("Error: sorry, compression is not supported with fastq format\n");
-     //TODO: use a better block compression/indexing scheme with virtual offsets, like bgzf
-     //      -- this should take care of the fastq compression
+     //NOTE: BGZF compressed input files are indexed directly (with virtual
+     //      offsets, see indexBgzf()), which is the better choice for fastq
 #ifdef COMPRESSION_ENABLED
+     GReadBuf *readbuf = new GReadBuf(infiles[0].f, GREADBUF_SIZE);
+     off_t recpos=0;
+     unsigned int recsize=0;
+     char* key=NULL;
      fdbsize=0;
      GCdbz cdbz(zf); // zlib interface
      recpos=cdbz.getZRecPos();
@@ -753,9 +1736,10 @@ int main(int argc, char **argv) {
            if (isspace(key[i])) { key[i]='\0';break; }
            }
          }
-       addKeyFunc(key, recpos, recsize);
+       addKeyFunc(key, recpos, recsize, &kstate);
        recpos = cdbz.getZRecPos();
        }
+     delete readbuf;
      remove(zfilename);
      cdbz.compress_end();
      fclose(zf);
@@ -774,218 +1758,157 @@ int main(int argc, char **argv) {
     GError("Error: this program was not compiled with compression enabled.\n");
 #endif
     }  //compression requested
-  else { // not compressed -- plain (buffered) file access
-     bool defline=false;
-     bool seen_defline=false;
-     int kbufsize=KBUFSIZE;
-     if (fullDefline) { GMALLOC(key, KBUFSIZE); }//large defline storage buffer, just in case
-                 else { GMALLOC(key, 1024); }
-     key[0]=0; //no keys have been parsed yet
-     int kidx=-1;
-     num_recs=0;
-     num_keys=0;
-     char prevch=0;
-     //first iteration -- for the beginning of file
-     if (readbuf->peekCmp(record_marker, record_marker_len)==0) {
-           //new record start found (defline)
-           recpos=readbuf->getPos(); //new record pos
-           defline=true; //we're in defline
-           seen_defline=true;
-           readbuf->skip(record_marker_len);
-           kidx=0;
-           }//new record start
-     int linecounter=0; //number of non-header lines for current record
-     int fq_recloc=(fastq) ? 0 : 4; //0=seq header line, 1=sequence string, 2=q-header line, 3=qvstring, 4=not fastq
-     int fq_lendata[4]={0,0,0,0}; //keep track of fastq seq len, qv len
-     int last_linelen=0; //length of last non-header line in a FASTA record
-     int first_linelen=0; //length of the first non-header line in a FASTA record
-     int last_eol_len=0;
-     bool mustbeLastLine=false;
-     bool wasEOL=false;
-     while ((ch=readbuf->getch())>0) {
-        bool isEOL=false;
-        if (ch=='\n' || ch=='\r') {
-           isEOL=true;
-           last_eol_len=1;
-           }
-        if (wasEOL && isEOL) {
-           //skipped double-char EoL (DOS or empty lines)
-           if (prevch=='\n' && ch=='\r') last_eol_len=2;
-           prevch=ch;
-           wasEOL=isEOL;
-           continue;
-           }
-        if (defline) {
-           // ===> in the header line (including its EOL)
-           if (isEOL) {
-              // --> end of header line
-              if (kidx>=0) { key[kidx]=0;kidx=-1; }
-              defline=false;
-              last_linelen=0;
-              first_linelen=0;
-              linecounter=0;
-              fq_recloc= (fastq) ? 0 : 4;
-              mustbeLastLine=false;
-              memset((void*)fq_lendata, 0, 4*sizeof(int));
-              prevch=ch;
-              wasEOL=isEOL;
-              continue;
-              }
-             else {
-              // --> within header, before EOL
-              if (kidx>=0) { //still parsing keys
-                if ((isspace(ch) || ch<31)
-                           && fullDefline==false) {
-                       key[kidx]=0;
-                       kidx=-1;
-                       wasEOL=false;
-                       prevch=ch;
-                       continue;
-                       }
-                key[kidx]=(char)ch;
-                kidx++;
-                if (kidx>=kbufsize) {
-                  kbufsize+=KBUFSIZE;
-                  GREALLOC(key, kbufsize);
-                  }
-                } //still parsing keys
-               } // <-- before EoL
-           } // <=== in the header line
-          else {
-           // ===> not in header line (could be "sequence block", or before first defline
-           if (isEOL) {
-              // <-- at EoL in "sequence" block (record body)
-              if (seen_defline) {
-                 linecounter++; //counting sequence lines
-                 if (gFastaSeq && linecounter>1) {
-                        if (last_linelen>first_linelen)
-                                 die_gseqformat(key);
-                        if (last_linelen<first_linelen)
-                                 mustbeLastLine=true;
-                        }
-                 }
-              } // --> at EoL
-             else {
-              // <-- before EoL
-              // could be a new header, should we check?
-              if (wasEOL) {
-                 // - start of a new line
-                 bool newRecStart=false;
-                 bool checkNewRec = (!fastq || fq_lendata[1]<=fq_lendata[3]);
-                 if (checkNewRec && ch==record_marker[0]) {
-                     newRecStart=(record_marker_len>1) ?
-                           (readbuf->peekCmp(&record_marker[1], record_marker_len-1)==0) :
-                           true;
-                     if (newRecStart) {
-                       // new record start (new header line coming up)
-                       seen_defline=true;
-                       recsize = readbuf->getPos()-recpos-1-last_eol_len; //previous recsize
-                       if (recsize>(off_t)(record_marker_len+1) && key[0]!='\0') {
-                           //add previous record
-                           //TODO: validate gFastaSeq or fastq here?
-                           if (fastq && fq_lendata[1]!=fq_lendata[3])
-                                    die_fastqformat(key, fq_lendata[1], fq_lendata[3]);
-                           addKeyFunc(key, recpos, recsize);
-                           }
-                       recpos=readbuf->getPos()-1; //new record pos (after reading this EOL)
-                       if (record_marker_len>1)
-                          readbuf->skip(record_marker_len-1); //skip past the record marker
-                       defline=true; //we'll be in the header line in the next iteration
-                       linecounter=0;
-                       mustbeLastLine=false;
-                       kidx=0; //reset keys
-                       prevch=record_marker[record_marker_len-1];
-                       wasEOL=(prevch=='\n' || prevch=='\r');
-                       continue;
-                       } // new record start
-                   } //checking for new record start (record_marker match)
-                 if (!seen_defline) {
-                   prevch=ch;
-                   wasEOL=isEOL;
-                   continue;
-                   }
-                 if (mustbeLastLine && !newRecStart)
-                     die_gseqformat(key);
-                 // start of a new line in the "sequence" block
-                 last_linelen=0;
-                 mustbeLastLine=false;
-                 if (fq_recloc<4) {
-                   //take care of multi-line fastq parsing
-                   if (fq_recloc==1 && ch=='+') {
-                      fq_recloc=2; //q-header line
-                      }
-                     else if (fq_recloc==0 || fq_recloc==2) fq_recloc++;
-                   } //fastq parsing
-                 } // - start of a new non-header line (wasEoL)
-              if (!seen_defline) {
-                   prevch=ch;
-                   wasEOL=isEOL;
-                   continue;
-                   }
-              if (fq_recloc<4) {
-                 fq_lendata[fq_recloc]++;
-                 }
-              last_linelen++;
-              if (linecounter==0) first_linelen++;
-              } // --> record body, before EoL
-           } // <=== not in header line
-
-        prevch=ch;
-        wasEOL=isEOL;
-        }//while getch
-     recsize=readbuf->getPos()-recpos;
-     if (recsize>0) {//add last record, if there
-         if (prevch=='\n' || prevch=='\r') recsize-=last_eol_len;
-         if (fullDefline && kidx>0) {//close the defline string
-               if (prevch!='\n' && prevch!='\r') kidx++;
-               key[kidx-1]='\0';
-               }
-         addKeyFunc(key, recpos, recsize);
-         linecounter=0;
-         //GMessage("adding key=%s\n",key);
-         }
-   delete readbuf;
-   }
-  if (f_read!=stdin) fclose(f_read);
-  if (cdbidx->finish() == -1) die_write("");
+  else { // not compressed -- memory mapped or plain (buffered) file access
+     if (appendMode)
+       appendIndex(idxfile, infiles[0], idxflags, kstate);
+     else
+#ifndef __WIN32__
+     if (numThreads>1 && (multiFile || infiles[0].size>PIDX_RANGE))
+       parallelIndex(infiles, numfiles, multiFile, numThreads, kstate);
+     else if (numThreads>1) { //a single file which cannot be split (e.g. stdin)
+       CIdxPipe pipe(numThreads, kstate);
+       pipe.setFile(-1);
+       infiles[0].size=indexFile(infiles[0], kstate, &pipe);
+       pipe.finish();
+       }
+     else
+#endif
+     for (int i=0;i<numfiles;i++) {
+       kstate.setFile(multiFile ? i : -1);
+       infiles[i].size=indexFile(infiles[i], kstate);
+       }
+     for (int i=0;i<numfiles;i++)
+       fdbsize+=infiles[i].size;
+     }
+  uint64 sum=0; //sampled checksum of the data file
+  if (idxflags & CDBMSK_OPT_DBSUM) {
+    CInputFile& inf=infiles[0];
+    int dfd=(inf.fd>=0) ? inf.fd : fileno(inf.f);
+    if (!cdb_samplesum(dfd, inf.size, sum)) die_read(inf.name);
+    }
+  for (int i=0;i<numfiles;i++) {
+    if (infiles[i].f!=NULL && infiles[i].f!=stdin) fclose(infiles[i].f);
+    if (infiles[i].fd>=0) close(infiles[i].fd);
+    }
+  num_recs=kstate.num_recs;
+  num_keys=kstate.num_keys;
+  int ofd=cdbidx->getfd(); //the index file descriptor
+  char fmph[380];
+  if (mphIndex) {
+    //the minimal perfect hash index is built from the cdb records written
+    //so far, into a new file (without the cdb hash tables)
+    if (cdbidx->sync() == -1) die_write("");
+    GCdbMphWrite mphw(fpBits, foldIndex, multiFile);
+    if (keyless) mphw.setKeyOffset(record_marker_len);
+    if (mphw.addRecords(cdbidx->getfd(), 2048, cdbidx->recordsEnd()) == -1)
+      die_read(ftmp);
+    sprintf(fmph, "%s_mph", ftmp);
+    ofd=open(fmph, O_RDWR|O_CREAT|O_TRUNC|O_BINARY, 0664);
+    if (ofd == -1) die_write(fmph);
+    if (mphw.write(ofd) == -1) die_write(fmph);
+    }
+  else if (cdbidx->finish() == -1) die_write("");
 
   // === add some statistics at the end of the cdb index file!
-  r=lseek(cdbidx->getfd(), 0, SEEK_END);
+  r=lseek(ofd, 0, SEEK_END);
   cdbInfo info;
-  memcpy((void*)info.tag, (void*)"CDBX", 4);
-  info.idxflags=0;
-  if (multikey) info.idxflags |= CDBMSK_OPT_MULTI;
-  if (do_compress) {
-      info.idxflags |= CDBMSK_OPT_COMPRESS;
+  memcpy((void*)info.tag, (void*)(mphIndex ? "CMPH" :
+                 (cdbidx->isFormat64() ? "CD64" : "CDBX")), 4);
+  info.idxflags=idxflags;
+  if (do_compress)
       GMessage("Input data were compressed into file '%s'\n",fname);
-      }
-  if (compact) {
-      if (compact_plus)
-            info.idxflags |= CDBMSK_OPT_CADD;
-         else
-            info.idxflags |= CDBMSK_OPT_C;
+  if (mphIndex || cdbidx->isFormat64()) {
+     cdbCounts64 cnt;
+     cnt.num_keys=num_keys;
+     cnt.num_keys=gcvt_offt(&cnt.num_keys);
+     cnt.num_records=num_recs;
+     cnt.num_records=gcvt_offt(&cnt.num_records);
+     if (write(ofd, &cnt, sizeof(cdbCounts64))!=sizeof(cdbCounts64))
+       GError(ERR_W_DBSTAT);
      }
-  if (gFastaSeq) {
-     info.idxflags |= CDBMSK_OPT_GSEQ;
+  if (idxflags & CDBMSK_OPT_KSTATS) {
+     cdbKeyStats kst;
+     kst.num_dups=gcvt_uint(&kstate.num_dups);
+     kst.reserved=0;
+     if (write(ofd, &kst, sizeof(cdbKeyStats))!=sizeof(cdbKeyStats))
+       GError(ERR_W_DBSTAT);
+     }
+  if (idxflags & CDBMSK_OPT_DBSUM) {
+     //write the sampled checksum of the data file
+     cdbDbSum dsum;
+     uint32 v=(uint32)(sum & 0xffffffffULL);
+     dsum.sum[0]=gcvt_uint(&v);
+     v=(uint32)(sum>>32);
+     dsum.sum[1]=gcvt_uint(&v);
+     v=CDB_SUM_SAMPLES;
+     dsum.samples=gcvt_uint(&v);
+     v=CDB_SUM_BLOCK;
+     dsum.blocksize=gcvt_uint(&v);
+     if (write(ofd, &dsum, sizeof(cdbDbSum))!=sizeof(cdbDbSum))
+       GError(ERR_W_DBSTAT);
      }
-  info.num_records=gcvt_uint(&num_recs);
-  info.num_keys=gcvt_uint(&num_keys);
+  if (multiFile) {
+     //write the file table
+     cdbFileTail ftail;
+     uint32 tablelen=sizeof(cdbFileTail);
+     for (int i=0;i<numfiles;i++) {
+       int64_t fsize=infiles[i].size;
+       fsize=gcvt_offt(&fsize);
+       uint32 flen=strlen(infiles[i].name);
+       tablelen+=sizeof(int64_t)+sizeof(uint32)+flen;
+       uint32 v=gcvt_uint(&flen);
+       if (write(ofd, &fsize, sizeof(int64_t))!=sizeof(int64_t) ||
+           write(ofd, &v, sizeof(uint32))!=sizeof(uint32) ||
+           write(ofd, infiles[i].name, flen)!=(ssize_t)flen)
+         GError(ERR_W_DBSTAT);
+       }
+     ftail.numfiles=gcvt_uint(&numfiles);
+     ftail.tablelen=gcvt_uint(&tablelen);
+     if (write(ofd, &ftail, sizeof(cdbFileTail))!=sizeof(cdbFileTail))
+       GError(ERR_W_DBSTAT);
+     }
+  //the 32bit counts are capped (see cdbCounts64 for the 64bit index)
+  uint32 v=(num_recs>MAX_UINT) ? MAX_UINT : (uint32)num_recs;
+  info.num_records=gcvt_uint(&v);
+  v=(num_keys>MAX_UINT) ? MAX_UINT : (uint32)num_keys;
+  info.num_keys=gcvt_uint(&v);
   info.dbsize=gcvt_offt(&fdbsize);
   info.idxflags=gcvt_uint(&info.idxflags);
   int nlen=strlen(fname);
   info.dbnamelen=gcvt_uint(&nlen);
-  r=write(cdbidx->getfd(), fname, nlen);
+  r=write(ofd, fname, nlen);
   if (r!=nlen)
         GError(ERR_W_DBSTAT);
-  r=write(cdbidx->getfd(), &info, cdbInfoSIZE);
+  r=write(ofd, &info, cdbInfoSIZE);
   if (r!=cdbInfoSIZE)
         GError(ERR_W_DBSTAT);
+  uint64 peakMem=cdbidx->getPeakMem();
+  uint64 wbytes=0;
+  double wsecs=0;
+  cdbidx->getWriteStats(wbytes, wsecs);
   delete cdbidx;
-  GFREE(key);
+  if (mphIndex) {
+    if ((!noSync && fsync(ofd) == -1) || close(ofd) == -1) die_write(fmph);
+    remove(ftmp);
+    }
+  const char* fout=mphIndex ? fmph : ftmp;
   remove(idxfile);
-  if (rename(ftmp,idxfile) == -1)
-    GError("Error: unable to rename %s to %s",ftmp,idxfile);
-  GMessage("%d entries from file %s were indexed in file %s\n",
-      num_recs, fname, idxfile);
+  if (rename(fout,idxfile) == -1)
+    GError("Error: unable to rename %s to %s",fout,idxfile);
+  if (multiFile)
+    GMessage("%llu entries from %d files were indexed in file %s\n",
+      (unsigned long long)num_recs, numfiles, idxfile);
+  else
+    GMessage("%llu entries from file %s were indexed in file %s\n",
+      (unsigned long long)num_recs, fname, idxfile);
+  if (memLimit>0)
+    GMessage("Peak memory used for the index hash tables: %.1f MB\n",
+      peakMem/1048576.0);
+  if (wbufSize>0 || bgWrite || noSync) {
+    if (wsecs<=0) wsecs=1e-6;
+    GMessage("Index write: %.1f MB in %.3fs (%.1f MB/s)\n", wbytes/1048576.0,
+      wsecs, wbytes/1048576.0/wsecs);
+    }
+  GFREE(infiles);
   return 0;
 }
@@ -1,5 +1,6 @@
 #include "GBase.h"
 #include "gcdb.h"
+#include "gbgzf.h"
 #include "GArgs.h"
 #include "ctype.h"
 #include <fcntl.h>
@@ -21,7 +22,7 @@ const char err_COMPRESSION[]="Error: compression requested but not compiled in!\
 
 #define USAGE "Usage:\n\
   cdbyank <index_file> [-d <fasta_file>] [-a <key>|-n|-l|-s]\n\
-      [-o <outfile>] [-q <char>|-Q][-F] [-R] [-P] [-x] [-w] \n\
+      [-o <outfile>] [-q <char>|-Q][-F] [-R] [-P] [-x] [-w] [-K]\n\
       [-z <dbfasta.cdbz>\n\n\
     <index_file> is the index file created previously with cdbfasta\n\
        (usually having a \".cidx\" suffix)\n\
@@ -31,35 +32,42 @@ const char err_COMPRESSION[]="Error: compression requested but not compiled in!\
     -d <fasta_file> is the fasta file to pull records from; \n\
        if not specified, cdbyank will look in the same directory\n\
        where <index_file> resides, for a file with the same name\n\
-       but without the \".cidx\" suffix\n\
+       but without the \".cidx\" suffix; for an index built for multiple\n\
+       files, this is the directory where these files are\n\
     -o the records found are written to file <outfile> instead of stdout\n\
     -x allows retrieval of multiple records per key, if the indexed \n\
        database had records with the same key (non-unique keys);\n\
        (without -x only one record for a given key is retrieved)\n\
     -i case insensitive query (expects the <index_file> to have been \n\
-       created with cdbfasta -i option)\n\
+       created with cdbfasta -i or -I option)\n\
+    -K for an index created with cdbfasta --locators: take a key as found\n\
+       when its 64bit hash matches, without reading the key stored in the\n\
+       index (faster, especially with cold caches)\n\
     -Q output the query key surrounded by character '%' before the\n\
        corresponding record\n\
     -q same as -Q but use character <char> instead of '%'\n\
     -w enable warnings (sent to stderr) when a key is not found\n\
     -F pulls only the defline for each record (discard the sequence)\n\
     -P only displays the position(s) (file offset) within the \n\
-       database file, for the requested record(s)\n\
+       database file, for the requested record(s) (for BGZF compressed\n\
+       files these are virtual offsets)\n\
     -R sequence range extraction: expects the input <key(s)> to have \n\
        the format: '<seq_name> <start> <end>'\n\
-       and pulls only the specified sequence range\n\
+       and pulls only the specified sequence range; for an index built\n\
+       with cdbfasta -G only the range itself is read from the database\n\
     -z decompress the entire file <dbfasta.cdbz>\n\
        (assumes it was built using cdbfasta with '-z' option)\n\
     -v show version number and exit\n\
     \n\
     Index file statistics (no database file needed):\n\
     -n display the number of records indexed\n\
-    -l list all keys stored in <index_file>\n\
+    -l list all keys stored in <index_file> (for a keyless index, built\n\
+       with cdbfasta --keyless, the keys are read from the database)\n\
     -s display indexing summary info\n\n"
 
 /*
-    -E same as -R but assumes FASTA records have a fixed line length\n\
-       (faster extraction of distant ranges for long records)\n\
+    -E same as -R (the line length of each record is now taken from\n\
+       the index, if it was built with cdbfasta -G)\n\
 */
 
 #define ERR_READ "cdbyank: error reading from file.\n"
@@ -83,11 +91,15 @@ bool rec_pos_only=false;
 bool use_range=false;
 bool fixed_linelen=false;
 bool caseInsensitive=false;
+bool folded_idx=false; //case-folded index (cdbfasta -I)
 bool showQuery=false;
 char delimQuery='%';
-uint32 irec_size32=8; //default size of the index record for records with 32bit offsets
+bool multi_file=false; //index built for multiple database files
+bool keyless_idx=false; //keys verified against the deflines (cdbfasta --keyless)
+uint32 key_offset=0; //offset of the key in the records of a keyless index
 
 off_t lastfpos=-1; //to avoid pulling the same record twice in a row..
+int lastfid=-1;
 
 FILE* fout=NULL;
 GCdbRead* cdb=NULL;
@@ -96,13 +108,32 @@ GCdbRead* cdb=NULL;
 #endif
 int fdb=-1;
 FILE* fz=NULL;
+bool bgzf_db=false; //BGZF compressed database file(s), virtual offsets stored
+GBgzfReader* dbbgz=NULL; //BGZF reader for fdb
+
+//database files of a multi-file index; they are opened when first needed
+//and at most MAX_OPEN_DBFILES of them are kept open
+#define MAX_OPEN_DBFILES 64
+struct CDbFile {
+  char* name; //file name as stored in the index
+  off_t size; //file size at indexing time
+  int fd;
+  GBgzfReader* bgz; //for BGZF compressed files
+  uint32 lastuse; //for closing the least recently used file
+};
+CDbFile* dbfiles=NULL;
+int num_dbfiles=0;
+int num_open_dbfiles=0;
+uint32 dbfiles_clock=0;
+char* dbfiles_dir=NULL; //-d directory where the database files are
+int dbfile_fd(int fid);
 
 void inplace_Lower(char* c) {
  char *p=c;
  while (*p!='\0') { *p=tolower(*p);p++; }
 }
 
-void buf_get(GCDBuffer* b, uint32& pos, char *buf, unsigned int len) {
+void buf_get(GCDBuffer* b, uint64& pos, char *buf, unsigned int len) {
   int r;
   while (len > 0) {
     r = b->get(buf,len);
@@ -115,16 +146,132 @@ void buf_get(GCDBuffer* b, uint32& pos, char *buf, unsigned int len) {
     }
 }
 
-void buf_getnum(GCDBuffer* b, uint32& pos, uint32 *num) {
+void buf_getnum(GCDBuffer* b, uint64& pos, uint32 *num) {
   char buf[4];
   buf_get(b, pos, buf, 4);
   uint32_unpack(buf,num);
 }
 
+void buf_getnum64(GCDBuffer* b, uint64& pos, uint64 *num) {
+  char buf[8];
+  buf_get(b, pos, buf, 8);
+  uint64_unpack(buf,num);
+}
+
+
+void print_pos(int fid, off_t fpos) {
+  if (fid>=0) fprintf(fout, "%s\t%lld\n", dbfiles[fid].name, (long long)fpos);
+         else fprintf(fout, "%lld\n", (long long)fpos);
+}
+
+//database file access: fpos is a file offset, or a virtual offset
+//for BGZF compressed files (bgz!=NULL)
+void db_seek(int dbfd, GBgzfReader* bgz, off_t fpos) {
+  if (bgz!=NULL) bgz->seek((uint64)fpos);
+    else lseek(dbfd, fpos, SEEK_SET);
+}
+
+int db_get(int dbfd, GBgzfReader* bgz, char* buf, int len) {
+  return (bgz!=NULL) ? bgz->read(buf, len) : read(dbfd, buf, len);
+}
+
+//skip n bytes of (uncompressed) data
+void db_skip(int dbfd, GBgzfReader* bgz, off_t n) {
+  if (bgz!=NULL) bgz->skip((uint64)n);
+    else lseek(dbfd, n, SEEK_CUR);
+}
+
+//read exactly len bytes from the current database file position
+void db_read(int dbfd, GBgzfReader* bgz, const char* dbname, char* buf, uint32 len) {
+  while (len>0) {
+    int r=db_get(dbfd, bgz, buf, len);
+    if (r<=0)
+      GError("cdbyank: Error reading from database file [%s] for %s (returned %d) !\n",
+              dbname, idxfile, r);
+    buf+=r;
+    len-=r;
+    }
+}
+
+//range extraction for records indexed with cdbfasta -G: the file offsets
+//of the range are computed from the sequence layout stored in the index
+//so only the defline and the range itself are read from the database
+void print_seqrange(int dbfd, GBgzfReader* bgz, const char* dbname, off_t fpos,
+                    uint32 deflen, uint32 seqlen, uint32 linelen, int elen,
+                    int r_start, int r_end) {
+  char* buf=NULL;
+  GMALLOC(buf, deflen+1);
+  db_seek(dbfd, bgz, fpos);
+  db_read(dbfd, bgz, dbname, buf, deflen);
+  buf[deflen]='\0';
+  fprintf(fout, "%s\n", buf); //output the defline
+  GFREE(buf);
+  uint32 rend=(r_end<=0 || (uint32)r_end>seqlen) ? seqlen : (uint32)r_end;
+  if ((uint32)r_start>rend) return;
+  //record offsets of the first and last base of the range
+  off_t seqstart=deflen+elen;
+  off_t lw=(off_t)linelen+elen;
+  off_t bstart=seqstart+((r_start-1)/linelen)*lw+(r_start-1)%linelen;
+  off_t bend=seqstart+((rend-1)/linelen)*lw+(rend-1)%linelen+1;
+  db_skip(dbfd, bgz, bstart-deflen);
+  off_t toread=bend-bstart;
+  uint32 bufsize=(toread<MAX_MEM_RECSIZE) ? (uint32)toread : MAX_MEM_RECSIZE;
+  GMALLOC(buf, bufsize);
+  char linebuf[61];
+  int outlen=0;
+  while (toread>0) {
+    uint32 chunk=(toread<bufsize) ? (uint32)toread : bufsize;
+    db_read(dbfd, bgz, dbname, buf, chunk);
+    for (uint32 i=0;i<chunk;i++) {
+      if (buf[i]=='\n' || buf[i]=='\r') continue;
+      linebuf[outlen++]=buf[i];
+      if (outlen==60) {
+        linebuf[outlen]='\0';
+        fprintf(fout, "%s\n", linebuf);
+        outlen=0;
+        }
+      }
+    toread-=chunk;
+    }
+  if (outlen>0) {
+    linebuf[outlen]='\0';
+    fprintf(fout, "%s\n", linebuf);
+    }
+  GFREE(buf);
+}
+
+//keyless index: the key of the record at fpos is the first token of
+//its defline; returns a pointer into kbuf, and the key length in klen
+#define RECKEY_BUFSIZE 4096
+char* read_reckey(int dbfd, GBgzfReader* bgz, off_t fpos, uint32 reclen,
+                  char* kbuf, int& klen) {
+  uint32 n=(reclen<RECKEY_BUFSIZE) ? reclen : RECKEY_BUFSIZE;
+  uint32 len=0;
+  db_seek(dbfd, bgz, fpos);
+  while (len<n) {
+    int r=db_get(dbfd, bgz, kbuf+len, n-len);
+    if (r<=0) break;
+    len+=r;
+    }
+  uint32 e=key_offset;
+  while (e<len && !isspace((uchar)kbuf[e]) && (uchar)kbuf[e]>=31) e++;
+  klen=(e>key_offset) ? e-key_offset : 0;
+  return kbuf+key_offset;
+}
+
+bool reckey_match(const char* key, int keylen, const char* rkey, int rklen) {
+  if (keylen!=rklen) return false;
+  if (folded_idx && caseInsensitive) {
+    for (int i=0;i<keylen;i++)
+      if (cdb_lower(key[i])!=cdb_lower(rkey[i])) return false;
+    return true;
+    }
+  return (memcmp(key, rkey, keylen)==0);
+}
 
 int fetch_record(char* key, char* dbname, int many, int r_start=0, int r_end=0) {
 //assumes fdb is open, cdb was created on the index file
- if (caseInsensitive) inplace_Lower(key);
+ if (caseInsensitive && !folded_idx) inplace_Lower(key);
  int r=cdb->find(key);
  if (r==0 && warnings) {
    GMessage("cdbyank: key \"%s\" not found in %s\n", key, idxfile);
@@ -133,52 +280,75 @@ int fetch_record(char* key, char* dbname, int many, int r_start=0, int r_end=0)
  if (r==-1)
    GError("cdbyank: error searching for key %s in %s\n", key, idxfile);
  char* mbuf=NULL; //memory buffer for reading records
+ int keylen=strlen(key);
+ bool found=false;
  while (r>0) {
-   off_t pos = cdb->datapos(); //position of this key's record in the index file
    unsigned int len=cdb->datalen(); // length of this key's record
    char bbuf[64]; // data buffer -- should just accomodate fastarec_pos, fastarec_length
-   if (cdb->read(bbuf,len,pos) == -1)
+   if (cdb->getdata(bbuf) == -1)
        GError("cdbyank: error at GCbd::read (%s)!\n", idxfile);
 
    off_t fpos; //this will be the fastadb offset
    uint32 reclen;  //this will be the fasta record offset
-   //int16_t linelen=0; //for genomic sequences, length of FASTA line
-   //byte elen=0; //size of end-of-line delimiter
-   if (len>irec_size32) { //64 bit file offset was used
+   int fid=-1; //database file index, for multi-file indexes
+   //sequence layout, for records indexed with cdbfasta -G
+   uint32 deflen=0, seqlen=0, linelen=0;
+   int elen=0;
+   int rlen=len; //record data length, without the file index
+   if (multi_file) {
+     rlen-=sizeof(int16_t);
+     fid=(uint16_t)gcvt_int16(&bbuf[rlen]);
+     }
+   if (cdb_idxdata64(rlen)) { //64 bit file offset was used
      fpos=gcvt_offt(bbuf);
-     if (rec_pos_only) {
-       fprintf(fout, "%lld\n", (long long)fpos);
-       return 1;
-       }
      reclen=gcvt_uint(&bbuf[offsetof(CIdxData, reclen)]);
-     /*
-     if (has_gseqs) {
-       linelen=gcvt_int16(&bbuf[offsetof(CIdxSeqData, linelen)]);
-       elen=bbuf[offsetof(CIdxSeqData, elen)];
+     if (rlen==IdxSeqDataSIZE) {
+       deflen=gcvt_uint(&bbuf[offsetof(CIdxSeqData, deflen)]);
+       seqlen=gcvt_uint(&bbuf[offsetof(CIdxSeqData, seqlen)]);
+       linelen=gcvt_uint(&bbuf[offsetof(CIdxSeqData, linelen)]);
+       elen=(byte)bbuf[offsetof(CIdxSeqData, elen)];
        }
-     */
      }
    else { //32bit offset used
      fpos=gcvt_uint(bbuf);
-     if (rec_pos_only) {
-       fprintf(fout, "%lld\n", (long long)fpos);
-       return 1;
-       }
      reclen=gcvt_uint(&bbuf[offsetof(CIdxData32, reclen)]);
-     /*
-     if (has_gseqs) {
-       linelen=gcvt_int16(&bbuf[offsetof(CIdxSeqData32, linelen)]);
-       elen=bbuf[offsetof(CIdxSeqData32, elen)];
+     if (rlen==IdxSeqDataSIZE32) {
+       deflen=gcvt_uint(&bbuf[offsetof(CIdxSeqData32, deflen)]);
+       seqlen=gcvt_uint(&bbuf[offsetof(CIdxSeqData32, seqlen)]);
+       linelen=gcvt_uint(&bbuf[offsetof(CIdxSeqData32, linelen)]);
+       elen=(byte)bbuf[offsetof(CIdxSeqData32, elen)];
        }
-     */
+     }
+   int dbfd=fdb;
+   GBgzfReader* bgz=dbbgz;
+   if (fid>=0) {
+     dbfd=dbfile_fd(fid);
+     bgz=dbfiles[fid].bgz;
+     dbname=dbfiles[fid].name;
+     }
+   if (keyless_idx) {
+     //the key is not stored in the index: check the record's defline
+     char kbuf[RECKEY_BUFSIZE];
+     int rklen=0;
+     char* rkey=read_reckey(dbfd, bgz, fpos, reclen, kbuf, rklen);
+     if (!reckey_match(key, keylen, rkey, rklen)) {
+       r=cdb->findnext(key, keylen); //a fingerprint collision
+       continue;
+       }
+     }
+   found=true;
+   if (rec_pos_only) {
+     print_pos(fid, fpos);
+     return 1;
      }
    //GMessage("reclen=%d\n", reclen);
-   if (fpos == lastfpos) {
+   if (fpos == lastfpos && fid == lastfid) {
       if (many) r=cdb->findnext(key, strlen(key));
            else r=0;
       continue;
    }
    lastfpos=fpos;
+   lastfid=fid;
    if (showQuery)
     fprintf(fout, "%c%s%c\t", delimQuery, key, delimQuery);
    if (is_compressed) {
@@ -190,13 +360,21 @@ int fetch_record(char* key, char* dbname, int many, int r_start=0, int r_end=0)
      #endif
      continue;
    }
+   if (use_range && r_start>0 && linelen>0) {
+     //the exact location of the range is known
+     print_seqrange(dbfd, bgz, dbname, fpos, deflen, seqlen, linelen, elen,
+                    r_start, r_end);
+     if (many) r=cdb->findnext(key, strlen(key));
+          else r=0;
+     continue;
+     }
    if (mbuf==NULL) {
 	   GMALLOC(mbuf, MAX_MEM_RECSIZE);
    }
-   lseek(fdb, fpos, SEEK_SET);
+   db_seek(dbfd, bgz, fpos);
    if (reclen<MAX_MEM_RECSIZE) {
        //errno=0;
-       r=read(fdb, mbuf, reclen);
+       r=db_get(dbfd, bgz, mbuf, reclen);
        if (r<=0)
           GError("cdbyank: Error reading from database file [%s] for %s (returned %d, offset %d) !\n",
                   dbname, idxfile, r, fpos);
@@ -253,9 +431,9 @@ int fetch_record(char* key, char* dbname, int many, int r_start=0, int r_end=0)
      if (defline_only || use_range) {
 		 if (defline_only) {
 			  reclen--;
-			  read(fdb, &c, 1);
+			  db_get(dbfd, bgz, &c, 1);
 		 }
-		 while (reclen-- && read(fdb, &c, 1)==1) {
+		 while (reclen-- && db_get(dbfd, bgz, &c, 1)==1) {
 		   fprintf(fout, "%c", c);
 		   if (c=='\n') break;
 		 }
@@ -263,7 +441,7 @@ int fetch_record(char* key, char* dbname, int many, int r_start=0, int r_end=0)
 		 if (!defline_only) {
 			 int seqpos=1;
 			 if (use_range) {
-				 while (reclen-- && read(fdb, &c, 1)==1 && seqpos<=r_end) {
+				 while (reclen-- && db_get(dbfd, bgz, &c, 1)==1 && seqpos<=r_end) {
 					 if (isspace(c)) continue;
 					 if (seqpos>=r_start) {
 						 int written=seqpos-r_start;
@@ -275,7 +453,7 @@ int fetch_record(char* key, char* dbname, int many, int r_start=0, int r_end=0)
 				 }//while
 			 } //range case
 			 else { //no range, just copy all chars to output
-				 while (reclen-- && read(fdb, &c, 1)==1) {
+				 while (reclen-- && db_get(dbfd, bgz, &c, 1)==1) {
 					 fprintf(fout, "%c", c);
 				 }
 			 }
@@ -285,7 +463,7 @@ int fetch_record(char* key, char* dbname, int many, int r_start=0, int r_end=0)
     	 uint toread=MAX_MEM_RECSIZE-1;
     	 uint rleft=reclen;
     	 while (rleft>0) {
-    		 r=read(fdb, mbuf, toread);
+    		 r=db_get(dbfd, bgz, mbuf, toread);
     		 if (r<=0)
     			 GError("cdbyank: Error reading from database file [%s] for %s (returned %d, offset %d) !\n",
     				 dbname, idxfile, r, fpos);
@@ -303,6 +481,11 @@ int fetch_record(char* key, char* dbname, int many, int r_start=0, int r_end=0)
         else r=0;
  } //for each matching record
  GFREE(mbuf);
+ if (keyless_idx && !found) { //only fingerprint collisions were found
+   if (warnings)
+     GMessage("cdbyank: key \"%s\" not found in %s\n", key, idxfile);
+   return 0;
+   }
  return 1;
 }
 
@@ -326,11 +509,13 @@ int read_dbinfo(int fd, char** fnameptr, cdbInfo& dbstat) {
             //GMessage("dbnamelen=%d\n", dbstat.dbnamelen);
             lseek(fd, -(off_t)(cdbInfoSIZE-4+dbstat.dbnamelen), SEEK_END);
             }
-          else if (strncmp(dbstat.tag, "CDBX", 4)!=0) {
+          else if (strncmp(dbstat.tag, "CDBX", 4)!=0 &&
+                   strncmp(dbstat.tag, "CD64", 4)!=0 &&
+                   strncmp(dbstat.tag, "CMPH", 4)!=0) {
             GMessage("Error: this doesn't appear to be a cdbfasta created file!\n");
             return 1;
             }
-           else { // new CDBX type:
+           else { // new CDBX type (or CD64, 64bit index, or CMPH):
             dbstat.dbsize = gcvt_offt(&dbstat.dbsize);
             dbstat.num_keys=gcvt_uint(&dbstat.num_keys);
             dbstat.num_records=gcvt_uint(&dbstat.num_records);
@@ -350,6 +535,160 @@ int read_dbinfo(int fd, char** fnameptr, cdbInfo& dbstat) {
        return 0;
        }
 
+//read the file table of a multi-file index; it is found right before
+//the db name (the file pointer should be on the db name)
+int read_filetable(int fd, cdbInfo& dbstat) {
+  off_t tailpos=lseek(fd, -(off_t)(cdbInfoSIZE+dbstat.dbnamelen+sizeof(cdbFileTail)),
+                     SEEK_END);
+  cdbFileTail ftail;
+  if (tailpos<0 || read(fd, &ftail, sizeof(cdbFileTail))!=sizeof(cdbFileTail))
+     return 2;
+  num_dbfiles=gcvt_uint(&ftail.numfiles);
+  uint32 tablelen=gcvt_uint(&ftail.tablelen);
+  if (num_dbfiles<=0 || num_dbfiles>CDB_MAX_FILES || tablelen<sizeof(cdbFileTail) ||
+      (off_t)tablelen>tailpos+(off_t)sizeof(cdbFileTail))
+     return 2;
+  uint32 flen=tablelen-sizeof(cdbFileTail);
+  char* ftable=NULL;
+  GMALLOC(ftable, flen+1);
+  lseek(fd, tailpos-flen, SEEK_SET);
+  if (read(fd, ftable, flen)!=(int)flen) {
+     GFREE(ftable);
+     return 2;
+     }
+  GCALLOC(dbfiles, num_dbfiles*sizeof(CDbFile));
+  char* p=ftable;
+  char* pend=ftable+flen;
+  for (int i=0;i<num_dbfiles;i++) {
+     if (pend-p<(int)(sizeof(int64_t)+sizeof(uint32))) { GFREE(ftable); return 2; }
+     dbfiles[i].size=gcvt_offt(p);
+     p+=sizeof(int64_t);
+     uint32 nlen=gcvt_uint(p);
+     p+=sizeof(uint32);
+     if ((uint32)(pend-p)<nlen) { GFREE(ftable); return 2; }
+     GMALLOC(dbfiles[i].name, nlen+1);
+     memcpy(dbfiles[i].name, p, nlen);
+     dbfiles[i].name[nlen]='\0';
+     p+=nlen;
+     dbfiles[i].fd=-1;
+     dbfiles[i].bgz=NULL;
+     }
+  GFREE(ftable);
+  return 0;
+}
+
+//length of the records following the key statistics (if any) at the
+//end of the index file, or -1 if it cannot be read
+off_t tail_len(int fd, cdbInfo& dbstat) {
+  off_t tail=cdbInfoSIZE+dbstat.dbnamelen;
+  if (dbstat.idxflags & CDBMSK_OPT_MFILE) {
+    cdbFileTail ftail;
+    if (lseek(fd, -(off_t)(tail+sizeof(cdbFileTail)), SEEK_END)<0 ||
+        read(fd, &ftail, sizeof(cdbFileTail))!=sizeof(cdbFileTail))
+      return -1;
+    tail+=gcvt_uint(&ftail.tablelen);
+    }
+  if (dbstat.idxflags & CDBMSK_OPT_DBSUM) tail+=sizeof(cdbDbSum);
+  return tail;
+}
+
+//number of duplicate keys dropped at indexing (CDBMSK_OPT_KSTATS),
+//or -1 if it cannot be read
+int read_dupkeys(int fd, cdbInfo& dbstat) {
+  off_t tail=tail_len(fd, dbstat);
+  if (tail<0) return -1;
+  cdbKeyStats kst;
+  if (lseek(fd, -(off_t)(tail+sizeof(cdbKeyStats)), SEEK_END)<0 ||
+      read(fd, &kst, sizeof(cdbKeyStats))!=sizeof(cdbKeyStats))
+    return -1;
+  return gcvt_uint(&kst.num_dups);
+}
+
+//64bit record and key counts of a 64bit index (cdbCounts64)
+int read_counts64(int fd, cdbInfo& dbstat, uint64& numrecs, uint64& numkeys) {
+  off_t tail=tail_len(fd, dbstat);
+  if (tail<0) return 2;
+  if (dbstat.idxflags & CDBMSK_OPT_KSTATS) tail+=sizeof(cdbKeyStats);
+  cdbCounts64 cnt;
+  if (lseek(fd, -(off_t)(tail+sizeof(cdbCounts64)), SEEK_END)<0 ||
+      read(fd, &cnt, sizeof(cdbCounts64))!=sizeof(cdbCounts64))
+    return 2;
+  numrecs=gcvt_offt(&cnt.num_records);
+  numkeys=gcvt_offt(&cnt.num_keys);
+  return 0;
+}
+
+//locate a database file of a multi-file index: in the -d directory if
+//given, otherwise at the stored path or in the directory of the index file
+char* locate_dbfile(char* name) {
+  char* base=rstrchr(name, '/');
+  base=(base==NULL) ? name : base+1;
+  char* path=NULL;
+  if (dbfiles_dir!=NULL) {
+    GMALLOC(path, strlen(dbfiles_dir)+strlen(base)+2);
+    sprintf(path, "%s/%s", dbfiles_dir, base);
+    }
+  else {
+    if (fileExists(name)) return Gstrdup(name);
+    char* idxdir=rstrchr(idxfile, '/');
+    if (idxdir==NULL) return NULL;
+    int dlen=idxdir-idxfile+1;
+    GMALLOC(path, dlen+strlen(base)+1);
+    strncpy(path, idxfile, dlen);
+    strcpy(path+dlen, base);
+    }
+  if (fileExists(path)) return path;
+  GFREE(path);
+  return NULL;
+}
+
+//file descriptor for database file fid, opening it if needed
+int dbfile_fd(int fid) {
+  if (fid<0 || fid>=num_dbfiles)
+    GError("cdbyank: invalid file index (%d) in %s\n", fid, idxfile);
+  CDbFile& dbf=dbfiles[fid];
+  dbf.lastuse=++dbfiles_clock;
+  if (dbf.fd>=0) return dbf.fd;
+  if (num_open_dbfiles>=MAX_OPEN_DBFILES) {
+    //close the least recently used one
+    int lru=-1;
+    for (int i=0;i<num_dbfiles;i++)
+      if (dbfiles[i].fd>=0 && (lru<0 || dbfiles[i].lastuse<dbfiles[lru].lastuse))
+         lru=i;
+    close(dbfiles[lru].fd);
+    dbfiles[lru].fd=-1;
+    delete dbfiles[lru].bgz;
+    dbfiles[lru].bgz=NULL;
+    num_open_dbfiles--;
+    }
+  char* path=locate_dbfile(dbf.name);
+  if (path==NULL)
+    GError("Cannot locate the database file %s for this index\n", dbf.name);
+  dbf.fd=open(path, O_RDONLY|O_BINARY);
+  if (dbf.fd==-1)
+    GError("Error: cannot open database file %s\n", path);
+  struct stat fdbstat;
+  fstat(dbf.fd, &fdbstat);
+  if (fdbstat.st_size!=dbf.size)
+    GError("Error: invalid database size - (%lld vs %lld) please rerun cdbfasta for '%s'\n",
+        (long long)dbf.size, (long long)fdbstat.st_size, path);
+  GFREE(path);
+  if (bgzf_db) dbf.bgz=new GBgzfReader(dbf.fd, dbf.name);
+  num_open_dbfiles++;
+  return dbf.fd;
+}
+
+void dbfiles_free() {
+  for (int i=0;i<num_dbfiles;i++) {
+    if (dbfiles[i].fd>=0) close(dbfiles[i].fd);
+    delete dbfiles[i].bgz;
+    GFREE(dbfiles[i].name);
+    }
+  GFREE(dbfiles);
+  num_dbfiles=0;
+  num_open_dbfiles=0;
+}
+
 int parse_int(FILE* f, char* buf, char* key, int& e) {
    char* p, *q;
    while (e!=EOF && isspace(e)) { //skip any spaces
@@ -437,7 +776,7 @@ int main(int argc, char **argv) {
   int r=0;
   cdbInfo dbstat;
   dbstat.dbsize=0;
-  GArgs args(argc, argv, "a:d:o:z:q:nlsxwvFREiPQ");
+  GArgs args(argc, argv, "a:d:o:z:q:nlsxwvFREiPQK");
   int e=args.isError();
   if (e>0)
      GError("%s Invalid argument: %s\n", USAGE, argv[e]);
@@ -518,9 +857,32 @@ int main(int argc, char **argv) {
                  GError("Error reading info chunk!\n");
  if (dbstat.idxflags & CDBMSK_OPT_GSEQ) {
     has_gseqs=true;
-    irec_size32=12;
     }
- if (dataQuery) {
+ if (dbstat.idxflags & CDBMSK_OPT_BGZF) bgzf_db=true;
+ if (dbstat.idxflags & CDBMSK_OPT_FOLD) {
+    folded_idx=true;
+    cdb->setFoldCase(true, caseInsensitive);
+    }
+ int hashv=(dbstat.idxflags & CDBMSK_OPT_HASHV) >> CDBMSK_HASHV_SHIFT;
+ if (hashv>CDB_HASH_MAX)
+    GError("Error: unknown key hash function (version %d) for this index;\n"
+           " it was created by a newer version of cdbfasta.\n", hashv);
+ cdb->setHash(hashv);
+ if (args.getOpt('K')!=NULL) cdb->setKeyCheck(false);
+ if ((dbstat.idxflags & CDBMSK_OPT_KEYLESS) && cdb->isMph()) {
+    keyless_idx=true;
+    key_offset=cdb->mphKeyOffset();
+    }
+ //the database file is also needed for verifying (or listing) the keys
+ //of a keyless index
+ bool needdb=(dataQuery && !rec_pos_only) || (keyless_idx && (dataQuery || listQuery));
+ if (dbstat.idxflags & CDBMSK_OPT_MFILE) {
+    multi_file=true;
+    if (read_filetable(fd, dbstat)!=0)
+       GError("Error reading the file table!\n");
+    lseek(fd, 0, SEEK_SET);
+    }
+ if (dataQuery || needdb) {
    //--------------- DB QUERY MODE: (always read the cdb stored info!)
    /*try to find the database file
      rules: if given, only the -d given filename is used
@@ -529,7 +891,11 @@ int main(int argc, char **argv) {
         2) the dbstat filepath/name stored by cdbfasta
    */
 
-   if (!rec_pos_only && dbname==NULL) { // no -d database given, find it
+   if (multi_file) {
+     //database files are opened when needed; -d gives their directory
+     dbfiles_dir=dbname;
+     }
+   else if (needdb && dbname==NULL) { // no -d database given, find it
     // 1) try to rip the suffix:
     p = rstrchr(idxfile, '.');
     if (p!=NULL) {
@@ -548,7 +914,7 @@ int main(int argc, char **argv) {
        else GError("Cannot locate the database file for this index\n");
       }
     }
-   if (!rec_pos_only) {
+   if (needdb && !multi_file) {
      if (!is_compressed) {
        if (r==0 && (dbstat.idxflags & CDBMSK_OPT_COMPRESS))
          is_compressed=true;
@@ -596,7 +962,10 @@ int main(int argc, char **argv) {
      if (dbstat.dbsize>0 && dbstat.dbsize!=db_size)
        GError("Error: invalid %d database size - (%lld vs %lld) please rerun cdbfasta for '%s'\n",
           fdb, (long long)dbstat.dbsize, (long long)db_size, dbname);
+     if (bgzf_db) dbbgz=new GBgzfReader(fdb, dbname);
      }
+   }
+ if (dataQuery) {
    int many=(args.getOpt('x')!=NULL);
    int keypos=0;
    if (key==NULL) { //key not given
@@ -664,22 +1033,53 @@ int main(int argc, char **argv) {
                result=1; //the only key given not found
        }
     //end data query:
-    if (!rec_pos_only) {
+    if (needdb) {
         if (is_compressed) {
          fclose(fz);
          #ifdef ENABLE_COMPRESSION
          delete cdbz;
          #endif
          }
-        else close(fdb);
+        else if (fdb>=0) {
+          delete dbbgz;
+          close(fdb);
+          }
        }
     if (fout!=NULL) fclose(fout);
     }
   //--------------- INDEX ONLY QUERY MODE:
   else { //index query mode: just retrieve some statistics or key names
-    if (listQuery) { //request for list keys
-       uint32 eod;
-       uint32 pos=0;
+    if (listQuery && keyless_idx) {
+       //rebuild the keys from the deflines of the records
+       char kbuf[RECKEY_BUFSIZE];
+       char bbuf[64];
+       for (uint64 i=0;i<cdb->mphNumLocators();i++) {
+         if (cdb->mphLocator(i)==-1 || cdb->getdata(bbuf)==-1)
+           GError("cdbyank: error reading the record locators (%s)!\n", idxfile);
+         int fid=-1;
+         int dbfd=fdb;
+         GBgzfReader* bgz=dbbgz;
+         if (multi_file) {
+           fid=(uint16_t)gcvt_int16(&bbuf[cdb->datalen()-sizeof(int16_t)]);
+           dbfd=dbfile_fd(fid);
+           bgz=dbfiles[fid].bgz;
+           }
+         off_t fpos=gcvt_offt(bbuf);
+         uint32 reclen=gcvt_uint(&bbuf[offsetof(CIdxData, reclen)]);
+         int klen=0;
+         char* rkey=read_reckey(dbfd, bgz, fpos, reclen, kbuf, klen);
+         printf("%.*s\n", klen, rkey);
+         }
+       if (fdb>=0) {
+         delete dbbgz;
+         close(fdb);
+         }
+       }
+    else if (listQuery) { //request for list keys
+       if (cdb->isMph())
+         GError("Error: the keys are not stored in a minimal perfect hash index (--mph)!\n");
+       uint64 eod;
+       uint64 pos=0;
        uint32 klen;
        uint32 dlen;
        char* bufspace;
@@ -687,7 +1087,12 @@ int main(int argc, char **argv) {
        GCDBuffer* readbuf=new GCDBuffer((opfunc)&read,
            fd, bufspace, GCDBUFFER_INSIZE);
 
-       buf_getnum(readbuf, pos, &eod);
+       if (cdb->isFormat64()) buf_getnum64(readbuf, pos, &eod);
+         else {
+           uint32 eod32;
+           buf_getnum(readbuf, pos, &eod32);
+           eod=eod32;
+           }
        GMALLOC(key, 1024); //!!! hopefully we don't have keys larger than that
        while (pos < 2048)
          buf_getnum(readbuf, pos, &dlen);
@@ -707,29 +1112,63 @@ int main(int argc, char **argv) {
        delete readbuf;
        }
      else { //dig up the info written at the end of the database file
+       uint64 numrecs=dbstat.num_records;
+       uint64 numkeys=dbstat.num_keys;
+       if (cdb->isFormat64() && read_counts64(fd, dbstat, numrecs, numkeys)!=0)
+          GError("Error reading the record counts!\n");
        if (args.getOpt('n')!=NULL) {
-          printf("%d\n",dbstat.num_records);
+          printf("%llu\n", (unsigned long long)numrecs);
           }
         else {//must be -s
             printf("-= Indexing information: =-\n");
-            printf("Number of records:%12d\n", dbstat.num_records);
-            printf("Number of keys   :%12d\n", dbstat.num_keys);
+            printf("Number of records:%12llu\n", (unsigned long long)numrecs);
+            printf("Number of keys   :%12llu\n", (unsigned long long)numkeys);
+            if (dbstat.idxflags & CDBMSK_OPT_KSTATS) {
+              int dups=read_dupkeys(fd, dbstat);
+              if (dups>=0)
+                printf("Duplicate keys dropped:%7d\n", dups);
+              }
             if (dbstat.idxflags & CDBMSK_OPT_COMPRESS)
                 printf("Database records are compressed.\n");
             if (dbstat.idxflags & CDBMSK_OPT_MULTI)
                 printf("Index was built with \"multi-key\" option enabled.\n");
             if (dbstat.idxflags & CDBMSK_OPT_GSEQ)
                 printf("Line length information is stored for each record.\n");
+            if (bgzf_db)
+                printf("Database file is BGZF compressed.\n");
+            if (cdb->isMph())
+                printf("Index is a minimal perfect hash (%u bit key fingerprints).\n",
+                       cdb->mphFpBits());
+              else if (cdb->isFormat64())
+                printf("Index is in the 64bit (cdb64) format.\n");
+            if (folded_idx)
+                printf("Index is case-folded (keys are hashed ignoring the case).\n");
+            if (keyless_idx)
+                printf("Keys are not stored, they are verified against the record deflines.\n");
+            if (cdb->hasLocSlots())
+                printf("The hash table slots hold the record locators.\n");
+            if (hashv==CDB_HASH_W64)
+                printf("Keys are hashed with the 64bit word hash (w64).\n");
             if (dbstat.idxflags & CDBMSK_OPT_C)
                 printf("Index was built with \"shortcut keys\" only.\n");
                else if (dbstat.idxflags & CDBMSK_OPT_CADD)
                 printf("The index was built with full keys and \"shortcut keys\".\n");
-            printf("Database file: %s\n", info_dbname);
-            printf("Database size: %lld bytes\n", (long long)dbstat.dbsize);
+            if (multi_file) {
+              printf("Database files (%d):\n", num_dbfiles);
+              for (int i=0;i<num_dbfiles;i++)
+                printf("  %s (%lld bytes)\n", dbfiles[i].name,
+                       (long long)dbfiles[i].size);
+              printf("Total size: %lld bytes\n", (long long)dbstat.dbsize);
+              }
+            else {
+              printf("Database file: %s\n", info_dbname);
+              printf("Database size: %lld bytes\n", (long long)dbstat.dbsize);
+              }
             }
        }
     }
  GFREE(info_dbname);
+ dbfiles_free();
  delete cdb;
  close(fd);
  GFREE(idxfile);
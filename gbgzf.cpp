@@ -0,0 +1,193 @@
+#include "gbgzf.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+
+int bgzf_filetype(int fd) {
+  unsigned char h[BGZF_HDR_SIZE];
+  off_t cur=lseek(fd, 0, SEEK_CUR);
+  if (cur<0 || lseek(fd, 0, SEEK_SET)!=0) return 0;
+  int r=read(fd, h, BGZF_HDR_SIZE);
+  lseek(fd, cur, SEEK_SET);
+  if (r<2 || h[0]!=0x1f || h[1]!=0x8b) return 0;
+  if (r<BGZF_HDR_SIZE || GBgzfInflater::blockSize((const char*)h)<0) return 1;
+  return 2;
+}
+
+GBgzfInflater::GBgzfInflater() {
+  memset(&zs, 0, sizeof(z_stream));
+  if (inflateInit2(&zs, -15)!=Z_OK) //raw deflate data
+    GError("Error: BGZF inflateInit failed!\n");
+  cbuf=NULL;
+  GMALLOC(cbuf, BGZF_MAX_BLOCK);
+}
+
+GBgzfInflater::~GBgzfInflater() {
+  inflateEnd(&zs);
+  GFREE(cbuf);
+}
+
+int GBgzfInflater::blockSize(const char* hdr) {
+  const unsigned char* h=(const unsigned char*)hdr;
+  //gzip magic, deflate method, FEXTRA flag, XLEN=6 with the BC subfield
+  if (h[0]!=0x1f || h[1]!=0x8b || h[2]!=8 || (h[3] & 4)==0 ||
+      h[10]!=6 || h[11]!=0 || h[12]!='B' || h[13]!='C' || h[14]!=2 || h[15]!=0)
+    return -1;
+  return (int)(h[16] | (h[17]<<8))+1;
+}
+
+int GBgzfInflater::blockDataSize(const char* blk, int bsize) {
+  const unsigned char* t=(const unsigned char*)(blk+bsize-4);
+  return (int)(t[0] | (t[1]<<8) | (t[2]<<16) | ((uint32)t[3]<<24));
+}
+
+int GBgzfInflater::inflateBlock(int bsize, char* ubuf) {
+  int isize=blockDataSize(cbuf, bsize);
+  if (isize<0 || isize>BGZF_MAX_BLOCK) return -1;
+  if (inflateReset(&zs)!=Z_OK) return -1;
+  zs.next_in=(Bytef*)(cbuf+BGZF_HDR_SIZE);
+  zs.avail_in=bsize-BGZF_HDR_SIZE-8;
+  zs.next_out=(Bytef*)ubuf;
+  zs.avail_out=BGZF_MAX_BLOCK;
+  int r=inflate(&zs, Z_FINISH);
+  if (r!=Z_STREAM_END || (int)zs.total_out!=isize) return -1;
+  const unsigned char* t=(const unsigned char*)(cbuf+bsize-8);
+  uint32 crc=t[0] | (t[1]<<8) | (t[2]<<16) | ((uint32)t[3]<<24);
+  if (crc32(crc32(0L, Z_NULL, 0), (const Bytef*)ubuf, isize)!=crc) return -1;
+  return isize;
+}
+
+//-------------------------------------
+int GBgzfStream::readBlock(char* ubuf) {
+  size_t r=fread(cbuf, 1, BGZF_HDR_SIZE, f);
+  if (r==0 && feof(f)) return -1;
+  int bsize=(r==BGZF_HDR_SIZE) ? blockSize(cbuf) : -1;
+  if (bsize<BGZF_HDR_SIZE+8 ||
+      fread(cbuf+BGZF_HDR_SIZE, 1, bsize-BGZF_HDR_SIZE, f)!=(size_t)(bsize-BGZF_HDR_SIZE))
+    GError("Error: invalid or truncated BGZF block at file offset %lld\n",
+           (long long)cofs);
+  int ulen=inflateBlock(bsize, ubuf);
+  if (ulen<0)
+    GError("Error: corrupt BGZF block at file offset %lld\n", (long long)cofs);
+  bofs=cofs;
+  cofs+=bsize;
+  return ulen;
+}
+
+//-------------------------------------
+GBgzfReader::GBgzfReader(int fdesc, const char* name):GBgzfInflater() {
+  fd=fdesc;
+  fname=name;
+  struct stat st;
+  fsize=(fstat(fd, &st)==0) ? st.st_size : 0;
+  clock=0;
+  for (int i=0;i<BGZF_CACHE_BLOCKS;i++) {
+    cache[i].cofs=-1;
+    cache[i].next=0;
+    cache[i].ulen=0;
+    cache[i].lastuse=0;
+    cache[i].data=NULL;
+    }
+  cur=NULL;
+  upos=0;
+}
+
+GBgzfReader::~GBgzfReader() {
+  for (int i=0;i<BGZF_CACHE_BLOCKS;i++) GFREE(cache[i].data);
+}
+
+bool GBgzfReader::readAt(off_t ofs, char* buf, int len) {
+  if (lseek(fd, ofs, SEEK_SET)!=ofs) return false;
+  while (len>0) {
+    int r=::read(fd, buf, len);
+    if (r<=0) return false;
+    buf+=r;
+    len-=r;
+    }
+  return true;
+}
+
+GBgzfReader::Block* GBgzfReader::loadBlock(off_t cofs) {
+  Block* b=NULL;
+  for (int i=0;i<BGZF_CACHE_BLOCKS;i++) {
+    if (cache[i].cofs==cofs) {
+      cache[i].lastuse=++clock;
+      return &cache[i];
+      }
+    if (b==NULL || cache[i].lastuse<b->lastuse) b=&cache[i];
+    }
+  //reuse the least recently used cache slot
+  int bsize=-1;
+  if (readAt(cofs, cbuf, BGZF_HDR_SIZE)) {
+    bsize=blockSize(cbuf);
+    if (bsize<BGZF_HDR_SIZE+8 ||
+        !readAt(cofs+BGZF_HDR_SIZE, cbuf+BGZF_HDR_SIZE, bsize-BGZF_HDR_SIZE))
+      bsize=-1;
+    }
+  if (bsize<0)
+    GError("Error: cannot read BGZF block at offset %lld in %s\n",
+           (long long)cofs, fname);
+  if (b->data==NULL) GMALLOC(b->data, BGZF_MAX_BLOCK);
+  b->cofs=-1;
+  b->ulen=inflateBlock(bsize, b->data);
+  if (b->ulen<0)
+    GError("Error: corrupt BGZF block at offset %lld in %s\n",
+           (long long)cofs, fname);
+  b->cofs=cofs;
+  b->next=cofs+bsize;
+  b->lastuse=++clock;
+  return b;
+}
+
+void GBgzfReader::seek(uint64 voffset) {
+  cur=loadBlock(bgzf_blockofs(voffset));
+  upos=bgzf_inblock(voffset);
+  if (upos>cur->ulen)
+    GError("Error: invalid BGZF offset %llu in %s\n",
+           (unsigned long long)voffset, fname);
+}
+
+int GBgzfReader::read(char* buf, int len) {
+  int done=0;
+  while (done<len && cur!=NULL) {
+    if (upos==cur->ulen) { //next block
+      if (cur->next>=fsize) break; //end of file
+      cur=loadBlock(cur->next);
+      upos=0;
+      continue;
+      }
+    int n=cur->ulen-upos;
+    if (n>len-done) n=len-done;
+    memcpy(buf+done, cur->data+upos, n);
+    upos+=n;
+    done+=n;
+    }
+  return done;
+}
+
+void GBgzfReader::skip(uint64 n) {
+  if (cur==NULL) return;
+  if ((uint64)(cur->ulen-upos)>=n) {
+    upos+=n;
+    return;
+    }
+  n-=cur->ulen-upos;
+  off_t cofs=cur->next;
+  //skip whole blocks using their header and trailer only
+  for (;;) {
+    int bsize=-1, isize=0;
+    if (readAt(cofs, cbuf, BGZF_HDR_SIZE)) {
+      bsize=blockSize(cbuf);
+      if (bsize>=BGZF_HDR_SIZE+8 && readAt(cofs+bsize-4, cbuf+BGZF_HDR_SIZE, 4))
+        isize=blockDataSize(cbuf+BGZF_HDR_SIZE, 4);
+      else bsize=-1;
+      }
+    if (bsize<0)
+      GError("Error: cannot read BGZF block at offset %lld in %s\n",
+             (long long)cofs, fname);
+    if ((uint64)isize>=n) break;
+    n-=isize;
+    cofs+=bsize;
+    }
+  cur=loadBlock(cofs);
+  upos=(int)n;
+}
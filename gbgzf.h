@@ -0,0 +1,95 @@
+#ifndef _GBGZF_H
+#define _GBGZF_H
+#include "GBase.h"
+#include <zlib.h>
+
+//=====================================================
+//-------- BGZF (blocked gzip) compressed files -------
+//=====================================================
+// A BGZF file is a series of gzip members ("blocks") holding at most
+// 64KB of uncompressed data each, with the compressed size of each block
+// stored in a 'BC' extra field of the gzip header. Any position in the
+// uncompressed data is given by a 64bit virtual offset:
+//     (file offset of the block) << 16 | (offset in the uncompressed block)
+
+#define BGZF_MAX_BLOCK 0x10000
+#define BGZF_HDR_SIZE 18
+//number of uncompressed blocks cached by GBgzfReader
+#define BGZF_CACHE_BLOCKS 8
+
+inline uint64 bgzf_voffset(off_t blockofs, int inblock) {
+  return (((uint64)blockofs)<<16) | (uint64)inblock;
+}
+inline off_t bgzf_blockofs(uint64 voffset) { return (off_t)(voffset>>16); }
+inline int bgzf_inblock(uint64 voffset) { return (int)(voffset & 0xFFFF); }
+
+//checks the start of the file open at fd (without changing its file position):
+//returns 2 for a BGZF file, 1 for other gzip files, 0 if not gzip compressed
+int bgzf_filetype(int fd);
+
+//BGZF block inflating
+class GBgzfInflater {
+ protected:
+  z_stream zs;
+  char* cbuf; //compressed block
+ public:
+  GBgzfInflater();
+  ~GBgzfInflater();
+  //compressed size of the block having the header hdr, or -1 if invalid
+  static int blockSize(const char* hdr);
+  //uncompressed size of the block, as found at the end of the block data
+  static int blockDataSize(const char* blk, int bsize);
+  //the compressed block of bsize bytes (header included) is in cbuf:
+  //inflate it into ubuf (BGZF_MAX_BLOCK bytes), returns the uncompressed
+  //length or -1 if the block is corrupt
+  int inflateBlock(int bsize, char* ubuf);
+  char* blockBuf() { return cbuf; }
+};
+
+//sequential reading of the blocks of a BGZF stream (for indexing)
+class GBgzfStream: public GBgzfInflater {
+  FILE* f;
+  off_t cofs; //file offset of the next block
+  off_t bofs; //file offset of the last block read
+ public:
+  GBgzfStream(FILE* fh, off_t fofs=0):GBgzfInflater(), f(fh), cofs(fofs), bofs(fofs) { }
+  //read and inflate the next block into ubuf (BGZF_MAX_BLOCK bytes);
+  //returns the uncompressed block length (which can be 0), or -1 at the end
+  //of the file; errors are fatal
+  int readBlock(char* ubuf);
+  off_t blockOfs() { return bofs; } //file offset of the last block read
+  off_t fileOfs() { return cofs; } //bytes consumed from the file
+};
+
+//random access to the uncompressed data of a BGZF file, keeping a small
+//cache of recently used blocks (for cdbyank)
+class GBgzfReader: public GBgzfInflater {
+  struct Block {
+    off_t cofs; //file offset of the block (-1 if unused)
+    off_t next; //file offset of the next block
+    int ulen; //uncompressed length
+    char* data;
+    uint32 lastuse;
+  };
+  int fd;
+  const char* fname;
+  off_t fsize;
+  Block cache[BGZF_CACHE_BLOCKS];
+  uint32 clock;
+  Block* cur; //current block
+  int upos; //position in the current block
+  Block* loadBlock(off_t cofs);
+  bool readAt(off_t ofs, char* buf, int len);
+ public:
+  GBgzfReader(int fdesc, const char* name);
+  ~GBgzfReader();
+  //position on the given virtual offset
+  void seek(uint64 voffset);
+  //copy the next len bytes of uncompressed data into buf; returns the
+  //number of bytes copied, which is less than len only at the end of file
+  int read(char* buf, int len);
+  //skip n bytes of uncompressed data; blocks entirely skipped are not inflated
+  void skip(uint64 n);
+};
+
+#endif
@@ -1,5 +1,11 @@
 #include "gcdb.h"
 #include <errno.h>
+#ifndef __WIN32__
+#include <pthread.h>
+#include <sys/time.h>
+#else
+#include <time.h>
+#endif
 
 #ifdef __WIN32__
 /*   m m a p           ===      from imagick sources
@@ -78,10 +84,8 @@ int endianSetup=0;
 int cdbInfoSIZE=offsetof(cdbInfo, tag)+4;
 int IdxDataSIZE=offsetof(CIdxData, reclen)+sizeof(uint32);
 int IdxDataSIZE32=offsetof(CIdxData32, reclen)+sizeof(uint32);
-/*
 int IdxSeqDataSIZE=offsetof(CIdxSeqData, elen)+sizeof(byte);
 int IdxSeqDataSIZE32=offsetof(CIdxSeqData32, elen)+sizeof(byte);
-*/
 
 //=====================================================
 //-------------     buffer stuff    -------------------
@@ -163,30 +167,44 @@ static void gcdb_byte_copyr(char *to, unsigned int n, char *from) {
   }
 }
 
-#define ALIGNMENT 16 /* XXX: assuming that this alignment is enough */
-#define SPACE 4096 /* must be multiple of ALIGNMENT */
-
-typedef union { char irrelevant[ALIGNMENT]; double d; } aligned;
-static aligned realspace[SPACE / ALIGNMENT];
-#define space ((char *) realspace)
-
-static unsigned int avail = SPACE; /* multiple of ALIGNMENT; 0<=avail<=SPACE */
-
 offt_conv_func gcvt_offt;
 uint_conv_func gcvt_uint;
 int16_conv_func gcvt_int16;
 
-char *gcdb_alloc(unsigned int n) {
-  char *x;
-  n = ALIGNMENT + n - (n & (ALIGNMENT - 1)); /* XXX: could overflow */
-  if (n <= avail) { avail -= n; return space + avail; }
-  x = (char*) malloc(n);
-  if (!x) return NULL;
-  //if (!x) GError("Error: mgcdb_alloc(%d) failed !\n", n);
-  return x;
+bool cdb_samplesum(int fd, off_t size, uint64& sum, uint32 samples, uint32 blocksize) {
+  //64bit FNV-1a hash of the sampled blocks and of the size
+  const uint64 fnv_prime=0x100000001b3ULL;
+  uint64 h=0xcbf29ce484222325ULL;
+  uint64 v=(uint64)size;
+  for (int i=0;i<8;i++) { h^=(v & 0xff); h*=fnv_prime; v>>=8; }
+  if (samples<2) samples=2;
+  if (blocksize==0) return false;
+  char* buf=NULL;
+  GMALLOC(buf, blocksize);
+  off_t lastblk=(size>(off_t)blocksize) ? size-blocksize : 0;
+  off_t prevend=0; //blocks may overlap for small files
+  for (uint32 i=0;i<samples && size>0;i++) {
+    off_t bstart=(off_t)(((uint64)lastblk*i)/(samples-1));
+    if (bstart<prevend) bstart=prevend;
+    off_t bend=bstart+blocksize;
+    if (bend>size) bend=size;
+    if (bstart>=bend) continue;
+    if (lseek(fd, bstart, SEEK_SET)!=bstart) { GFREE(buf); return false; }
+    int len=bend-bstart;
+    int r=0;
+    while (r<len) {
+      int n=read(fd, buf+r, len-r);
+      if (n<=0) { GFREE(buf); return false; }
+      r+=n;
+      }
+    for (int k=0;k<len;k++) { h^=(unsigned char)buf[k]; h*=fnv_prime; }
+    prevend=bend;
+    }
+  GFREE(buf);
+  sum=h;
+  return true;
 }
 
-
 int GCDBuffer::write_all(char* buf, unsigned int len) {
   int w;
   while (len) {
@@ -214,13 +232,13 @@ int GCDBuffer::putalign(char *buf,unsigned int len) {
   unsigned int bn;
 
   while (len > (bn = n-p)) {
-    gcdb_byte_copy(x + p,bn,buf);
+    memcpy(x + p,buf,bn);
     p += bn; buf += bn; len -= bn;
     if (GCDBuffer::flush() == -1) return -1;
     }
 
   /* now len <= s->n - s->p */
-  gcdb_byte_copy(x + p,len,buf);
+  memcpy(x + p,buf,len);
   p += len;
   return 0;
 }
@@ -239,7 +257,7 @@ int GCDBuffer::put(char *buf,unsigned int len) {
     }
   }
   /* now len <= s->n - s->p */
-  gcdb_byte_copy(x + p,len,buf);
+  memcpy(x + p,buf,len);
   p += len;
   return 0;
 }
@@ -520,6 +538,20 @@ void uint32_unpack(char s[4],uint32 *u)
   *u = result;
 }
 
+void uint64_pack(char s[8],uint64 u)
+{
+  uint32_pack(s, (uint32)(u & 0xffffffffULL));
+  uint32_pack(s + 4, (uint32)(u >> 32));
+}
+
+void uint64_unpack(char s[8],uint64 *u)
+{
+  uint32 lo, hi;
+  uint32_unpack(s, &lo);
+  uint32_unpack(s + 4, &hi);
+  *u = ((uint64)hi << 32) | lo;
+}
+
 void uint32_unpack_big(char s[4],uint32 *u)
 {
   uint32 result;
@@ -559,6 +591,175 @@ void gcvt_endian_setup() {
        }
  }
 
+//=====================================================
+//-------------   index output      -------------------
+//=====================================================
+
+static double gcdb_time() {
+ #ifdef __WIN32__
+  return clock() / (double)CLOCKS_PER_SEC;
+ #else
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+ #endif
+}
+
+struct GCdbBgWrite {
+ #ifndef __WIN32__
+  pthread_t tid;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+ #endif
+  GCdbWBuffer* wb;
+  char* pending; //buffer to be written, or NULL
+  unsigned int plen;
+  bool quit;
+  int err;
+};
+
+#ifndef __WIN32__
+static void* cdb_bgWriteThread(void* p) {
+  GCdbBgWrite* bg = (GCdbBgWrite*)p;
+  pthread_mutex_lock(&bg->lock);
+  for (;;) {
+    while (bg->pending == NULL && !bg->quit)
+      pthread_cond_wait(&bg->cond, &bg->lock);
+    if (bg->pending == NULL) break;
+    char* b = bg->pending;
+    unsigned int len = bg->plen;
+    pthread_mutex_unlock(&bg->lock);
+    int r = bg->wb->writeOut(b, len);
+    pthread_mutex_lock(&bg->lock);
+    if (r == -1) bg->err = 1;
+    bg->pending = NULL;
+    pthread_cond_broadcast(&bg->cond);
+    }
+  pthread_mutex_unlock(&bg->lock);
+  return NULL;
+}
+#endif
+
+GCdbWBuffer::GCdbWBuffer(int afd, unsigned int bufsize, bool background) {
+  fd = afd;
+  size = (bufsize < GCDBUFFER_OUTSIZE) ? GCDBUFFER_OUTSIZE : bufsize;
+  p = 0;
+  cur = 0;
+  bgw = NULL;
+  wbytes = 0;
+  wtime = 0;
+  buf[1] = NULL;
+  GMALLOC(buf[0], size);
+ #ifndef __WIN32__
+  if (background) {
+    GMALLOC(bgw, sizeof(GCdbBgWrite));
+    bgw->wb = this;
+    bgw->pending = NULL;
+    bgw->plen = 0;
+    bgw->quit = false;
+    bgw->err = 0;
+    pthread_mutex_init(&bgw->lock, NULL);
+    pthread_cond_init(&bgw->cond, NULL);
+    if (pthread_create(&bgw->tid, NULL, &cdb_bgWriteThread, bgw) != 0) {
+      pthread_cond_destroy(&bgw->cond);
+      pthread_mutex_destroy(&bgw->lock);
+      GFREE(bgw); //write in this thread
+      }
+    else GMALLOC(buf[1], size);
+    }
+ #endif
+}
+
+GCdbWBuffer::~GCdbWBuffer() {
+  sync();
+ #ifndef __WIN32__
+  if (bgw != NULL) {
+    pthread_mutex_lock(&bgw->lock);
+    bgw->quit = true;
+    pthread_cond_broadcast(&bgw->cond);
+    pthread_mutex_unlock(&bgw->lock);
+    pthread_join(bgw->tid, NULL);
+    pthread_cond_destroy(&bgw->cond);
+    pthread_mutex_destroy(&bgw->lock);
+    GFREE(bgw);
+    }
+ #endif
+  GFREE(buf[0]);
+  GFREE(buf[1]);
+}
+
+int GCdbWBuffer::writeOut(char* b, unsigned int len) {
+  double t = gcdb_time();
+  wbytes += len;
+  while (len) {
+    ssize_t w = ::write(fd, b, len);
+    if (w == -1) {
+      if (errno == error_intr) continue;
+      wtime += gcdb_time() - t;
+      return -1;
+      }
+    b += w;
+    len -= w;
+    }
+  wtime += gcdb_time() - t;
+  return 0;
+}
+
+int GCdbWBuffer::put(const char* b, unsigned int len) {
+  if (p == 0 && len >= size && bgw == NULL) //no need to copy it
+    return writeOut((char*)b, len);
+  while (len > size - p) {
+    unsigned int n = size - p;
+    memcpy(buf[cur] + p, b, n);
+    p = size;
+    b += n;
+    len -= n;
+    if (flush() == -1) return -1;
+    }
+  memcpy(buf[cur] + p, b, len);
+  p += len;
+  return 0;
+}
+
+int GCdbWBuffer::flush() {
+  if (p == 0) return 0;
+  unsigned int len = p;
+  p = 0;
+ #ifndef __WIN32__
+  if (bgw != NULL) {
+    //wait for the previous buffer to be written, then pass this one
+    pthread_mutex_lock(&bgw->lock);
+    while (bgw->pending != NULL)
+      pthread_cond_wait(&bgw->cond, &bgw->lock);
+    int err = bgw->err;
+    if (!err) {
+      bgw->pending = buf[cur];
+      bgw->plen = len;
+      pthread_cond_broadcast(&bgw->cond);
+      }
+    pthread_mutex_unlock(&bgw->lock);
+    cur ^= 1;
+    return err ? -1 : 0;
+    }
+ #endif
+  return writeOut(buf[cur], len);
+}
+
+int GCdbWBuffer::sync() {
+  if (flush() == -1) return -1;
+ #ifndef __WIN32__
+  if (bgw != NULL) {
+    pthread_mutex_lock(&bgw->lock);
+    while (bgw->pending != NULL)
+      pthread_cond_wait(&bgw->cond, &bgw->lock);
+    int err = bgw->err;
+    pthread_mutex_unlock(&bgw->lock);
+    if (err) return -1;
+    }
+ #endif
+  return 0;
+}
+
 //=====================================================
 //-------------     cdb index       -------------------
 //=====================================================
@@ -566,12 +767,26 @@ void gcvt_endian_setup() {
 GCdbWrite::GCdbWrite(int afd) {
   //check endianness :)
   gcvt_endian_setup();
-  cdbuf=new GCDBuffer((opfunc)&write,(int) afd,(char*)bspace,sizeof bspace);
-  head = NULL;
-  split = 0;
-  hash = 0;
+  cdbuf = new GCdbWBuffer(afd);
+  dosync = true;
+  tbytes = 0;
+  ttime = 0;
   numentries = 0;
+  memlimit = 0;
+  curmem = 0;
+  peakmem = 0;
+  spillfd = -1;
+  spillname = NULL;
+  spillpos = 0;
+  spillofs = NULL;
+  spillcnt = NULL;
+  numruns = 0;
+  numthreads = 1;
   fd = afd;
+  foldcase = false;
+  hashv = CDB_HASH_DJB;
+  format64 = false;
+  locslots = false;
   pos = sizeof final;
   gcdb_seek_set(fd, pos);
 
@@ -581,20 +796,34 @@ GCdbWrite::GCdbWrite(int afd) {
 
 GCdbWrite::GCdbWrite(char* afname) {
 #ifdef __WIN32__
-   fd = open(afname,O_WRONLY | O_TRUNC | O_BINARY | O_CREAT, S_IREAD|S_IWRITE);
+   fd = open(afname,O_RDWR | O_TRUNC | O_BINARY | O_CREAT, S_IREAD|S_IWRITE);
 #else
-   fd = open(afname,O_WRONLY | O_NDELAY | O_TRUNC | O_CREAT, 0664);
+   fd = open(afname,O_RDWR | O_NDELAY | O_TRUNC | O_CREAT, 0664);
 #endif
   if (fd == -1)
     GError("GCdbWrite: Error creating file '%s'\n", fname);
 
   gcvt_endian_setup();
 
-  cdbuf=new GCDBuffer((opfunc)&write,(int) fd,(char*)bspace,sizeof bspace);
-  head = NULL;
-  split = 0;
-  hash = 0;
+  cdbuf = new GCdbWBuffer(fd);
+  dosync = true;
+  tbytes = 0;
+  ttime = 0;
   numentries = 0;
+  memlimit = 0;
+  curmem = 0;
+  peakmem = 0;
+  spillfd = -1;
+  spillname = NULL;
+  spillpos = 0;
+  spillofs = NULL;
+  spillcnt = NULL;
+  numruns = 0;
+  numthreads = 1;
+  foldcase = false;
+  hashv = CDB_HASH_DJB;
+  format64 = false;
+  locslots = false;
   pos = sizeof final;
   gcdb_seek_set(fd, pos);
   strcpy(fname, afname);
@@ -603,10 +832,10 @@ GCdbWrite::GCdbWrite(char* afname) {
 }
 
 GCdbWrite::~GCdbWrite() {
-  cdbuf->flush();
+  cdbuf->sync();
   #ifndef __WIN32__
    /* NFS silliness  */
-   if (fsync(fd) == -1)
+   if (dosync && fsync(fd) == -1)
       GError("GCdbWrite: Error at fsync() for file '%s'\n",
                           fname);
   #endif
@@ -614,30 +843,203 @@ GCdbWrite::~GCdbWrite() {
         GError("GCdbWrite: Error at closing file '%s'\n",
                           fname);
   delete cdbuf;
-  if (head!=NULL) free(head);
+  hps.release();
+  if (spillfd>=0) {
+    ::close(spillfd);
+    remove(spillname);
+    }
+  GFREE(spillname);
+  GFREE(spillofs);
+  GFREE(spillcnt);
   }
 
-int GCdbWrite::posplus(uint32 len) {
-  uint32 newpos = pos + len;
+void GCdbWrite::setWriteBuffer(unsigned int bufsize, bool background) {
+  if (cdbuf->sync() == -1)
+    GError("GCdbWrite: Error writing file '%s'\n", fname);
+  delete cdbuf;
+  cdbuf = new GCdbWBuffer(fd, bufsize, background);
+}
+
+int GCdbWrite::posplus(uint64 len) {
+  uint64 newpos = pos + len;
   if (newpos < len) { //errno = error_nomem;
                      return -1; }
   pos = newpos;
   return 0;
 }
 
-int GCdbWrite::addend(unsigned int keylen,unsigned int datalen,uint32 h) {
-  struct cdb_hplist *chead = head;
-  if (!chead || (chead->num >= CDB_HPLIST)) {
-    chead = (struct cdb_hplist *) gcdb_alloc(sizeof(struct cdb_hplist));
-    if (!chead) return -1;
-    chead->num = 0;
-    chead->next = head;
-    head = chead;
-    }
-  chead->hp[head->num].h = h;
-  chead->hp[head->num].p = pos;
-  ++chead->num;
+int GCdbWrite::addhp(uint32 h, uint64 p) {
+  if (memlimit && hps.size() >= memlimit && spill() == -1) return -1;
+  uint64 m = hps.memSize();
+  hps.add(h, p);
+  if (hps.memSize() != m) memTrack(hps.memSize() - m);
   ++numentries;
+  return 0;
+}
+
+void GCdbHPArray::grow() {
+  uint64 newcap = (cap == 0) ? 0x10000 : cap * 2;
+  if (maxcap && newcap > maxcap) newcap = (maxcap > cap) ? maxcap : cap + 1;
+  size_t oldsize = cap * sizeof(struct cdb_hp);
+  size_t newsize = newcap * sizeof(struct cdb_hp);
+ #ifdef __linux__
+  void* m = (data == NULL) ?
+      mmap(NULL, newsize, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0) :
+      mremap(data, oldsize, newsize, MREMAP_MAYMOVE);
+  if (m == MAP_FAILED)
+    GError("Error allocating memory for %llu index entries!\n",
+           (unsigned long long)newcap);
+  #ifdef MADV_HUGEPAGE
+  if (hugepages) madvise(m, newsize, MADV_HUGEPAGE);
+  #endif
+  data = (struct cdb_hp*)m;
+  mapped = true;
+ #else
+  (void)oldsize;
+  GREALLOC(data, newsize);
+ #endif
+  cap = newcap;
+}
+
+void GCdbHPArray::release() {
+  if (data != NULL) {
+    if (mapped) munmap(data, cap * sizeof(struct cdb_hp));
+      else GFREE(data);
+    }
+  data = NULL;
+  count = 0;
+  cap = 0;
+  mapped = false;
+}
+
+void GCdbWrite::setMemLimit(uint64 maxbytes, const char* tmpname) {
+  memlimit = maxbytes / sizeof(struct cdb_hp);
+  if (memlimit < CDB_HPLIST) memlimit = CDB_HPLIST;
+  hps.setMaxCap(memlimit);
+  GFREE(spillname);
+  if (tmpname != NULL) spillname = Gstrdup(tmpname);
+    else {
+      GMALLOC(spillname, strlen(fname)+10);
+      sprintf(spillname, "%s.hpspill", fname);
+      }
+}
+
+//positioned writes and reads (which can be used by multiple threads
+//where pwrite/pread are available)
+static int gcdb_pwrite(int fd, char* buf, size_t len, uint64 ofs) {
+ #ifdef __WIN32__
+  if (gcdb_seek_set(fd, (gcdb_seek_pos)ofs) == -1) return -1;
+ #endif
+  while (len > 0) {
+   #ifdef __WIN32__
+    ssize_t w = ::write(fd, buf, len);
+   #else
+    ssize_t w = ::pwrite(fd, buf, len, (off_t)ofs);
+   #endif
+    if (w == -1) {
+      if (errno == error_intr) continue;
+      return -1;
+      }
+    buf += w;
+    len -= w;
+    ofs += w;
+    }
+  return 0;
+}
+
+static int gcdb_pread(int fd, char* buf, size_t len, uint64 ofs) {
+ #ifdef __WIN32__
+  if (gcdb_seek_set(fd, (gcdb_seek_pos)ofs) == -1) return -1;
+ #endif
+  while (len > 0) {
+   #ifdef __WIN32__
+    ssize_t r = ::read(fd, buf, len);
+   #else
+    ssize_t r = ::pread(fd, buf, len, (off_t)ofs);
+   #endif
+    if (r == -1) {
+      if (errno == error_intr) continue;
+      return -1;
+      }
+    if (r == 0) return -1;
+    buf += r;
+    len -= r;
+    ofs += r;
+    }
+  return 0;
+}
+
+//write the entries kept in memory to the spill file, as a new run:
+//the entries of each partition are stored together, in the order they
+//were added
+int GCdbWrite::spill() {
+  uint64 n = hps.size();
+  if (n == 0) return 0;
+  if (spillfd < 0) {
+   #ifdef __WIN32__
+    spillfd = open(spillname, O_RDWR | O_TRUNC | O_BINARY | O_CREAT, S_IREAD|S_IWRITE);
+   #else
+    spillfd = open(spillname, O_RDWR | O_TRUNC | O_CREAT, 0600);
+   #endif
+    if (spillfd == -1)
+      GError("GCdbWrite: Error creating temporary file '%s'\n", spillname);
+    }
+  GREALLOC(spillofs, (numruns+1) * 256 * sizeof(uint64));
+  GREALLOC(spillcnt, (numruns+1) * 256 * sizeof(uint64));
+  uint64* rofs = spillofs + numruns * 256;
+  uint64* rcnt = spillcnt + numruns * 256;
+  memset(rcnt, 0, 256 * sizeof(uint64));
+  struct cdb_hp* hp = hps.entries();
+  uint64 i;
+  for (i = 0;i < n;++i)
+    ++rcnt[hp[i].h & 255];
+  uint64 cur[256]; //write position in each partition
+  uint64 o = spillpos;
+  for (int b = 0;b < 256;++b) {
+    rofs[b] = o;
+    cur[b] = o;
+    o += rcnt[b] * sizeof(struct cdb_hp);
+    }
+  struct cdb_hp* sbuf = NULL; //write buffers of the partitions
+  GMALLOC(sbuf, 256 * CDB_SPILL_BUF * sizeof(struct cdb_hp));
+  uint32 sfill[256];
+  memset(sfill, 0, sizeof(sfill));
+  int r = 0;
+  for (i = 0;i < n && r == 0;++i) {
+    uint32 b = hp[i].h & 255;
+    sbuf[b * CDB_SPILL_BUF + sfill[b]] = hp[i];
+    if (++sfill[b] == CDB_SPILL_BUF) {
+      if (gcdb_pwrite(spillfd, (char*)(sbuf + b * CDB_SPILL_BUF),
+              CDB_SPILL_BUF * sizeof(struct cdb_hp), cur[b]) == -1) r = -1;
+      cur[b] += CDB_SPILL_BUF * sizeof(struct cdb_hp);
+      sfill[b] = 0;
+      }
+    }
+  for (int b = 0;b < 256 && r == 0;++b) {
+    if (sfill[b] && gcdb_pwrite(spillfd, (char*)(sbuf + b * CDB_SPILL_BUF),
+                sfill[b] * sizeof(struct cdb_hp), cur[b]) == -1) r = -1;
+    }
+  GFREE(sbuf);
+  hps.clear();
+  spillpos = o;
+  ++numruns;
+  return r;
+}
+
+//load the spilled entries of a partition, in the order they were added
+int GCdbWrite::loadPart(int part, struct cdb_hp* buf) {
+  for (int run = 0;run < numruns;++run) {
+    uint64 n = spillcnt[run * 256 + part];
+    if (n == 0) continue;
+    if (gcdb_pread(spillfd, (char*)buf, n * sizeof(struct cdb_hp),
+                   spillofs[run * 256 + part]) == -1) return -1;
+    buf += n;
+    }
+  return 0;
+}
+
+int GCdbWrite::addend(unsigned int keylen,unsigned int datalen,uint32 h) {
+  if (addhp(h, pos) == -1) return -1;
   if (posplus(8) == -1) return -1;
   if (posplus(keylen) == -1) return -1;
   if (posplus(datalen) == -1) return -1;
@@ -650,18 +1052,11 @@ int GCdbWrite::addbegin(unsigned int keylen,unsigned int datalen) {
   // if (datalen > MAX_UINT) { /*errno = error_nomem;*/ return -1; }
   uint32_pack(buf,keylen);
   uint32_pack(buf + 4,datalen);
-  if (cdbuf->putalign(buf,8) == -1) return -1;
+  if (cdbuf->put(buf,8) == -1) return -1;
   return 0;
 }
 
-#define cdbuffer_PUTC(s,c) \
-  ( ((s).n != (s).p) \
-    ? ( (s).x[(s).p++] = (c), 0 ) \
-    : (s).put(&(c),1) \
-  )
-
 int GCdbWrite::add(const char* key, char* recdata, unsigned int datalen) {
- unsigned int i;
  unsigned int klen=strlen(key);
  if (klen<1) {
     GMessage("Warning: zero length key found\n");
@@ -670,14 +1065,9 @@ int GCdbWrite::add(const char* key, char* recdata, unsigned int datalen) {
  //------------ adding record -----------------
  if (addbegin(klen,datalen)==-1)
      GError("GCdbWrite: Error at addbegin(%d, %d)\n",klen, datalen);
- uint32 h=CDB_HASHSTART;
- for (i = 0;i < klen; ++i) {
-      //if (cdbuffer_PUTC(c.cdbuf,key[i]) == -1)
-      if ( ((cdbuf->n!=cdbuf->p) ? (cdbuf->x[cdbuf->p++]=(key[i]),0 )
-                      : cdbuf->put((char*)&(key[i]),1) )==-1)
-               GError("GCdbWrite: Error at cdbbuf.put, key '%s'\n", key);
-      h = cdb_hashadd(h,key[i]);
-      }
+ if (cdbuf->put(key, klen) == -1)
+    GError("GCdbWrite: Error at cdbbuf.put, key '%s'\n", key);
+ uint32 h = cdb_keyhash(hashv, key, klen, foldcase);
  if (cdbuf->put(recdata,datalen) == -1)
     GError("GCdbWrite: Error at final cdbuf.put() at key='%s', datalen=%d\n",
                     key, datalen);
@@ -688,91 +1078,723 @@ int GCdbWrite::add(const char* key, char* recdata, unsigned int datalen) {
 
 int GCdbWrite::addrec(const char *key,unsigned int keylen,char *data,unsigned int datalen) {
   if (GCdbWrite::addbegin(keylen,datalen) == -1) return -1;
-  if (cdbuf->putalign((char*)key,keylen) == -1) return -1;
-  if (cdbuf->putalign(data,datalen) == -1) return -1;
-  return GCdbWrite::addend(keylen,datalen,cdb_hash(key,keylen));
+  if (cdbuf->put(key,keylen) == -1) return -1;
+  if (cdbuf->put(data,datalen) == -1) return -1;
+  return GCdbWrite::addend(keylen,datalen,
+            cdb_keyhash(hashv, key, keylen, foldcase));
 }
 
 
-int GCdbWrite::finish() {
-  char buf[8];
-  int i;
-  uint32 len;
-  uint32 u;
-  uint32 memsize;
-  uint32 icount;
-  uint32 where;
-  struct cdb_hplist *x;
-  struct cdb_hp *hp;
-
-  for (i = 0;i < 256;++i)
-    count[i] = 0;
-
-  for (x = head;x;x = x->next) {
-    i = x->num;
-    while (i--)
-      ++count[255 & x->hp[i].h];
-  }
+int GCdbWrite::addbuf(GCdbRecBuf* rb) {
+  if (rb->dlen==0) return 0;
+  if (cdbuf->put(rb->data, rb->dlen) == -1) return -1;
+  for (uint32 i=0;i<rb->numentries;i++) {
+    if (addhp(rb->hp[i].h, pos+rb->hp[i].p) == -1) return -1;
+    }
+  return posplus(rb->dlen);
+}
 
-  memsize = 1;
-  for (i = 0;i < 256;++i) {
-    u = count[i] * 2;
-    if (u > memsize)
-      memsize = u;
-  }
+GCdbRecBuf::GCdbRecBuf() {
+  data=NULL;
+  dlen=0;
+  dcap=0;
+  hp=NULL;
+  numentries=0;
+  hpcap=0;
+  foldcase=false;
+  hashv=CDB_HASH_DJB;
+}
 
-  memsize += numentries; /* no overflow possible up to now */
-  u = (uint32) 0 - (uint32) 1;
-  u /= sizeof(struct cdb_hp);
-  if (memsize > u) { /* errno = error_nomem;*/ return -1; }
+GCdbRecBuf::~GCdbRecBuf() {
+  GFREE(data);
+  GFREE(hp);
+}
 
-  split = (struct cdb_hp *) gcdb_alloc(memsize * sizeof(struct cdb_hp));
-  if (!split) return -1;
+int GCdbRecBuf::addrec(const char *key,unsigned int keylen,char *rdata,unsigned int datalen) {
+  uint32 rlen=8+keylen+datalen;
+  if (dlen+rlen < rlen) return -1;
+  if (dlen+rlen > dcap) {
+    uint32 newcap = (dcap<0x10000) ? 0x10000 : dcap;
+    while (newcap < dlen+rlen) {
+      if (newcap > MAX_UINT/2) { newcap=dlen+rlen; break; }
+      newcap <<= 1;
+      }
+    GREALLOC(data, newcap);
+    dcap=newcap;
+    }
+  if (numentries==hpcap) {
+    hpcap = (hpcap==0) ? CDB_HPLIST : hpcap*2;
+    GREALLOC(hp, hpcap*sizeof(struct cdb_hp));
+    }
+  char* p=data+dlen;
+  uint32_pack(p, keylen);
+  uint32_pack(p+4, datalen);
+  memcpy(p+8, key, keylen);
+  memcpy(p+8+keylen, rdata, datalen);
+  hp[numentries].h=cdb_keyhash(hashv, key, keylen, foldcase);
+  hp[numentries].p=dlen;
+  numentries++;
+  dlen+=rlen;
+  return 0;
+}
 
-  hash = split + numentries;
+//state shared by the threads building the hash tables in finish()
+struct GCdbTables {
+  GCdbWrite* cdbw;
+  uint32 tbits;
+  uint32 nsub; //tables in each partition
+  uint64* tcount; //number of entries of each table (in tk order)
+  uint64* tstart; //first entry of each table in the sorted entries
+  struct cdb_hp* tsplit; //all the entries sorted by table, if not spilled
+  uint64 maxpart; //max. number of entries in a spilled partition
+  uint64 ppos[257]; //file position of the tables of each partition
+  char* dir; //table directory (64bit format)
+  int nextpart;
+  int err;
+ #ifndef __WIN32__
+  pthread_mutex_t lock;
+ #endif
+};
 
-  u = 0;
-  for (i = 0;i < 256;++i) {
-    u += count[i]; /* bounded by numentries, so no overflow */
-    start[i] = u;
-  }
+//build the tables of a partition and write them at their position;
+//w holds the buffers of the calling thread
+int GCdbWrite::putPart(GCdbTables& tb, int part, GCdbTableBufs& w) {
+  uint32 tbits = tb.tbits;
+  uint32 tmask = (1u << tbits) - 1;
+  uint32 nsub = tb.nsub;
+  uint32 tk0 = part * nsub;
+  uint64 u;
+  #define CDB_TKEY(h) ((((h) & 255) << (tbits - 8)) | (((h) & tmask) >> 8))
+  struct cdb_hp* entries = tb.tsplit;
+  if (spillfd >= 0) {
+    //load the partition, sort its entries by table
+    uint64 n = 0;
+    for (int run = 0;run < numruns;++run) n += spillcnt[run * 256 + part];
+    if (w.pload == NULL) {
+      GMALLOC(w.pload, (tb.maxpart + 1) * sizeof(struct cdb_hp));
+      GMALLOC(w.psplit, (tb.maxpart + 1) * sizeof(struct cdb_hp));
+      }
+    if (loadPart(part, w.pload) == -1) return -1;
+    uint64* tcount = tb.tcount;
+    uint64* tstart = tb.tstart;
+    for (uint32 k = 0;k < nsub;++k) tcount[tk0 + k] = 0;
+    for (u = 0;u < n;++u) ++tcount[CDB_TKEY(w.pload[u].h)];
+    uint64 o = 0;
+    for (uint32 k = 0;k < nsub;++k) {
+      tstart[tk0 + k] = o;
+      o += tcount[tk0 + k];
+      }
+    for (u = 0;u < n;++u) {
+      uint32 k = CDB_TKEY(w.pload[u].h);
+      w.psplit[tstart[k]++] = w.pload[u];
+      }
+    for (uint32 k = 0;k < nsub;++k) tstart[tk0 + k] -= tcount[tk0 + k];
+    entries = w.psplit;
+    }
+  #undef CDB_TKEY
+  uint32 slotsize = slotSize();
+  uint64 opos = tb.ppos[part]; //file position of w.obuf
+  uint32 olen = 0;
+  for (uint32 tk = tk0;tk < tk0 + nsub;++tk) {
+    uint32 t = (tk >> (tbits - 8)) | ((tk & (nsub - 1)) << 8);
+    uint64 n = tb.tcount[tk];
+    uint64 len = n + n;
+    uint64 tpos = opos + olen;
+    if (format64) {
+      uint64_pack(tb.dir + 16 * t, tpos);
+      uint64_pack(tb.dir + 16 * t + 8, len);
+      }
+    else {
+      uint32_pack(final + 8 * t, (uint32)tpos);
+      uint32_pack(final + 8 * t + 4, (uint32)len);
+      }
+    if (len > w.htcap) {
+      w.htcap = len;
+      GREALLOC(w.htable, w.htcap * sizeof(struct cdb_hp));
+      }
+    struct cdb_hp* htable = w.htable;
+    for (u = 0;u < len;++u) {
+      htable[u].h = 0;
+      htable[u].p = 0;
+      }
+    struct cdb_hp* hp = entries + tb.tstart[tk];
+    for (u = 0;u < n;++u) {
+      uint64 where = (hp->h >> tbits) % len;
+      while (htable[where].p)
+        if (++where == len)
+          where = 0;
+      htable[where] = *hp++;
+      }
+    for (u = 0;u < len;++u) {
+      if (olen + slotsize > CDB_TABLE_WBUF) {
+        if (gcdb_pwrite(fd, w.obuf, olen, opos) == -1) return -1;
+        opos += olen;
+        olen = 0;
+        }
+      char* buf = w.obuf + olen;
+      if (locslots) {
+        if (putLocSlot(buf, htable[u], tb.ppos[0], w) == -1) return -1;
+        olen += slotsize;
+        continue;
+        }
+      uint32_pack(buf, htable[u].h);
+      if (format64) {
+        uint32_pack(buf + 4, 0);
+        uint64_pack(buf + 8, htable[u].p);
+        }
+      else uint32_pack(buf + 4, (uint32)htable[u].p);
+      olen += slotsize;
+      }
+    }
+  if (olen > 0 && gcdb_pwrite(fd, w.obuf, olen, opos) == -1) return -1;
+  return 0;
+}
 
-  for (x = head;x;x = x->next) {
-    i = x->num;
-    while (i--)
-      split[--start[255 & x->hp[i].h]] = x->hp[i];
-  }
+//fill a locator slot for entry hp, reading its record back from the
+//index file (the records end at eod)
+int GCdbWrite::putLocSlot(char* slot, struct cdb_hp& hp, uint64 eod,
+                          GCdbTableBufs& w) {
+  memset(slot, 0, CDB_LOC_SLOT);
+  uint32_pack(slot, hp.h);
+  if (hp.p == 0) return 0; //empty slot
+  if (w.rcap == 0) {
+    w.rcap = 256;
+    GMALLOC(w.rbuf, w.rcap);
+    }
+  uint64 n = eod - hp.p; //bytes available
+  if (n < 8) return -1;
+  if (n > w.rcap) n = w.rcap;
+  if (gcdb_pread(fd, w.rbuf, n, hp.p) == -1) return -1;
+  uint32 klen, dlen;
+  uint32_unpack(w.rbuf, &klen);
+  uint32_unpack(w.rbuf + 4, &dlen);
+  uint64 rlen = 8 + (uint64)klen + dlen;
+  if (rlen > eod - hp.p) return -1;
+  if (rlen > n) { //a long key
+    if (rlen > w.rcap) {
+      w.rcap = rlen;
+      GREALLOC(w.rbuf, w.rcap);
+      }
+    if (gcdb_pread(fd, w.rbuf, rlen, hp.p) == -1) return -1;
+    }
+  uint32_pack(slot + 4, (uint32)(cdb_hash64(w.rbuf + 8, klen, foldcase) >> 32));
+  uint64 p = hp.p;
+  if (dlen > 0 && dlen <= CDB_LOC_DATA) {
+    p |= ((uint64)dlen) << 56;
+    memcpy(slot + 16, w.rbuf + 8 + klen, dlen);
+    }
+  uint64_pack(slot + 8, p);
+  return 0;
+}
 
-  for (i = 0;i < 256;++i) {
-    icount = count[i];
+//take the next partition to process, or -1
+static int cdb_nextpart(GCdbTables* tb) {
+ #ifndef __WIN32__
+  pthread_mutex_lock(&tb->lock);
+ #endif
+  int part = (tb->err || tb->nextpart == 256) ? -1 : tb->nextpart++;
+ #ifndef __WIN32__
+  pthread_mutex_unlock(&tb->lock);
+ #endif
+  return part;
+}
 
-    len = icount + icount; /* no overflow possible */
-    uint32_pack(final + 8 * i,pos);
-    uint32_pack(final + 8 * i + 4,len);
+static void* cdb_tablesThread(void* p) {
+  GCdbTables* tb = (GCdbTables*)p;
+  GCdbTableBufs w;
+  int part;
+  while ((part = cdb_nextpart(tb)) >= 0) {
+    if (tb->cdbw->putPart(*tb, part, w) == -1) tb->err = 1;
+    }
+  return NULL;
+}
 
-    for (u = 0;u < len;++u)
-      hash[u].h = hash[u].p = 0;
+int GCdbWrite::finish() {
+  //the 32bit format can only be used if the hash tables end below 4GB
+  if (pos + numentries * 16 > MAX_UINT) format64 = true;
+  GCdbTables tb;
+  tb.cdbw = this;
+  tb.tbits = CDB64_MIN_TBITS; //8 bits: the 256 tables of the 32bit format
+  if (format64) { //more tables for more entries
+    while (tb.tbits < CDB64_MAX_TBITS && (numentries >> tb.tbits) > CDB64_TABLE_KEYS)
+      ++tb.tbits;
+    }
+  uint32 tbits = tb.tbits;
+  uint32 ntables = 1u << tbits;
+  uint32 tmask = ntables - 1;
+  tb.nsub = ntables >> 8;
+  //the tables are written by partition (low 8 bits of the hash), so the
+  //spilled entries can be processed one partition at a time, and the
+  //partitions can be processed in parallel; tk is the index of a table
+  //in this order
+  #define CDB_TKEY(h) ((((h) & 255) << (tbits - 8)) | (((h) & tmask) >> 8))
+  tb.tcount = NULL;
+  tb.tstart = NULL;
+  GCALLOC(tb.tcount, ntables * sizeof(uint64));
+  GMALLOC(tb.tstart, ntables * sizeof(uint64));
+  tb.tsplit = NULL;
+  tb.maxpart = 0;
+  tb.dir = NULL;
+  tb.nextpart = 0;
+  tb.err = 0;
+  memTrack(ntables * 2 * sizeof(uint64));
+  uint64 pcount[256]; //entries in each partition
+  memset(pcount, 0, sizeof(pcount));
+  struct cdb_hp* hp = hps.entries();
+  uint64 nmem = hps.size();
+  uint64 u;
+  if (spillfd >= 0) {
+    if (spill() == -1) tb.err = 1;
+    for (int p = 0;p < 256;++p) {
+      for (int run = 0;run < numruns;++run) pcount[p] += spillcnt[run * 256 + p];
+      if (pcount[p] > tb.maxpart) tb.maxpart = pcount[p];
+      }
+    }
+  else {
+    for (u = 0;u < nmem;++u)
+      ++tb.tcount[CDB_TKEY(hp[u].h)];
+    u = 0;
+    for (uint32 tk = 0;tk < ntables;++tk) {
+      pcount[tk / tb.nsub] += tb.tcount[tk];
+      u += tb.tcount[tk];
+      tb.tstart[tk] = u;
+      }
+    GMALLOC(tb.tsplit, (nmem + 1) * sizeof(struct cdb_hp));
+    memTrack(nmem * sizeof(struct cdb_hp));
+    for (u = nmem;u > 0;--u)
+      tb.tsplit[--tb.tstart[CDB_TKEY(hp[u-1].h)]] = hp[u-1];
+    }
+  //the entries are no longer needed
+  memTrack(-(int64)hps.memSize());
+  hps.release();
+  #undef CDB_TKEY
+  //the position of each partition's tables in the file
+  uint64 eod = pos;
+  if (locslots && eod > CDB_LOC_POSMASK) return -1;
+  uint32 slotsize = slotSize();
+  tb.ppos[0] = eod;
+  for (int p = 0;p < 256;++p)
+    tb.ppos[p + 1] = tb.ppos[p] + pcount[p] * 2 * slotsize;
+  if (format64) GMALLOC(tb.dir, ntables * 16);
+  if (cdbuf->sync() == -1) tb.err = 1;
+  double ttstart = gcdb_time();
+  int nthreads = (numthreads < 256) ? numthreads : 256;
+  //buffers of each thread: output, the largest table and the partitions
+  uint64 maxtable = 0;
+  for (uint32 tk = 0;tk < ntables;++tk)
+    if (tb.tcount[tk] > maxtable) maxtable = tb.tcount[tk];
+  if (spillfd >= 0) maxtable = tb.maxpart;
+  uint64 tbufs = CDB_TABLE_WBUF + maxtable * 2 * sizeof(struct cdb_hp);
+  if (spillfd >= 0) tbufs += tb.maxpart * 2 * sizeof(struct cdb_hp);
+  int64 fmem = (format64 ? ntables * 16 : 0) + nthreads * tbufs;
+  memTrack(fmem);
+ #ifndef __WIN32__
+  if (nthreads > 1 && !tb.err) {
+    pthread_mutex_init(&tb.lock, NULL);
+    pthread_t* tids = NULL;
+    GMALLOC(tids, nthreads * sizeof(pthread_t));
+    int nt = 0;
+    for (;nt < nthreads;++nt)
+      if (pthread_create(&tids[nt], NULL, &cdb_tablesThread, &tb) != 0) break;
+    if (nt == 0) cdb_tablesThread(&tb);
+    for (int i = 0;i < nt;++i) pthread_join(tids[i], NULL);
+    GFREE(tids);
+    pthread_mutex_destroy(&tb.lock);
+    }
+  else
+ #endif
+  if (!tb.err) {
+   #ifndef __WIN32__
+    pthread_mutex_init(&tb.lock, NULL);
+   #endif
+    cdb_tablesThread(&tb);
+   #ifndef __WIN32__
+    pthread_mutex_destroy(&tb.lock);
+   #endif
+    }
+  pos = tb.ppos[256];
+  tbytes += pos - eod;
+  ttime += gcdb_time() - ttstart;
+  uint64 dpos = pos;
+  if (!tb.err && format64) {
+    if (gcdb_seek_set(fd, (gcdb_seek_pos)pos) == -1 ||
+        cdbuf->put(tb.dir, ntables * 16) == -1 ||
+        posplus(ntables * 16) == -1) tb.err = 1;
+    }
+  GFREE(tb.dir);
+  GFREE(tb.tsplit);
+  GFREE(tb.tstart);
+  GFREE(tb.tcount);
+  curmem = 0;
+  if (spillfd >= 0) {
+    ::close(spillfd);
+    spillfd = -1;
+    remove(spillname);
+    }
+  if (tb.err) return -1;
+  if (format64) {
+    memset(final, 0, sizeof(final));
+    uint64_pack(final + CDB64_HEADER_EOD, eod);
+    uint64_pack(final + CDB64_HEADER_DIR, dpos);
+    uint32_pack(final + CDB64_HEADER_TBITS, tbits);
+    if (locslots) uint32_pack(final + CDB64_HEADER_SLOT, CDB_LOC_SLOT);
+    }
+  if (cdbuf->sync() == -1) return -1;
+  if (gcdb_seek_begin(fd) == -1) return -1;
+  return cdbuf->putflush(final,sizeof(final));
+}
 
-    hp = split + start[i];
-    for (u = 0;u < icount;++u) {
-      where = (hp->h >> 8) % len;
-      while (hash[where].p)
-	if (++where == len)
-	  where = 0;
-      hash[where] = *hp++;
+//=====================================================
+//-------- minimal perfect hash index (GCdbMphWrite) --
+//=====================================================
+struct GCdbMphEntry {
+  uint64 h; //cdb_hash64() of the key
+  uint64 fpos;
+  uint32 reclen;
+  uint32 fid;
+};
+
+static int cmpMphEntry(const void* p1, const void* p2) {
+  const GCdbMphEntry* a = (const GCdbMphEntry*)p1;
+  const GCdbMphEntry* b = (const GCdbMphEntry*)p2;
+  if (a->h != b->h) return (a->h < b->h) ? -1 : 1;
+  if (a->fid != b->fid) return (a->fid < b->fid) ? -1 : 1;
+  if (a->fpos != b->fpos) return (a->fpos < b->fpos) ? -1 : 1;
+  return 0;
+}
+
+//number of bits needed for v
+static uint32 cdb_bitwidth(uint64 v) {
+  uint32 w = 0;
+  while (v) { ++w; v >>= 1; }
+  return w;
+}
+
+//bit-packed array, written from the lowest bits of each byte
+struct GCdbBitArray {
+  char* data;
+  uint64 len;
+  uint64 cap;
+  uint64 acc;
+  uint32 accbits;
+  GCdbBitArray():data(NULL),len(0),cap(0),acc(0),accbits(0) { }
+  ~GCdbBitArray() { GFREE(data); }
+  void putbyte(char c) {
+    if (len == cap) {
+      cap = (cap == 0) ? 65536 : cap * 2;
+      GREALLOC(data, cap);
+      }
+    data[len++] = c;
     }
+  void put(uint64 v, uint32 width) {
+    if (width > 32) {
+      put(v & 0xFFFFFFFFULL, 32);
+      put(v >> 32, width - 32);
+      return;
+      }
+    if (width == 0) return;
+    acc |= (v & ((((uint64)1) << width) - 1)) << accbits;
+    accbits += width;
+    while (accbits >= 8) {
+      putbyte((char)(acc & 0xFF));
+      acc >>= 8;
+      accbits -= 8;
+      }
+    }
+  //flush the last bits and pad the array, so a reader can always load
+  //9 bytes from any bit position
+  void finish() {
+    if (accbits) putbyte((char)(acc & 0xFF));
+    acc = 0;
+    accbits = 0;
+    for (int i = 0;i < 16;++i) putbyte(0);
+    }
+};
 
-    for (u = 0;u < len;++u) {
-      uint32_pack(buf,hash[u].h);
-      uint32_pack(buf + 4,hash[u].p);
-      if (cdbuf->putalign(buf,8) == -1) return -1;
-      if (posplus(8) == -1) return -1;
+GCdbMphWrite::GCdbMphWrite(uint32 fpb, bool fold, bool multifile) {
+  entries = NULL;
+  count = 0;
+  cap = 0;
+  fpbits = (fpb > 32) ? 32 : fpb;
+  foldcase = fold;
+  mfile = multifile;
+  numkeys = 0;
+  maxpos = 0;
+  maxlen = 0;
+  maxfid = 0;
+  keyofs = 0;
+}
+
+GCdbMphWrite::~GCdbMphWrite() {
+  GFREE(entries);
+}
+
+int GCdbMphWrite::addRecords(int fd, uint64 from, uint64 to) {
+  uint32 bcap = CDB_TABLE_WBUF;
+  char* buf = NULL;
+  GMALLOC(buf, bcap);
+  uint64 bpos = from; //file position of buf[0]
+  uint64 blen = 0;
+  uint64 pos = from;
+  int r = 0;
+  while (pos < to) {
+    uint32 klen = 0, dlen = 0;
+    //the record header, then the whole record must be in buf
+    for (int pass = 0;pass < 2;++pass) {
+      uint64 need = (pass == 0) ? 8 : 8 + (uint64)klen + dlen;
+      if (pos + need > to) { r = -1; break; }
+      if (pos + need > bpos + blen) {
+        if (need > bcap) {
+          bcap = (uint32)need;
+          GREALLOC(buf, bcap);
+          }
+        bpos = pos;
+        blen = (to - pos < bcap) ? to - pos : bcap;
+        if (gcdb_pread(fd, buf, blen, bpos) == -1) { r = -1; break; }
+        }
+      if (pass == 0) {
+        uint32_unpack(buf + (pos - bpos), &klen);
+        uint32_unpack(buf + (pos - bpos) + 4, &dlen);
+        }
+      }
+    if (r == -1) break;
+    char* key = buf + (pos - bpos) + 8;
+    char* data = key + klen;
+    pos += 8 + (uint64)klen + dlen;
+    uint32 rlen = dlen;
+    uint32 fid = 0;
+    if (mfile) {
+      if (rlen < sizeof(int16_t)) GError("GCdbMphWrite: invalid record data!\n");
+      rlen -= sizeof(int16_t);
+      fid = (uint16_t)gcvt_int16(data + rlen);
+      }
+    GCdbMphEntry e;
+    e.h = cdb_hash64(key, klen, foldcase);
+    e.fid = fid;
+    if ((int)rlen == IdxDataSIZE) {
+      e.fpos = (uint64)gcvt_offt(data);
+      e.reclen = gcvt_uint(data + offsetof(CIdxData, reclen));
+      }
+    else if ((int)rlen == IdxDataSIZE32) {
+      e.fpos = gcvt_uint(data);
+      e.reclen = gcvt_uint(data + offsetof(CIdxData32, reclen));
+      }
+    else GError("GCdbMphWrite: unsupported record data (length %d)!\n", dlen);
+    if (count == cap) {
+      cap = (cap == 0) ? 65536 : cap * 2;
+      GREALLOC(entries, cap * sizeof(GCdbMphEntry));
+      }
+    entries[count++] = e;
+    if (e.fpos > maxpos) maxpos = e.fpos;
+    if (e.reclen > maxlen) maxlen = e.reclen;
+    if (fid > maxfid) maxfid = fid;
     }
-  }
+  GFREE(buf);
+  return r;
+}
 
-  if (cdbuf->flush() == -1) return -1;
-  if (gcdb_seek_begin(fd) == -1) return -1;
-  return cdbuf->putflush(final,sizeof(final));
+//hash & displace for the n distinct key hashes of a partition (hh,
+//already mixed with the seed): sets the displacement of each bucket and
+//the key placed in each slot; returns the largest displacement, or -1
+//if a bucket could not be placed
+static int64 cdb_mphplace(uint64* hh, uint32 n, uint32* disp, uint32* slotkey,
+                          uint32* bstart, uint32* bkeys, uint32* border, uint32* bpos) {
+  uint32 nb = n / CDB_MPH_BUCKET_KEYS + 1;
+  memset(bstart, 0, (nb + 1) * sizeof(uint32));
+  for (uint32 i = 0;i < n;++i) ++bstart[cdb_mphrange((uint32)(hh[i] >> 32), nb) + 1];
+  uint32 maxbsize = 0;
+  for (uint32 b = 0;b < nb;++b) {
+    if (bstart[b + 1] > maxbsize) maxbsize = bstart[b + 1];
+    bstart[b + 1] += bstart[b];
+    }
+  //border is used for filling the buckets first
+  memcpy(border, bstart, nb * sizeof(uint32));
+  for (uint32 i = 0;i < n;++i)
+    bkeys[border[cdb_mphrange((uint32)(hh[i] >> 32), nb)]++] = i;
+  //buckets are placed in decreasing size order (a counting sort)
+  uint32* scount = NULL;
+  GCALLOC(scount, (maxbsize + 2) * sizeof(uint32));
+  for (uint32 b = 0;b < nb;++b) ++scount[maxbsize - (bstart[b + 1] - bstart[b]) + 1];
+  for (uint32 s = 0;s <= maxbsize;++s) scount[s + 1] += scount[s];
+  for (uint32 b = 0;b < nb;++b) border[scount[maxbsize - (bstart[b + 1] - bstart[b])]++] = b;
+  GFREE(scount);
+  memset(disp, 0, nb * sizeof(uint32));
+  for (uint32 i = 0;i < n;++i) slotkey[i] = MAX_UINT;
+  int64 maxd = 0;
+  for (uint32 bi = 0;bi < nb;++bi) {
+    uint32 b = border[bi];
+    uint32 bsize = bstart[b + 1] - bstart[b];
+    if (bsize == 0) break; //only empty buckets left
+    uint32* bk = bkeys + bstart[b];
+    uint32 d = 0;
+    for (;d < CDB_MPH_MAX_DISP;++d) {
+      uint32 j = 0;
+      for (;j < bsize;++j) {
+        uint32 p = cdb_mphslot(hh[bk[j]], d, n);
+        if (slotkey[p] != MAX_UINT) break;
+        slotkey[p] = bk[j];
+        bpos[j] = p;
+        }
+      if (j == bsize) break; //all the keys of the bucket were placed
+      while (j > 0) slotkey[bpos[--j]] = MAX_UINT;
+      }
+    if (d == CDB_MPH_MAX_DISP) return -1;
+    disp[b] = d;
+    if (d > maxd) maxd = d;
+    }
+  return maxd;
+}
+
+int GCdbMphWrite::write(int fd) {
+  uint32 nparts = (uint32)(count / CDB_MPH_PART_KEYS + 1);
+  //group the entries by partition, sorted by hash in each partition
+  uint64* pstart = NULL;
+  GCALLOC(pstart, ((uint64)nparts + 1) * sizeof(uint64));
+  uint64 i;
+  for (i = 0;i < count;++i) ++pstart[cdb_mphrange((uint32)(entries[i].h >> 32), nparts) + 1];
+  for (uint32 p = 0;p < nparts;++p) pstart[p + 1] += pstart[p];
+  GCdbMphEntry* sorted = NULL;
+  GMALLOC(sorted, (count + 1) * sizeof(GCdbMphEntry));
+  uint64* pfill = NULL;
+  GMALLOC(pfill, (uint64)nparts * sizeof(uint64));
+  memcpy(pfill, pstart, (uint64)nparts * sizeof(uint64));
+  for (i = 0;i < count;++i)
+    sorted[pfill[cdb_mphrange((uint32)(entries[i].h >> 32), nparts)]++] = entries[i];
+  GFREE(pfill);
+  GFREE(entries);
+  cap = 0;
+  uint32 posbits = cdb_bitwidth(maxpos);
+  uint32 lenbits = cdb_bitwidth(maxlen);
+  uint32 fidbits = mfile ? cdb_bitwidth(maxfid) : 0;
+  uint32 startbits = cdb_bitwidth(count);
+  uint64 fpmask = (((uint64)1) << fpbits) - 1;
+  //the partition table and the displacements of all the buckets
+  char* parts = NULL;
+  GMALLOC(parts, (uint64)nparts * CDB_MPH_PART);
+  uint64 nbuckets = 0;
+  for (uint32 p = 0;p < nparts;++p) nbuckets += (pstart[p + 1] - pstart[p]) / CDB_MPH_BUCKET_KEYS + 1;
+  uint32* disps = NULL;
+  GMALLOC(disps, nbuckets * sizeof(uint32));
+  GCdbBitArray fps, locs, starts;
+  //working buffers, for the largest partition
+  uint64 maxpart = 0;
+  for (uint32 p = 0;p < nparts;++p)
+    if (pstart[p + 1] - pstart[p] > maxpart) maxpart = pstart[p + 1] - pstart[p];
+  uint64* hh = NULL;
+  uint32 *kfirst = NULL, *slotkey = NULL, *bstart = NULL, *bkeys = NULL, *border = NULL, *bpos = NULL;
+  GMALLOC(hh, (maxpart + 1) * sizeof(uint64));
+  GMALLOC(kfirst, (maxpart + 2) * sizeof(uint32));
+  GMALLOC(slotkey, (maxpart + 1) * sizeof(uint32));
+  GMALLOC(bstart, (maxpart / CDB_MPH_BUCKET_KEYS + 2) * sizeof(uint32));
+  GMALLOC(bkeys, (maxpart + 1) * sizeof(uint32));
+  GMALLOC(border, (maxpart / CDB_MPH_BUCKET_KEYS + 2) * sizeof(uint32));
+  GMALLOC(bpos, (maxpart + 1) * sizeof(uint32));
+  uint32 maxdisp = 0;
+  uint64 slotbase = 0, bucketbase = 0, nloc = 0;
+  numkeys = 0;
+  for (uint32 p = 0;p < nparts;++p) {
+    GCdbMphEntry* pe = sorted + pstart[p];
+    uint32 m = (uint32)(pstart[p + 1] - pstart[p]);
+    qsort(pe, m, sizeof(GCdbMphEntry), cmpMphEntry);
+    //distinct hashes: the entries with the same hash share a slot
+    uint32 nk = 0;
+    for (uint32 j = 0;j < m;++j)
+      if (j == 0 || pe[j].h != pe[j - 1].h) kfirst[nk++] = j;
+    kfirst[nk] = m;
+    uint32 nb = nk / CDB_MPH_BUCKET_KEYS + 1;
+    uint32 seed = 0;
+    int64 maxd = -1;
+    if (nk > 0) {
+      for (;seed < CDB_MPH_MAX_SEEDS;++seed) {
+        for (uint32 k = 0;k < nk;++k) hh[k] = cdb_mphmix(pe[kfirst[k]].h, seed);
+        maxd = cdb_mphplace(hh, nk, disps + bucketbase, slotkey, bstart, bkeys, border, bpos);
+        if (maxd >= 0) break;
+        }
+      if (maxd < 0)
+        GError("Error: failed to build the perfect hash for partition %u (%u keys)!\n", p, nk);
+      if ((uint32)maxd > maxdisp) maxdisp = (uint32)maxd;
+      }
+    else memset(disps + bucketbase, 0, nb * sizeof(uint32));
+    char* pr = parts + (uint64)p * CDB_MPH_PART;
+    uint64_pack(pr, slotbase);
+    uint64_pack(pr + 8, bucketbase);
+    uint32_pack(pr + 16, seed);
+    uint32_pack(pr + 20, nk);
+    for (uint32 s = 0;s < nk;++s) {
+      uint32 k = slotkey[s];
+      fps.put(pe[kfirst[k]].h & fpmask, fpbits);
+      starts.put(nloc, startbits);
+      for (uint32 j = kfirst[k];j < kfirst[k + 1];++j) {
+        locs.put(pe[j].fpos, posbits);
+        locs.put(pe[j].reclen, lenbits);
+        locs.put(pe[j].fid, fidbits);
+        ++nloc;
+        }
+      }
+    slotbase += nk;
+    bucketbase += nb;
+    numkeys += nk;
+    }
+  starts.put(nloc, startbits);
+  GFREE(bpos);
+  GFREE(border);
+  GFREE(bkeys);
+  GFREE(bstart);
+  GFREE(slotkey);
+  GFREE(kfirst);
+  GFREE(hh);
+  GFREE(sorted);
+  GFREE(pstart);
+  //a single locator per slot: the slot gives the locator
+  if (numkeys == count) {
+    GFREE(starts.data);
+    starts.len = 0;
+    starts.cap = 0;
+    startbits = 0;
+    }
+  else starts.finish();
+  fps.finish();
+  locs.finish();
+  uint32 dispbits = cdb_bitwidth(maxdisp);
+  GCdbBitArray dbits;
+  for (i = 0;i < nbuckets;++i) dbits.put(disps[i], dispbits);
+  dbits.finish();
+  GFREE(disps);
+  char hdr[CDB_MPH_HEADER];
+  memset(hdr, 0, sizeof(hdr));
+  uint64 partpos = CDB_MPH_HEADER;
+  uint64 disppos = partpos + (uint64)nparts * CDB_MPH_PART;
+  uint64 fppos = disppos + dbits.len;
+  uint64 locpos = fppos + fps.len;
+  uint64 startpos = locpos + locs.len;
+  uint64_pack(hdr + CDB_MPH_H_KEYS, numkeys);
+  uint64_pack(hdr + CDB_MPH_H_ENTRIES, count);
+  uint32_pack(hdr + CDB_MPH_H_PARTS, nparts);
+  uint32_pack(hdr + CDB_MPH_H_FPBITS, fpbits);
+  uint32_pack(hdr + CDB_MPH_H_DISPBITS, dispbits);
+  uint32_pack(hdr + CDB_MPH_H_POSBITS, posbits);
+  uint32_pack(hdr + CDB_MPH_H_LENBITS, lenbits);
+  uint32_pack(hdr + CDB_MPH_H_FIDBITS, fidbits);
+  uint32_pack(hdr + CDB_MPH_H_STARTBITS, startbits);
+  uint32_pack(hdr + CDB_MPH_H_MFILE, mfile ? 1 : 0);
+  uint64_pack(hdr + CDB_MPH_H_PARTPOS, partpos);
+  uint64_pack(hdr + CDB_MPH_H_DISPPOS, disppos);
+  uint64_pack(hdr + CDB_MPH_H_FPPOS, fppos);
+  uint64_pack(hdr + CDB_MPH_H_LOCPOS, locpos);
+  uint64_pack(hdr + CDB_MPH_H_STARTPOS, startpos);
+  uint32_pack(hdr + CDB_MPH_H_KEYOFS, keyofs);
+  int r = 0;
+  if (gcdb_pwrite(fd, hdr, CDB_MPH_HEADER, 0) == -1 ||
+      gcdb_pwrite(fd, parts, (uint64)nparts * CDB_MPH_PART, partpos) == -1 ||
+      gcdb_pwrite(fd, dbits.data, dbits.len, disppos) == -1 ||
+      gcdb_pwrite(fd, fps.data, fps.len, fppos) == -1 ||
+      gcdb_pwrite(fd, locs.data, locs.len, locpos) == -1 ||
+      (starts.len > 0 && gcdb_pwrite(fd, starts.data, starts.len, startpos) == -1))
+    r = -1;
+  GFREE(parts);
+  count = 0;
+  if (r == 0 && gcdb_seek_set(fd, (gcdb_seek_pos)(startpos + starts.len)) == -1) r = -1;
+  return r;
 }
 
 //=====================================================
@@ -793,41 +1815,70 @@ uint32 cdb_hash(const char *buf,unsigned int len) {
   return h;
 }
 
+uint32 cdb_hash_fold(const char *buf,unsigned int len) {
+  uint32 h;
+  h = CDB_HASHSTART;
+  while (len) {
+    h = cdb_hashadd(h,cdb_lower(*buf++));
+    --len;
+    }
+  return h;
+}
+
+//8 key bytes as a little endian word
+static inline uint64 cdb_word(const char* buf) {
+  uint64 v;
+  memcpy(&v, buf, 8);
+ #if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  v = __builtin_bswap64(v);
+ #endif
+  return v;
+}
+
+//ASCII lowercase of the 8 bytes of a word
+static inline uint64 cdb_lower64(uint64 v) {
+  const uint64 ones = 0x0101010101010101ULL;
+  uint64 b7 = v & (0x7f * ones);
+  uint64 geA = b7 + (0x80 - 'A') * ones; //high bit set for bytes >= 'A'
+  uint64 gtZ = b7 + (0x7f - 'Z') * ones; //high bit set for bytes > 'Z'
+  return v | (((geA ^ gtZ) & ~v & (0x80 * ones)) >> 2);
+}
+
+uint64 cdb_hash64(const char* key, unsigned int len, bool fold) {
+  const uint64 m = 0x9E3779B97F4A7C15ULL;
+  uint64 h = (0x27D4EB2F165667C5ULL ^ ((uint64)len * m)) * m;
+  while (len >= 8) {
+    uint64 v = cdb_word(key);
+    if (fold) v = cdb_lower64(v);
+    h = (h ^ v) * m;
+    h ^= h >> 29;
+    key += 8;
+    len -= 8;
+    }
+  if (len > 0) {
+    uint64 v = 0;
+    for (unsigned int i = 0;i < len;++i)
+      v |= ((uint64)(uchar)(fold ? cdb_lower(key[i]) : key[i])) << (i * 8);
+    h = (h ^ v) * m;
+    h ^= h >> 29;
+    }
+  h *= 0xBF58476D1CE4E5B9ULL;
+  h ^= h >> 32;
+  return h;
+}
+
 //---------------------------------------------------------------
 //-------------------------- cdb methods ------------------------
 
-GCdbRead::GCdbRead(int afd):map(NULL),loop(0) {
-  struct stat st;
-  char *x;
-  gcvt_endian_setup();
-  findstart();
+GCdbRead::GCdbRead(int afd):map(NULL),loop(0),foldhash(false),foldcmp(false),
+      hashv(CDB_HASH_DJB),keycheck(true) {
   fd = afd;
-  if (fstat(fd,&st) == 0) {
-    if (st.st_size <= MAX_UINT) {
-      #ifndef NO_MMAP
-      x = (char *) mmap(0,st.st_size,PROT_READ,MAP_SHARED,fd,0);
-      if (x + 1) {
-        size = st.st_size;
-        map = x;
-        }
-       else {
-         GError("Error mapping the file (size=%ld)!\n",st.st_size);
-         }
-      #endif
-       }
-    else {
-       GError("Error mapping the file (size %ld > MAX_UINT)\n",
-           st.st_size);
-       }
-    }
+  fname[0]='\0';
+  init();
 }
 
-GCdbRead::GCdbRead(char* afname):map(NULL) {
-  struct stat st;
-  char *x;
-  gcvt_endian_setup();
-
-  findstart();
+GCdbRead::GCdbRead(char* afname):map(NULL),loop(0),foldhash(false),foldcmp(false),
+      hashv(CDB_HASH_DJB),keycheck(true) {
   #ifdef __WIN32__
     fd = open(afname, O_RDONLY|O_BINARY);
   #else
@@ -836,44 +1887,164 @@ GCdbRead::GCdbRead(char* afname):map(NULL) {
   if (fd == -1)
      GError("Error: cannot open file %s\n", afname);
   strcpy(fname, afname);
+  init();
+}
+
+void GCdbRead::init() {
+  struct stat st;
+  char *x;
+  gcvt_endian_setup();
+  findstart();
+  is64=false;
+  tbits=0;
+  dirpos=0;
+  locslots=false;
+  ldinline=false;
+  mph=false;
+  mphentries=0;
+  mphkeyofs=0;
+  maplen=0;
+  size=0;
+  mapclock=0;
+  memset(blocks, 0, sizeof(blocks));
   if (fstat(fd,&st) == 0) {
-    if (st.st_size <= MAX_UINT) {
-     #ifndef NO_MMAP
-      x = (char *) mmap(0,st.st_size,PROT_READ,MAP_SHARED,fd,0);
-      if (x + 1) {
-        size = st.st_size;
+    size = st.st_size;
+   #ifndef NO_MMAP
+    //small files are mapped whole, larger ones only have the header
+    //mapped here (see MCDB_MAP_BLOCKS)
+    uint64 mlen = size;
+    if (mlen > (uint64)MCDB_MAP_BLOCKS * MCDB_BLOCK_SZ) mlen = MCDB_MMAP_SZ;
+    if (mlen > 0) {
+      x = (char *) mmap(0,(size_t)mlen,PROT_READ,MAP_SHARED,fd,0);
+      if (x != MAP_FAILED) {
+        maplen = (uintptr_t)mlen;
         map = x;
         }
        else {
-         GError("GCdbRead: Error mapping the file (size=%ld)!\n",st.st_size);
+         GError("GCdbRead: Error mapping the file (size=%lld)!\n",
+             (long long)st.st_size);
          }
-      #endif
       }
-    else {
-       GError("GCdbRead: Error mapping the file (size %ld > MAX_UINT)\n",
-           st.st_size);
-       }
+   #endif
+    //64bit index files have the "CD64" tag at the end
+    char tag[4];
+    if (st.st_size > CDB_MPH_HEADER+4 && GCdbRead::read(tag, 4, st.st_size-4) == 0 &&
+        strncmp(tag, "CMPH", 4) == 0) {
+      //minimal perfect hash index
+      if (GCdbRead::read(mphhdr, CDB_MPH_HEADER, 0) == -1)
+        GError("GCdbRead: Error reading the header of %s\n", fname);
+      is64=true; //same footer as the 64bit index files
+      mph=true;
+      uint32 mf;
+      uint64_unpack(mphhdr + CDB_MPH_H_KEYS, &mphkeys);
+      uint64_unpack(mphhdr + CDB_MPH_H_ENTRIES, &mphentries);
+      uint32_unpack(mphhdr + CDB_MPH_H_KEYOFS, &mphkeyofs);
+      uint32_unpack(mphhdr + CDB_MPH_H_PARTS, &mphparts);
+      uint32_unpack(mphhdr + CDB_MPH_H_FPBITS, &fpbits);
+      uint32_unpack(mphhdr + CDB_MPH_H_DISPBITS, &dispbits);
+      uint32_unpack(mphhdr + CDB_MPH_H_POSBITS, &posbits);
+      uint32_unpack(mphhdr + CDB_MPH_H_LENBITS, &lenbits);
+      uint32_unpack(mphhdr + CDB_MPH_H_FIDBITS, &fidbits);
+      uint32_unpack(mphhdr + CDB_MPH_H_STARTBITS, &startbits);
+      uint32_unpack(mphhdr + CDB_MPH_H_MFILE, &mf);
+      mphmfile = (mf != 0);
+      uint64_unpack(mphhdr + CDB_MPH_H_PARTPOS, &partpos);
+      uint64_unpack(mphhdr + CDB_MPH_H_DISPPOS, &disppos);
+      uint64_unpack(mphhdr + CDB_MPH_H_FPPOS, &fppos);
+      uint64_unpack(mphhdr + CDB_MPH_H_LOCPOS, &locpos);
+      uint64_unpack(mphhdr + CDB_MPH_H_STARTPOS, &startpos);
+      if (mphparts == 0 || fpbits > 32 || dispbits > 32 || posbits > 64 ||
+          lenbits > 32 || fidbits > 16 || startbits > 64)
+        GError("GCdbRead: Invalid header found in %s\n", fname);
+      }
+    else if (st.st_size > 2048+4 && GCdbRead::read(tag, 4, st.st_size-4) == 0 &&
+        strncmp(tag, "CD64", 4) == 0) {
+      char buf[24];
+      if (GCdbRead::read(buf, 24, 0) == -1)
+        GError("GCdbRead: Error reading the header of %s\n", fname);
+      is64=true;
+      uint64_unpack(buf + CDB64_HEADER_DIR, &dirpos);
+      uint32_unpack(buf + CDB64_HEADER_TBITS, &tbits);
+      uint32 slotsize;
+      uint32_unpack(buf + CDB64_HEADER_SLOT, &slotsize);
+      if (tbits < CDB64_MIN_TBITS || tbits > CDB64_MAX_TBITS ||
+          (slotsize != 0 && slotsize != 16 && slotsize != CDB_LOC_SLOT))
+        GError("GCdbRead: Invalid header found in %s\n", fname);
+      locslots = (slotsize == CDB_LOC_SLOT);
+      }
    }
 }
 
-
 GCdbRead::~GCdbRead() {
   if (map!=NULL) {
-    munmap(map,size);
+    munmap(map,maplen);
     map = NULL;
     }
+  for (int i = 0;i < MCDB_MAP_BLOCKS;++i)
+    if (blocks[i].map != NULL) munmap(blocks[i].map, blocks[i].len);
+}
+
+//the mapped block of the file holding position pos (mapped now if
+//needed, replacing the least recently used one); NULL if the block
+//cannot be mapped
+char* GCdbRead::mapblock(uint64 pos, uint64& bstart, uint32& blen) {
+ #ifndef NO_MMAP
+  uint64 start = pos - pos % MCDB_BLOCK_SZ;
+  int lru = 0;
+  for (int i = 0;i < MCDB_MAP_BLOCKS;++i) {
+    GCdbMapBlock& b = blocks[i];
+    if (b.map != NULL && b.start == start) {
+      b.lastuse = ++mapclock;
+      bstart = start;
+      blen = b.len;
+      return b.map;
+      }
+    if (blocks[lru].map != NULL &&
+        (b.map == NULL || b.lastuse < blocks[lru].lastuse)) lru = i;
+    }
+  GCdbMapBlock& b = blocks[lru];
+  if (b.map != NULL) {
+    munmap(b.map, b.len);
+    b.map = NULL;
+    }
+  uint32 len = (size - start < MCDB_BLOCK_SZ) ? (uint32)(size - start) : MCDB_BLOCK_SZ;
+  char* x = (char *) mmap(0, len, PROT_READ, MAP_SHARED, fd, (off_t)start);
+  if (x == MAP_FAILED) return NULL;
+  b.map = x;
+  b.start = start;
+  b.len = len;
+  b.lastuse = ++mapclock;
+  bstart = start;
+  blen = len;
+  return x;
+ #else
+  return NULL;
+ #endif
 }
 
-int GCdbRead::read(char *buf,unsigned int len, uint32 pos) {
+int GCdbRead::read(char *buf,unsigned int len, uint64 pos) {
+  if ((pos > size) || (size - pos < len)) {
+        /* errno = error_proto; */
+        return -1;
+        }
   #ifndef NO_MMAP
-  if (map) {
-    if ((pos > size) || (size - pos < len)) {
-          /* errno = error_proto; */
-          return -1;
-          }
+  if (pos + len <= maplen) {
     gcdb_byte_copy(buf, len, map + pos);
+    return 0;
     }
-  else
+  while (map != NULL && len > 0) { //windowed access
+    uint64 bstart;
+    uint32 blen;
+    char* b = mapblock(pos, bstart, blen);
+    if (b == NULL) break; //read the rest from the file
+    uint32 n = blen - (uint32)(pos - bstart);
+    if (n > len) n = len;
+    gcdb_byte_copy(buf, n, b + (pos - bstart));
+    buf += n;
+    pos += n;
+    len -= n;
+    }
+  if (len == 0) return 0;
   #endif
     {
     if (gcdb_seek_set(fd,pos) == -1) return -1;
@@ -894,14 +2065,18 @@ int GCdbRead::read(char *buf,unsigned int len, uint32 pos) {
   return 0;
 }
 
-int GCdbRead::match(const char *key, unsigned int len, uint32 pos) {
+int GCdbRead::match(const char *key, unsigned int len, uint64 pos) {
   char buf[32];
   unsigned int n;
   while (len > 0) {
     n = sizeof buf;
     if (n > len) n = len;
     if (GCdbRead::read(buf,n,pos) == -1) return -1;
-    if (byte_diff(buf,n,(char*)key)) return 0;
+    if (foldcmp) {
+      for (unsigned int i=0;i<n;i++)
+        if (cdb_lower(buf[i])!=cdb_lower(key[i])) return 0;
+      }
+    else if (byte_diff(buf,n,(char*)key)) return 0;
     pos += n;
     key += n;
     len -= n;
@@ -910,31 +2085,69 @@ int GCdbRead::match(const char *key, unsigned int len, uint32 pos) {
 }
 
 int GCdbRead::findnext(const char *key,unsigned int len) {
-  char buf[8];
-  uint32 pos;
+  char buf[CDB_LOC_SLOT];
+  uint64 pos;
   uint32 u;
+  uint32 ldlen = 0; //record data length in a locator slot
+  //hash table slot size
+  uint32 slotsize = is64 ? (locslots ? CDB_LOC_SLOT : 16) : 8;
+  if (mph) return mphnext(key, len);
   if (!loop) {
-    u = cdb_hash(key,len);
-    if (GCdbRead::read(buf,8,(u << 3) & 2047) == -1) return -1;
-    uint32_unpack(buf + 4,&hslots);
-    if (!hslots) return 0;
-    uint32_unpack(buf,&pos);
-    hpos=pos;
+    u = cdb_keyhash(hashv, key, len, foldhash);
     khash = u;
-    u >>= 8;
-    u %= hslots;
-    u <<= 3;
-    kpos = hpos + u;
+    if (locslots) kfp = (uint32)(cdb_hash64(key, len, foldhash) >> 32);
+    if (is64) {
+      if (GCdbRead::read(buf,16,dirpos+((uint64)(u & ((1u<<tbits)-1))<<4)) == -1)
+        return -1;
+      uint64_unpack(buf + 8,&hslots);
+      if (!hslots) return 0;
+      uint64_unpack(buf,&hpos);
+      kpos = hpos + ((u >> tbits) % hslots) * slotsize;
+      }
+    else {
+      uint32 p32, n32;
+      if (GCdbRead::read(buf,8,(u << 3) & 2047) == -1) return -1;
+      uint32_unpack(buf + 4,&n32);
+      if (!n32) return 0;
+      hslots=n32;
+      uint32_unpack(buf,&p32);
+      hpos=p32;
+      kpos = hpos + ((u >> 8) % n32) * slotsize;
+      }
     }
   while (loop < hslots) {
-    if (GCdbRead::read(buf,8,kpos) == -1) return - 1;
-    uint32_unpack(buf + 4, &pos);
+    if (GCdbRead::read(buf,slotsize,kpos) == -1) return - 1;
+    if (is64) uint64_unpack(buf + 8, &pos);
+      else {
+        uint32 p32;
+        uint32_unpack(buf + 4, &p32);
+        pos=p32;
+        }
+    if (locslots) {
+      ldlen = (uint32)(pos >> 56);
+      pos &= CDB_LOC_POSMASK;
+      }
     if (!pos) return 0;
     loop += 1;
-    kpos += 8;
-    if (kpos == hpos + (hslots << 3)) kpos = hpos;
+    kpos += slotsize;
+    if (kpos == hpos + hslots * slotsize) kpos = hpos;
     uint32_unpack(buf,&u);
     if (u == khash) {
+      ldinline = false;
+      if (locslots) {
+        uint32 fp;
+        uint32_unpack(buf + 4, &fp);
+        if (fp != kfp) continue;
+        if (ldlen > 0) {
+          memcpy(ldata, buf + 16, ldlen);
+          if (!keycheck && (foldcmp || !foldhash)) {
+            dlen = ldlen;
+            dpos = 0;
+            ldinline = true;
+            return 1;
+            }
+          }
+        }
       if (GCdbRead::read(buf,8,pos) == -1) return -1;
       uint32_unpack(buf,&u);
       if (u == len)
@@ -944,6 +2157,7 @@ int GCdbRead::findnext(const char *key,unsigned int len) {
           case 1:
             uint32_unpack(buf + 4,&dlen);
             dpos = pos + 8 + len;
+            ldinline = (ldlen > 0 && ldlen == dlen);
             return 1;
         }
     }
@@ -951,6 +2165,87 @@ int GCdbRead::findnext(const char *key,unsigned int len) {
   return 0;
 }
 
+//width bits (up to 64) starting at bit bitpos of the bit-packed array
+//at file position base
+int GCdbRead::getbits(uint64 base, uint64 bitpos, uint32 width, uint64& v) {
+  char buf[9];
+  v = 0;
+  if (width == 0) return 0;
+  if (GCdbRead::read(buf, 9, base + (bitpos >> 3)) == -1) return -1;
+  uint32 sh = (uint32)(bitpos & 7);
+  v = cdb_word(buf) >> sh;
+  if (sh + width > 64) v |= ((uint64)(uchar)buf[8]) << (64 - sh);
+  if (width < 64) v &= (((uint64)1) << width) - 1;
+  return 0;
+}
+
+int GCdbRead::mphnext(const char *key,unsigned int len) {
+  if (!loop) {
+    loop = 1;
+    mphcur = mphend = 0;
+    if (mphkeys == 0) return 0;
+    char buf[CDB_MPH_PART];
+    uint64 h = cdb_hash64(key, len, foldhash);
+    uint32 part = cdb_mphrange((uint32)(h >> 32), mphparts);
+    if (GCdbRead::read(buf, CDB_MPH_PART, partpos + (uint64)part * CDB_MPH_PART) == -1)
+      return -1;
+    uint64 slotbase, bucketbase;
+    uint32 seed, nk;
+    uint64_unpack(buf, &slotbase);
+    uint64_unpack(buf + 8, &bucketbase);
+    uint32_unpack(buf + 16, &seed);
+    uint32_unpack(buf + 20, &nk);
+    if (nk == 0) return 0;
+    uint64 hh = cdb_mphmix(h, seed);
+    uint32 nb = nk / CDB_MPH_BUCKET_KEYS + 1;
+    uint64 d, v;
+    if (getbits(disppos, (bucketbase + cdb_mphrange((uint32)(hh >> 32), nb)) * dispbits,
+                dispbits, d) == -1) return -1;
+    uint64 s = slotbase + cdb_mphslot(hh, (uint32)d, nk);
+    if (fpbits) {
+      if (getbits(fppos, s * fpbits, fpbits, v) == -1) return -1;
+      if (v != (h & ((((uint64)1) << fpbits) - 1))) return 0;
+      }
+    if (startbits) {
+      if (getbits(startpos, s * startbits, startbits, mphcur) == -1 ||
+          getbits(startpos, (s + 1) * startbits, startbits, mphend) == -1)
+        return -1;
+      }
+    else {
+      mphcur = s;
+      mphend = s + 1;
+      }
+    }
+  if (mphcur >= mphend) return 0;
+  return mphloc(mphcur++);
+}
+
+//locator e, returned as the record data of a regular index (CIdxData)
+int GCdbRead::mphloc(uint64 e) {
+  uint64 b = e * (posbits + lenbits + fidbits);
+  uint64 fpos, reclen, fid;
+  if (getbits(locpos, b, posbits, fpos) == -1 ||
+      getbits(locpos, b + posbits, lenbits, reclen) == -1 ||
+      getbits(locpos, b + posbits + lenbits, fidbits, fid) == -1)
+    return -1;
+  off_t fp = (off_t)fpos;
+  fp = gcvt_offt(&fp);
+  memcpy(ldata, &fp, sizeof(off_t));
+  uint32 rl = (uint32)reclen;
+  rl = gcvt_uint(&rl);
+  memcpy(ldata + offsetof(CIdxData, reclen), &rl, sizeof(uint32));
+  dlen = IdxDataSIZE;
+  if (mphmfile) {
+    int16_t f = (int16_t)fid;
+    f = gcvt_int16(&f);
+    memcpy(ldata + dlen, &f, sizeof(int16_t));
+    dlen += sizeof(int16_t);
+    }
+  dpos = 0;
+  ldinline = true;
+  return 1;
+}
+
 int GCdbRead::find(const char *key) {
   GCdbRead::findstart();
   return GCdbRead::findnext(key,gcdb_strlen(key));
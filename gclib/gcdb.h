@@ -95,6 +95,39 @@ class GCDBuffer {
   int copy(GCDBuffer* bin);
 };
 
+//output buffer of the index writer: a large buffer (memcpy-ed into), and
+//optionally a second one, so the data can be written by a background
+//thread while the other buffer is being filled; the time spent in the
+//write() calls is measured
+#define CDB_WRITE_BUF 0x100000 //default buffer size
+struct GCdbBgWrite; //background writer state
+class GCdbWBuffer {
+   int fd;
+   char* buf[2];
+   unsigned int size;
+   unsigned int p; //data in the current buffer
+   int cur; //current buffer
+   GCdbBgWrite* bgw; //NULL if writing in the calling thread
+   uint64 wbytes; //bytes written
+   double wtime; //seconds spent writing
+  public:
+   GCdbWBuffer(int afd, unsigned int bufsize=CDB_WRITE_BUF, bool background=false);
+   ~GCdbWBuffer();
+   //write all of buf now (not buffered), updating the counters
+   int writeOut(char* b, unsigned int len);
+   int put(const char* b, unsigned int len);
+   //pass the buffered data to be written (it may still be in progress)
+   int flush();
+   //write the buffered data and wait until all of it was written
+   int sync();
+   int putflush(char* b, unsigned int len) {
+     if (sync() == -1) return -1;
+     return writeOut(b, len);
+     }
+   uint64 bytesWritten() { return wbytes; }
+   double writeTime() { return wtime; }
+};
+
 
 //=====================================================
 //-------------     cdb utils       -------------------
@@ -112,6 +145,32 @@ extern int error_proto;
 #define CDBMSK_OPT_CADD     0x00000004
 #define CDBMSK_OPT_COMPRESS 0x00000008
 #define CDBMSK_OPT_GSEQ     0x00000010
+//multi-file index: each record's data is followed by a 16bit file index
+//and a file table is stored before the db name (see cdbFileTail below)
+#define CDBMSK_OPT_MFILE    0x00000020
+#define CDB_MAX_FILES 65535
+//a sampled checksum of the indexed data is stored (see cdbDbSum below),
+//so the index can be updated when data is appended to the file
+#define CDBMSK_OPT_DBSUM    0x00000040
+//record offsets are BGZF virtual offsets (BGZF compressed database files)
+#define CDBMSK_OPT_BGZF     0x00000080
+//duplicate keys found within a record were dropped, and their number
+//is stored (see cdbKeyStats below)
+#define CDBMSK_OPT_KSTATS   0x00000100
+//case-folded index: keys are stored once, with their original case, but
+//they are hashed as lowercase (ASCII), so lookups can ignore the case
+#define CDBMSK_OPT_FOLD     0x00000200
+//hash function version used for the keys (bits 10-11): 0 is the classic
+//cdb (DJB) hash of all the older indexes, see CDB_HASH_* below
+#define CDBMSK_OPT_HASHV    0x00000C00
+#define CDBMSK_HASHV_SHIFT  10
+//the hash table slots hold the record locators (cdb64 format only, see
+//CDB_LOC_SLOT below)
+#define CDBMSK_OPT_LOCSLOT  0x00001000
+//keyless index (MPH format only): the keys are not stored, a key found
+//is verified against the first token of the record's defline, which
+//starts CDB_MPH_H_KEYOFS bytes into the record
+#define CDBMSK_OPT_KEYLESS  0x00002000
 //creates a compressed version of the database
 //uses plenty of unions for ensuring compatibility with
 // the old 'CIDX' info structure
@@ -148,93 +207,395 @@ struct cdbInfo {
      };
    };
 
+// multi-file index: the file table precedes the db name, as
+// numfiles entries of {int64 file size, uint32 namelen, file name}
+// followed by this fixed-size record
+struct cdbFileTail {
+    uint32 numfiles;
+    uint32 tablelen; //file table length, including this record
+   };
+
+// sampled checksum of the data file (CDBMSK_OPT_DBSUM); this record
+// precedes the file table (if any) and the db name
+struct cdbDbSum {
+    uint32 sum[2]; //64bit checksum, low 32 bits first
+    uint32 samples; //number of sampled blocks
+    uint32 blocksize; //size of each sampled block
+   };
+
+// record and key counts of a 64bit index (tag "CD64"), which can exceed
+// the 32bit counts in cdbInfo (these are capped at MAX_UINT); this record
+// precedes all the other records added after the cdb data
+struct cdbCounts64 {
+    int64_t num_keys;
+    int64_t num_records;
+   };
+
+// key statistics (CDBMSK_OPT_KSTATS); this record precedes the sampled
+// checksum (if any), the file table (if any) and the db name
+struct cdbKeyStats {
+    uint32 num_dups; //duplicate keys dropped
+    uint32 reserved;
+   };
+
 // for passing around index data:
 struct CIdxData32 {
    uint32 fpos;
    uint32 reclen;
    };
-/*
-struct CIdxSeqData32 { //4+4+2+1 = 11 bytes
+//records indexed with -G also store the sequence layout
+//(so ranges can be pulled without reading the whole record)
+struct CIdxSeqData32 { //4+4+4+4+4+1 = 21 bytes
    uint32 fpos;
    uint32 reclen;
-   uint16_t linelen; //line length for FASTA-formatted seq
+   uint32 deflen; //defline length (EOL excluded)
+   uint32 seqlen; //sequence length
+   uint32 linelen; //line length for FASTA-formatted seq (0 if not uniform)
    byte elen; //length of end-of-line delimiter: 1 (unix/mac) or 2 (Windows)
    };
-*/
 struct CIdxData {
    off_t fpos; //64bit value on Linux
    uint32 reclen;
  };
-/*
-struct CIdxSeqData { //8+4+2+1 = 15 bytes
+struct CIdxSeqData { //8+4+4+4+4+1 = 25 bytes
    off_t fpos; //64bit value on Linux
    uint32 reclen;
-   uint16_t linelen; //line length for FASTA-formatted seq
-   byte elen; //length of end-of-line delimiter: 1 (unix/mac) or 2 (Windows)
+   uint32 deflen;
+   uint32 seqlen;
+   uint32 linelen;
+   byte elen;
   };
-*/
 #pragma pack()
 
 extern int cdbInfoSIZE;
 extern int IdxDataSIZE;
 extern int IdxDataSIZE32;
-/*
 extern int IdxSeqDataSIZE;
 extern int IdxSeqDataSIZE32;
-*/
+//true if the index record data of length len (file index excluded)
+//has a 64bit file offset
+inline bool cdb_idxdata64(int len) {
+  return (len==IdxDataSIZE || len==IdxSeqDataSIZE);
+}
+
+//default sampling for cdb_samplesum()
+#define CDB_SUM_SAMPLES 64
+#define CDB_SUM_BLOCK 4096
+//compute the checksum of the first size bytes of file fd, using only
+//the given number of evenly spaced blocks (the first and the last block
+//are always included); returns false if the file cannot be read
+bool cdb_samplesum(int fd, off_t size, uint64& sum,
+         uint32 samples=CDB_SUM_SAMPLES, uint32 blocksize=CDB_SUM_BLOCK);
 
 void uint32_pack(char *,uint32);
 void uint32_pack_big(char *,uint32);
 void uint32_unpack(char *,uint32 *);
 void uint32_unpack_big(char *,uint32 *);
+void uint64_pack(char *,uint64);
+void uint64_unpack(char *,uint64 *);
 
 //=====================================================
 //-------------     cdb index       -------------------
 //=====================================================
 
-#define CDB_HPLIST 1000
+#define CDB_HPLIST 1000 //initial entries capacity of a GCdbRecBuf
 
-struct cdb_hp { uint32 h; uint32 p; } ;
+#pragma pack(4)
+struct cdb_hp { uint32 h; uint64 p; } ;
+#pragma pack()
 
-struct cdb_hplist {
-  struct cdb_hp hp[CDB_HPLIST];
-  struct cdb_hplist *next;
-  int num;
-  };
+//growable array of (hash, position) entries, stored contiguously;
+//on Linux the memory is mapped directly and grown with mremap() (no
+//copying), and it can be backed by transparent huge pages
+class GCdbHPArray {
+   struct cdb_hp* data;
+   uint64 count;
+   uint64 cap; //allocated entries
+   uint64 maxcap; //growth limit (0: none)
+   bool mapped; //mmap()-ed memory
+   bool hugepages;
+   void grow();
+  public:
+   GCdbHPArray():data(NULL), count(0), cap(0), maxcap(0), mapped(false),
+       hugepages(false) { }
+   ~GCdbHPArray() { release(); }
+   void setHugePages(bool h) { hugepages=h; }
+   void setMaxCap(uint64 n) { maxcap=n; }
+   void add(uint32 h, uint64 p) {
+     if (count==cap) grow();
+     data[count].h=h;
+     data[count].p=p;
+     ++count;
+     }
+   uint64 size() { return count; }
+   uint64 memSize() { return cap*sizeof(struct cdb_hp); }
+   struct cdb_hp* entries() { return data; }
+   void clear() { count=0; } //the memory is kept
+   void release(); //free the memory
+};
 
 
-//the index file should always be smaller than 4GB !
+//in-memory buffer of cdb records, laid out exactly as GCdbWrite would
+//write them; used for building parts of an index in parallel, the
+//buffers being appended in order with GCdbWrite::addbuf()
+class GCdbRecBuf {
+   char* data; //serialized records
+   uint32 dlen;
+   uint32 dcap;
+   struct cdb_hp* hp; //hash values and record offsets in data
+   uint32 numentries;
+   uint32 hpcap;
+   bool foldcase; //case-folded key hashing
+   int hashv; //hash function version (CDB_HASH_*)
+   friend class GCdbWrite;
+  public:
+   GCdbRecBuf();
+   void setFoldCase(bool fold) { foldcase=fold; }
+   void setHash(int hv) { hashv=hv; }
+   ~GCdbRecBuf();
+   int addrec(const char *key,unsigned int keylen,char *data,unsigned int datalen);
+   int getNumEntries() { return numentries; }
+   uint32 size() { return dlen; }
+   void clear() { dlen=0; numentries=0; }
+};
+
+//Index files are written in the classic cdb format (256 hash tables,
+//32bit positions) unless they would exceed 4GB, or the 64bit format
+//is requested with setFormat64(). The 64bit format ("cdb64") has:
+// - a 2048 bytes header: the end of the records (uint64), the position
+//   of the table directory (uint64) and the number of bits of the hash
+//   used for selecting the table (uint32, at least 8)
+// - the records (same as in the 32bit format)
+// - the hash tables, as 16 bytes slots: the key hash (uint32), 4 bytes
+//   reserved (0), the record position (uint64)
+// - the table directory: (position, number of slots) uint64 pairs
+//The index tag of cdb64 files is "CD64" instead of "CDBX".
+//A cdb64 index can also be written with "locator slots" (the slot size
+//is stored in the header, 0 meaning 16): 32 bytes slots holding the key
+//hash (uint32), a fingerprint of the key (uint32, the high half of
+//cdb_hash64()), the record position (uint64, its top byte being the
+//length of the record data if that is stored inline) and up to 16 bytes
+//of record data (the locator in the database file). A lookup then only
+//reads the record for comparing the key, and not at all if the key
+//comparison is skipped (GCdbRead::setKeyCheck()).
+#define CDB64_HEADER_EOD 0
+#define CDB64_HEADER_DIR 8
+#define CDB64_HEADER_TBITS 16
+#define CDB64_HEADER_SLOT 20
+#define CDB_LOC_SLOT 32
+#define CDB_LOC_DATA 16 //max. record data stored in a slot
+#define CDB_LOC_POSMASK 0x00FFFFFFFFFFFFFFULL
+#define CDB64_MIN_TBITS 8
+#define CDB64_MAX_TBITS 20
+#define CDB64_TABLE_KEYS 0x10000 //target number of entries per table
+
+//With a memory limit (setMemLimit()), the (hash, position) entries are
+//spilled to a temporary file whenever the limit is reached, as runs
+//grouped by partition (the low 8 bits of the hash, i.e. the table in the
+//32bit format); finish() then loads and writes one partition at a time.
+#define CDB_SPILL_BUF 2048 //entries buffered for each partition
+
+struct GCdbTables;
+#define CDB_TABLE_WBUF 0x100000 //output buffer size
+//buffers of a thread building hash tables in GCdbWrite::finish()
+struct GCdbTableBufs {
+  struct cdb_hp* htable;
+  uint64 htcap;
+  struct cdb_hp* pload; //spilled entries of a partition
+  struct cdb_hp* psplit; //  sorted by table
+  char* obuf; //output buffer
+  char* rbuf; //record read for a locator slot
+  uint32 rcap;
+  GCdbTableBufs():htable(NULL), htcap(0), pload(NULL), psplit(NULL), obuf(NULL),
+      rbuf(NULL), rcap(0) {
+    GMALLOC(obuf, CDB_TABLE_WBUF);
+    }
+  ~GCdbTableBufs() {
+    GFREE(rbuf);
+    GFREE(htable);
+    GFREE(pload);
+    GFREE(psplit);
+    GFREE(obuf);
+    }
+};
 
 class GCdbWrite {
-   GCDBuffer* cdbuf;
-   char bspace[8192];
+   GCdbWBuffer* cdbuf;
+   bool dosync; //fsync() the index file when closing it
+   uint64 tbytes; //hash tables written by finish()
+   double ttime; //  and the time taken for building and writing them
    char fname[1024];
    char final[2048];
-   uint32 count[256];
-   uint32 start[256];
-   struct cdb_hplist *head;
-   struct cdb_hp *split; /* includes space for hash */
-   struct cdb_hp *hash;
-   uint32 numentries;
-   uint32 pos; //file position
-   int posplus(uint32 len);
+   GCdbHPArray hps; //entries kept in memory
+   uint64 numentries;
+   uint64 pos; //file position
+   int posplus(uint64 len);
+   int addhp(uint32 h, uint64 p);
    int fd; //file descriptor
+   bool foldcase; //case-folded key hashing (CDBMSK_OPT_FOLD)
+   int hashv; //hash function version (CDB_HASH_*)
+   bool format64; //write (or was written in) the 64bit format
+   bool locslots; //locator slots (64bit format)
+   uint32 slotSize() { return format64 ? (locslots ? CDB_LOC_SLOT : 16) : 8; }
+   int putLocSlot(char* slot, struct cdb_hp& hp, uint64 eod, GCdbTableBufs& w);
+   //external memory mode:
+   uint64 memlimit; //max. entries kept in memory (0: no limit)
+   uint64 curmem; //memory used by the entries and for building the tables
+   uint64 peakmem;
+   void memTrack(int64 delta) {
+     curmem+=delta;
+     if (curmem>peakmem) peakmem=curmem;
+     }
+   int spillfd; //temporary file with the spilled entries, or -1
+   char* spillname;
+   uint64 spillpos; //end of the spilled data
+   uint64* spillofs; //offset of each partition, for each run
+   uint64* spillcnt; //number of entries of each partition, for each run
+   int numruns;
+   int numthreads; //threads building the hash tables
+   int spill();
+   int loadPart(int part, struct cdb_hp* buf);
   public:
+   //build and write the hash tables of a partition (used by finish())
+   int putPart(GCdbTables& tb, int part, GCdbTableBufs& w);
   //methods:
    GCdbWrite(int afd); //was: init
    GCdbWrite(char* fname);
    ~GCdbWrite();
+   void setFoldCase(bool fold) { foldcase=fold; }
+   void setHash(int hv) { hashv=hv; }
+   //always use the 64bit format (otherwise it's only used if needed)
+   void setFormat64(bool f64) { format64=f64; }
+   //after finish(): true if the index was written in the 64bit format
+   bool isFormat64() { return format64; }
+   //write the record locators in the hash table slots (this implies the
+   //64bit format); the records are read back from the index file by
+   //finish(), so a file descriptor given to the constructor must be open
+   //for reading too
+   void setLocSlots(bool loc) { locslots=loc; if (loc) format64=true; }
+   //keep at most maxbytes of hash entries in memory, spilling the others
+   //to the temporary file tmpname (if NULL, the index file name with the
+   //.hpspill suffix is used)
+   void setMemLimit(uint64 maxbytes, const char* tmpname=NULL);
+   int getSpillRuns() { return numruns; }
+   //use transparent huge pages for the entries (where available)
+   void setHugePages(bool h) { hps.setHugePages(h); }
+   //peak memory used for the hash entries and for building the tables
+   uint64 getPeakMem() { return peakmem; }
+   //number of threads building the hash tables in finish(); the index
+   //file is the same for any number of threads
+   void setThreads(int n) { numthreads = (n > 0) ? n : 1; }
+   //output buffer size, and writing in a background thread (this must
+   //be set before adding any records)
+   void setWriteBuffer(unsigned int bufsize, bool background=false);
+   //skip the fsync() of the index file (e.g. for scratch files)
+   void setSync(bool s) { dosync=s; }
+   //bytes written to the index file so far and the time spent writing
+   //them (the hash tables are counted with the time needed to build them)
+   void getWriteStats(uint64& bytes, double& secs) {
+     bytes = cdbuf->bytesWritten() + tbytes;
+     secs = cdbuf->writeTime() + ttime;
+     }
    int addbegin(unsigned int keylen,unsigned int datalen);
    int addend(unsigned int keylen,unsigned int datalen,uint32 h);
    int addrec(const char *key,unsigned int keylen,char *data,unsigned int datalen);
    int add(const char *key, char *data, unsigned int datalen);
-   int getNumEntries() { return numentries; }
+   int addbuf(GCdbRecBuf* rb); //append all the records in rb
+   uint64 getNumEntries() { return numentries; }
+   //write out the buffered records (without finishing the index)
+   int sync() { return cdbuf->sync(); }
+   //end of the records written so far (before finish())
+   uint64 recordsEnd() { return pos; }
    int finish();
    int close();
    int getfd() { return fd; }
    char* getfile() { return fname; }
 };
 
+//Minimal perfect hash (MPH) index, for static sets of keys: the keys
+//are not stored, only a few bytes per key. The keys are split by their
+//64bit hash (cdb_hash64()) into partitions of about CDB_MPH_PART_KEYS;
+//each partition has a hash & displace perfect hash function: its keys
+//are spread into buckets of CDB_MPH_BUCKET_KEYS keys on average, and
+//each bucket's displacement places its keys into distinct slots. Each
+//slot has a short fingerprint of its key (optional, for rejecting most
+//absent keys) and the key's record locators (file offset, record length
+//and file index), bit-packed. Keys with the same 64bit hash (e.g. the
+//same key in several records) share a slot; their number of locators is
+//then given by a bit-packed array of the first locator of each slot.
+//File layout: the header (CDB_MPH_HEADER bytes, see the CDB_MPH_H_*
+//offsets), the partition table (CDB_MPH_PART bytes per partition: first
+//slot (uint64), first bucket (uint64), hash seed (uint32), number of
+//keys (uint32)), then the bit-packed displacements, fingerprints,
+//locators and first locators. The index tag of MPH files is "CMPH".
+#define CDB_MPH_PART_KEYS 4096
+#define CDB_MPH_BUCKET_KEYS 4
+#define CDB_MPH_MAX_DISP 0x100000 //a new seed is tried after this
+#define CDB_MPH_MAX_SEEDS 256
+#define CDB_MPH_HEADER 128
+#define CDB_MPH_PART 24
+#define CDB_MPH_H_KEYS 0 //number of slots (distinct key hashes)
+#define CDB_MPH_H_ENTRIES 8 //number of locators
+#define CDB_MPH_H_PARTS 16 //number of partitions (uint32)
+#define CDB_MPH_H_FPBITS 20 //bit widths (uint32 each):
+#define CDB_MPH_H_DISPBITS 24
+#define CDB_MPH_H_POSBITS 28
+#define CDB_MPH_H_LENBITS 32
+#define CDB_MPH_H_FIDBITS 36
+#define CDB_MPH_H_STARTBITS 40 //0 if each slot has a single locator
+#define CDB_MPH_H_MFILE 44 //locators include a file index (uint32, 0/1)
+#define CDB_MPH_H_PARTPOS 48 //section positions (uint64 each)
+#define CDB_MPH_H_DISPPOS 56
+#define CDB_MPH_H_FPPOS 64
+#define CDB_MPH_H_LOCPOS 72
+#define CDB_MPH_H_STARTPOS 80
+#define CDB_MPH_H_KEYOFS 88 //offset of the key in the records (uint32,
+                            //for keyless indexes, see CDBMSK_OPT_KEYLESS)
+
+//the 64bit key hash mixed with a partition's seed
+inline uint64 cdb_mphmix(uint64 h, uint32 seed) {
+  h ^= (uint64)seed * 0x9E3779B97F4A7C15ULL;
+  h ^= h >> 30;
+  h *= 0xBF58476D1CE4E5B9ULL;
+  h ^= h >> 27;
+  h *= 0x94D049BB133111EBULL;
+  h ^= h >> 31;
+  return h;
+}
+inline uint32 cdb_mphrange(uint32 v, uint32 n) { //v mapped to 0..n-1
+  return (uint32)(((uint64)v * n) >> 32);
+}
+//slot of a key in its partition (of n keys), for displacement d
+inline uint32 cdb_mphslot(uint64 hh, uint32 d, uint32 n) {
+  return cdb_mphrange((uint32)(cdb_mphmix(hh, d) >> 32), n);
+}
+
+struct GCdbMphEntry;
+//builds an MPH index from the records of a cdb file
+class GCdbMphWrite {
+   GCdbMphEntry* entries;
+   uint64 count;
+   uint64 cap;
+   uint32 fpbits;
+   bool foldcase;
+   bool mfile; //the record data ends with a file index
+   uint64 numkeys; //distinct key hashes
+   uint64 maxpos;
+   uint32 maxlen;
+   uint32 maxfid;
+   uint32 keyofs;
+  public:
+   GCdbMphWrite(uint32 fpbits, bool fold, bool multifile);
+   //for keyless indexes: the keys are found at this offset in the records
+   void setKeyOffset(uint32 ofs) { keyofs = ofs; }
+   ~GCdbMphWrite();
+   //add the keys of the records in [from, to) of the cdb file fd
+   int addRecords(int fd, uint64 from, uint64 to);
+   //build the perfect hash and write the index to fd; returns -1 on error
+   int write(int fd);
+   uint64 getNumKeys() { return numkeys; }
+};
+
 
 //=====================================================
 //-------------        cdb          -------------------
@@ -244,6 +605,24 @@ class GCdbWrite {
 
 uint32 cdb_hashadd(uint32,unsigned char);
 uint32 cdb_hash(const char *,unsigned int);
+//hash of the lowercase (ASCII) version of the key
+uint32 cdb_hash_fold(const char *,unsigned int);
+inline char cdb_lower(char c) {
+  return (c>='A' && c<='Z') ? c+('a'-'A') : c;
+}
+
+//key hash functions (the version is stored in the index flags):
+#define CDB_HASH_DJB 0 //the classic cdb hash, one byte per step
+#define CDB_HASH_W64 1 //64bit multiply-xorshift hash over 8 byte words
+#define CDB_HASH_MAX 1 //latest version known
+//64bit hash of a key, read as little endian words (optionally lowercase)
+uint64 cdb_hash64(const char* key, unsigned int len, bool fold=false);
+//hash value of a key in the hash tables, for the given hash version
+inline uint32 cdb_keyhash(int hashv, const char* key, unsigned int len,
+                          bool fold=false) {
+  if (hashv == CDB_HASH_W64) return (uint32)cdb_hash64(key, len, fold);
+  return fold ? cdb_hash_fold(key, len) : cdb_hash(key, len);
+}
 
 #define MCDB_SLOT_BITS 8                  /* 2^8 = 256 */
 #define MCDB_SLOTS (1u<<MCDB_SLOT_BITS)   /* must be power-of-2 */
@@ -251,37 +630,111 @@ uint32 cdb_hash(const char *,unsigned int);
 #define MCDB_HEADER_SZ (MCDB_SLOTS<<4)    /* MCDB_SLOTS * 16  (256*16=4096) */
 #define MCDB_MMAP_SZ (1u<<19)             /* 512KB; must be >  MCDB_HEADER_SZ */
 #define MCDB_BLOCK_SZ (1u<<22)            /*   4MB; must be >= MCDB_MMAP_SZ */
+//Index files larger than MCDB_MAP_BLOCKS blocks are not mapped whole: the
+//first MCDB_MMAP_SZ bytes (the header) are mapped once, the rest of the
+//file is mapped in MCDB_BLOCK_SZ blocks when needed, and the least
+//recently used block is unmapped when all MCDB_MAP_BLOCKS are in use.
+//So the address space (and the resident pages) used by a GCdbRead is
+//bounded whatever the size of the index.
+#define MCDB_MAP_BLOCKS 16
+
+struct GCdbMapBlock {
+  char* map; //NULL if not mapped
+  uint64 start; //file offset (multiple of MCDB_BLOCK_SZ)
+  uint32 len;
+  uint64 lastuse;
+};
 
 class GCdbRead {
   //struct mcdb_mmap *map;
-  char *map;         // ptr, mmap pointer
-    uintptr_t size; // mmap size, initialized if map is nonzero
+  char *map;         // ptr, mmap pointer (the whole file or the header)
+  uintptr_t maplen; // bytes mapped at map
+  uint64 size; // file size
+  GCdbMapBlock blocks[MCDB_MAP_BLOCKS]; // windowed access beyond maplen
+  uint64 mapclock;
+  char* mapblock(uint64 pos, uint64& bstart, uint32& blen);
 
-  uint32 loop; // number of hash slots searched under this key
-  uint32 hslots; // initialized if loop is nonzero
+  uint64 loop; // number of hash slots searched under this key
+  uint64 hslots; // initialized if loop is nonzero
 
-  uintptr_t kpos; // initialized if loop is nonzero
-  uintptr_t hpos; // initialized if loop is nonzero
-  uintptr_t dpos; // initialized if cdb_findnext() returns 1
+  uint64 kpos; // initialized if loop is nonzero
+  uint64 hpos; // initialized if loop is nonzero
+  uint64 dpos; // initialized if cdb_findnext() returns 1
 
   uint32 dlen; // initialized if cdb_findnext() returns 1
 
   uint32 khash; // initialized if loop is nonzero
 
+  bool foldhash; // keys were hashed case-folded (CDBMSK_OPT_FOLD index)
+  bool foldcmp; // key comparisons ignore the case
+  int hashv; // hash function version (CDB_HASH_*, from the index flags)
+
+  bool is64; // 64bit (cdb64) index
+  uint32 tbits; // cdb64: hash bits selecting the table
+  uint64 dirpos; // cdb64: position of the table directory
+  bool locslots; // cdb64 with locator slots
+  bool keycheck; // compare the keys (locator slots: unless set to false)
+  uint32 kfp; // key fingerprint (locator slots)
+  bool ldinline; // the record data found is in ldata
+  char ldata[CDB_LOC_DATA];
+
+  bool mph; // minimal perfect hash index ("CMPH" tag)
+  char mphhdr[CDB_MPH_HEADER];
+  uint64 mphkeys;
+  uint64 mphentries;
+  uint32 mphparts;
+  uint32 mphkeyofs;
+  uint32 fpbits, dispbits, posbits, lenbits, fidbits, startbits;
+  bool mphmfile;
+  uint64 partpos, disppos, fppos, locpos, startpos;
+  uint64 mphcur, mphend; // locators left for the key searched
+  int getbits(uint64 base, uint64 bitpos, uint32 width, uint64& v);
+  int mphnext(const char *key,unsigned int len);
+  int mphloc(uint64 e);
+
   char fname[1024];
   //char *map; // 0 if no map is available
   int fd;
+  void init(); //mapping and format detection
  public:
 //methods:
   GCdbRead(int fd); //was cdb_init
   GCdbRead(char* afname); //was cdb_init
   ~GCdbRead(); //was cdb_free
-  int read(char *,unsigned int,uint32);
-  int match(const char *key, unsigned int len, uint32 pos);
+  //for a case-folded index (CDBMSK_OPT_FOLD): lookups can be exact
+  //(ignorecase=false) or case insensitive
+  void setFoldCase(bool folded, bool ignorecase) {
+    foldhash=folded;
+    foldcmp=(folded && ignorecase);
+    }
+  void setHash(int hv) { hashv=hv; }
+  //with locator slots, a key whose hash and fingerprint (64 bits in all)
+  //match is taken as found without reading the record (check=false);
+  //exact lookups in a case-folded index always compare the keys
+  void setKeyCheck(bool check) { keycheck=check; }
+  bool hasLocSlots() { return locslots; }
+  int read(char *,unsigned int,uint64);
+  //the data of the record found (datalen() bytes)
+  int getdata(char* buf) {
+    if (ldinline) { memcpy(buf, ldata, dlen); return 0; }
+    return read(buf, dlen, dpos);
+    }
+  int match(const char *key, unsigned int len, uint64 pos);
   void findstart() { loop =0; }
   int findnext(const char *key,unsigned int len);
   int find(const char *key);
-  int datapos() { return dpos; }
+  uint64 datapos() { return dpos; }
+  bool isFormat64() { return is64; }
+  //minimal perfect hash index: the keys are not stored, so the lookups
+  //of absent keys can succeed (rarely, with fingerprints)
+  bool isMph() { return mph; }
+  uint32 mphFpBits() { return fpbits; }
+  //all the record locators of an MPH index (e.g. for listing the keys
+  //of a keyless index): mphLocator() sets the record data (as found by
+  //findnext()) to locator e, 0 <= e < mphNumLocators()
+  uint64 mphNumLocators() { return mphentries; }
+  int mphLocator(uint64 e) { return (e < mphentries) ? mphloc(e) : -1; }
+  uint32 mphKeyOffset() { return mphkeyofs; }
   int datalen() { return dlen; }
   int getfd() { return fd; }
   char* getfile() { return fname; }
@@ -0,0 +1,491 @@
+#include "gfascan.h"
+#include <ctype.h>
+#if !defined(__WIN32__) && !defined(NO_MMAP)
+#include <sys/mman.h>
+#endif
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+//16K initial defline buffer
+#define GFSCAN_KEYBUF 0x4000
+//a mapped input file is scanned in windows of this size;
+//the pages of each window are dropped after it was scanned
+#define GFSCAN_MAPWIN 0x4000000
+
+static void die_gseqformat(const char* seqname) {
+  GError("Error: invalid FASTA sequence format for %s (not uniform line length)\n",
+       seqname);
+}
+
+static void die_fastqformat(const char* seqid, int seqlen, int qvlen) {
+  GError("Error: invalid FASTQ sequence format for %s (seqlen=%d, qvlen=%d)\n",
+       seqid, seqlen, qvlen);
+}
+
+const char* gfscan_eol(const char* p, const char* end) {
+#if defined(__AVX2__)
+  const __m256i vn=_mm256_set1_epi8('\n');
+  const __m256i vr=_mm256_set1_epi8('\r');
+  while (end-p>=32) {
+    __m256i v=_mm256_loadu_si256((const __m256i*)p);
+    unsigned int m=(unsigned int)_mm256_movemask_epi8(
+          _mm256_or_si256(_mm256_cmpeq_epi8(v,vn), _mm256_cmpeq_epi8(v,vr)));
+    if (m) return p+__builtin_ctz(m);
+    p+=32;
+    }
+#endif
+#if defined(__SSE2__)
+  const __m128i sn=_mm_set1_epi8('\n');
+  const __m128i sr=_mm_set1_epi8('\r');
+  while (end-p>=16) {
+    __m128i v=_mm_loadu_si128((const __m128i*)p);
+    unsigned int m=(unsigned int)_mm_movemask_epi8(
+          _mm_or_si128(_mm_cmpeq_epi8(v,sn), _mm_cmpeq_epi8(v,sr)));
+    if (m) return p+__builtin_ctz(m);
+    p+=16;
+    }
+#endif
+  while (p<end && *p!='\n' && *p!='\r') p++;
+  return p;
+}
+
+GFastaScan::GFastaScan(const char* rmarker, int rmarker_len, bool is_fastq,
+         bool gseq_check, bool full_defline, GFRecFunc rfunc, void* rdata) {
+  marker_len=rmarker_len;
+  GMALLOC(marker, marker_len+1);
+  memcpy(marker, rmarker, marker_len);
+  marker[marker_len]='\0';
+  fastq=is_fastq;
+  gseq=gseq_check;
+  fullDefline=full_defline;
+  fastBody=(!fastq && !gseq);
+  recfunc=rfunc;
+  recdata=rdata;
+  bstart=NULL;
+  bofs=0;
+  bof=true;
+  c1=0;
+  c2=0;
+  lkind=lkNone;
+  recpos=0;
+  seen_defline=false;
+  keycap=GFSCAN_KEYBUF;
+  GMALLOC(key, keycap);
+  key[0]=0; //no keys have been parsed yet
+  keylen=0;
+  keyDone=false;
+  curlen=0;
+  linecounter=0;
+  first_linelen=0;
+  last_linelen=0;
+  mustbeLastLine=false;
+  fq_recloc=(fastq) ? 0 : 4;
+  memset((void*)fq_lendata, 0, 4*sizeof(int));
+  total=0;
+  geom=NULL;
+  deflEnd=-1;
+  lineEndPos=0;
+  seqlen=0;
+  elen=0;
+  geomOK=false;
+}
+
+GFastaScan::~GFastaScan() {
+  GFREE(key);
+  GFREE(marker);
+}
+
+void GFastaScan::addKeyChars(const char* p, int len) {
+  if (keylen+len>=keycap) {
+    while (keylen+len>=keycap) keycap+=GFSCAN_KEYBUF;
+    GREALLOC(key, keycap);
+    }
+  memcpy(key+keylen, p, len);
+  keylen+=len;
+}
+
+//store the layout of the current record (of recsize bytes) in *geom
+void GFastaScan::setGeom(uint32 recsize) {
+  geom->deflen=(deflEnd<0) ? recsize : (uint32)(deflEnd-recpos);
+  geom->seqlen=seqlen;
+  bool uniform=(geomOK && linecounter>0);
+  geom->linelen=uniform ? first_linelen : 0;
+  geom->elen=uniform ? elen : 0;
+}
+
+//a new record starts at file offset mpos: add the previous one
+void GFastaScan::endRecord(off_t mpos) {
+  uint32 recsize=(uint32)(mpos-recpos-eolLen()); //previous recsize
+  if (recsize>(uint32)(marker_len+1) && key[0]!='\0') {
+    if (fastq && fq_lendata[1]!=fq_lendata[3])
+          die_fastqformat(key, fq_lendata[1], fq_lendata[3]);
+    if (geom!=NULL) setGeom(recsize);
+    recfunc(key, recpos, recsize, recdata);
+    }
+}
+
+//p is at the first character of a line;
+//returns the position where the line content scanning should resume
+const char* GFastaScan::lineStart(const char* p, const char* end) {
+  if (*p==marker[0] && (!fastq || fq_lendata[1]<=fq_lendata[3]) &&
+      (marker_len==1 || (end-p>=marker_len &&
+           memcmp(p+1, marker+1, marker_len-1)==0))) {
+    // new record start (new header line coming up)
+    off_t mpos=ofs(p);
+    if (!bof) endRecord(mpos);
+    bof=false;
+    recpos=mpos;
+    seen_defline=true;
+    linecounter=0;
+    mustbeLastLine=false;
+    keylen=0;
+    keyDone=false;
+    lkind=lkDefline;
+    if (gseq) {
+      deflEnd=-1;
+      seqlen=0;
+      geomOK=true;
+      }
+    track(p, p+marker_len);
+    return p+marker_len;
+    }
+  bof=false;
+  if (!seen_defline) lkind=lkJunk;
+  else {
+    // start of a new line in the "sequence" block
+    if (mustbeLastLine) die_gseqformat(key);
+    mustbeLastLine=false;
+    if (gseq) {
+      //sequence lines must be separated by the same EOL as the defline
+      off_t gap=ofs(p)-((linecounter==0) ? deflEnd : lineEndPos);
+      if (linecounter==0) elen=(int)gap;
+      if (gap!=elen || (gap!=1 && !(gap==2 && c2=='\r' && c1=='\n')))
+        geomOK=false; //blank lines or mixed EOLs
+      }
+    curlen=0;
+    if (fq_recloc<4) {
+      //take care of multi-line fastq parsing
+      if (fq_recloc==1 && *p=='+') fq_recloc=2; //q-header line
+        else if (fq_recloc==0 || fq_recloc==2) fq_recloc++;
+      }
+    lkind=lkBody;
+    }
+  lineData(p, p+1);
+  track(p, p+1);
+  return p+1;
+}
+
+//[p, e) is a chunk of the current line (no EOL characters in it)
+void GFastaScan::lineData(const char* p, const char* e) {
+  int n=e-p;
+  if (lkind==lkBody) {
+    curlen+=n;
+    if (fq_recloc<4) fq_lendata[fq_recloc]+=n;
+    }
+  else if (lkind==lkDefline && !keyDone) {
+    if (fullDefline) addKeyChars(p, n);
+    else {
+      //only the first space delimited token is needed
+      const char* s=p;
+      while (s<e && !isspace((uchar)*s) && (uchar)*s>=31) s++;
+      addKeyChars(p, s-p);
+      if (s<e) keyDone=true;
+      }
+    }
+}
+
+//an EOL character was found right after the current line,
+//at file offset epos
+void GFastaScan::lineEnd(off_t epos) {
+  if (lkind==lkDefline) {
+    // --> end of header line
+    key[keylen]=0;
+    deflEnd=epos;
+    keyDone=true;
+    last_linelen=0;
+    first_linelen=0;
+    linecounter=0;
+    fq_recloc= (fastq) ? 0 : 4;
+    mustbeLastLine=false;
+    memset((void*)fq_lendata, 0, 4*sizeof(int));
+    }
+  else if (lkind==lkBody) {
+    last_linelen=curlen;
+    if (linecounter==0) first_linelen=curlen;
+    linecounter++; //counting sequence lines
+    seqlen+=curlen;
+    lineEndPos=epos;
+    if (gseq && linecounter>1) {
+      if (last_linelen>first_linelen)
+              die_gseqformat(key);
+      if (last_linelen<first_linelen)
+              mustbeLastLine=true;
+      }
+    }
+  lkind=lkNone;
+}
+
+//record body scanning when no per-line checks are needed:
+//jump directly to the next record delimiter character found at a line start
+const char* GFastaScan::skipBody(const char* p, const char* end) {
+  const char* s=p;
+  for (;;) {
+    const char* h=(const char*)memchr(s, marker[0], end-s);
+    if (h==NULL) {
+      track(p, end);
+      return end;
+      }
+    char pc=(h>p) ? h[-1] : c1;
+    if (pc=='\n' || pc=='\r') {
+      track(p, h);
+      lkind=lkNone;
+      return h;
+      }
+    s=h+1;
+    }
+}
+
+const char* GFastaScan::scan(const char* p, const char* end, off_t pofs, bool last) {
+  bstart=p;
+  bofs=pofs;
+  while (p<end) {
+    if (lkind==lkNone) {
+      //in an EOL run (or at the very beginning)
+      const char* s=p;
+      while (p<end && (*p=='\n' || *p=='\r')) p++;
+      if (p>s) {
+        track(s, p);
+        bof=false;
+        if (p==end) break;
+        }
+      //p is at a line start
+      if (!last && *p==marker[0] && end-p<marker_len)
+        break; //need more data to check for the record delimiter
+      if (fastq && *p==marker[0]) {
+        //try the whole 4-line record at once
+        const char* r=fastqRecord(p, end, last);
+        if (r!=NULL) {
+          p=r;
+          continue;
+          }
+        }
+      p=lineStart(p, end);
+      continue;
+      }
+    if (fastBody && lkind!=lkDefline) {
+      p=skipBody(p, end);
+      continue;
+      }
+    const char* e=gfscan_eol(p, end);
+    lineData(p, e);
+    track(p, e);
+    p=e;
+    if (e<end) lineEnd(ofs(e));
+    }
+  total=ofs(p);
+  return p;
+}
+
+//skip a run of EOL characters
+static inline const char* skipEOL(const char* p, const char* end) {
+  while (p<end && (*p=='\n' || *p=='\r')) p++;
+  return p;
+}
+
+//FASTQ fast path: p is at a line start with the record delimiter; if a
+//whole 4-line record (@header, sequence, +[header], qualities of the same
+//length) followed by the next record start (or the end of input) is found
+//in the [p, end) block, the record is consumed with one EOL search per line
+//and the scanner state is left exactly as the line by line parsing would
+//leave it; otherwise NULL is returned and the generic parsing is used
+const char* GFastaScan::fastqRecord(const char* p, const char* end, bool last) {
+  if (fq_lendata[1]>fq_lendata[3] || end-p<marker_len ||
+      (marker_len>1 && memcmp(p+1, marker+1, marker_len-1)!=0))
+    return NULL;
+  const char* h=p+marker_len; //header
+  const char* he=gfscan_eol(h, end);
+  const char* s=skipEOL(he, end); //sequence
+  if (s==end || *s==marker[0]) return NULL;
+  const char* se=gfscan_eol(s, end);
+  const char* t=skipEOL(se, end); //'+' line
+  if (t==end || *t!='+') return NULL;
+  const char* te=gfscan_eol(t, end);
+  const char* q=skipEOL(te, end); //qualities
+  if (q==end) return NULL;
+  const char* qe=gfscan_eol(q, end);
+  if (qe-q!=se-s) return NULL; //multi-line or bad record
+  const char* n=skipEOL(qe, end); //next record
+  if (n==end) {
+    if (!last || qe==end) return NULL;
+    }
+  else if (*n!=marker[0] || end-n<marker_len ||
+           (marker_len>1 && memcmp(n+1, marker+1, marker_len-1)!=0))
+    return NULL;
+  //-- record start (see lineStart())
+  off_t mpos=ofs(p);
+  if (!bof) endRecord(mpos);
+  bof=false;
+  recpos=mpos;
+  seen_defline=true;
+  keylen=0;
+  keyDone=false;
+  lkind=lkDefline;
+  lineData(h, he);
+  key[keylen]=0;
+  keyDone=true;
+  //-- the record body
+  int slen=se-s;
+  fq_recloc=3;
+  fq_lendata[0]=0;
+  fq_lendata[1]=slen;
+  fq_lendata[2]=te-t;
+  fq_lendata[3]=slen;
+  linecounter=3;
+  first_linelen=slen;
+  last_linelen=slen;
+  curlen=slen;
+  mustbeLastLine=false;
+  lkind=lkNone;
+  track(q, n);
+  return n;
+}
+
+void GFastaScan::finish() {
+  if (bof) return; //empty input
+  uint32 recsize=(uint32)(total-recpos);
+  if (recsize>0) { //add last record, if there
+    if (c1=='\n' || c1=='\r') recsize-=eolLen();
+    if (lkind==lkDefline) key[keylen]=0; //close the defline string
+    if (geom!=NULL) {
+      if (lkind==lkBody) lineEnd(total); //last line had no EOL
+      setGeom(recsize);
+      }
+    recfunc(key, recpos, recsize, recdata);
+    }
+}
+
+off_t GFastaScan::scanFile(FILE* f, int bufsize, off_t fofs) {
+  char* buf=NULL;
+  GMALLOC(buf, bufsize+marker_len);
+  int kept=0;
+  off_t pofs=fofs;
+  total=fofs;
+  for (;;) {
+    size_t r=fread((void*)(buf+kept), 1, bufsize, f);
+    if (ferror(f))
+      GError("GFastaScan: error at fread!\n");
+    bool last=(r<(size_t)bufsize);
+    const char* end=buf+kept+r;
+    const char* p=scan(buf, end, pofs, last);
+    if (last) break;
+    kept=end-p;
+    pofs+=p-buf;
+    if (kept>0) memmove(buf, p, kept);
+    }
+  finish();
+  GFREE(buf);
+  return total;
+}
+
+bool GFileMap::open(int fd, off_t fsize) {
+#if defined(__WIN32__) || defined(NO_MMAP)
+  return false;
+#else
+  unmap();
+  if (fsize<=0 || (uint64)fsize>(uint64)((size_t)-1)) return false;
+  size_t msize=(size_t)fsize;
+  char* m=(char*)mmap(NULL, msize, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (m==(char*)MAP_FAILED) return false;
+ #ifdef MADV_SEQUENTIAL
+  madvise(m, msize, MADV_SEQUENTIAL);
+ #endif
+ #ifdef MADV_HUGEPAGE
+  madvise(m, msize, MADV_HUGEPAGE);
+ #endif
+  map=m;
+  size=msize;
+  released=0;
+  return true;
+#endif
+}
+
+void GFileMap::release(off_t upto) {
+#if !defined(__WIN32__) && !defined(NO_MMAP) && defined(MADV_DONTNEED)
+  if (map==NULL) return;
+  size_t pgsize=(size_t)sysconf(_SC_PAGESIZE);
+  size_t rel=(((size_t)upto)/pgsize)*pgsize;
+  if (rel-released>=GFSCAN_MAPWIN) {
+    madvise(map+released, rel-released, MADV_DONTNEED);
+    released=rel;
+    }
+#endif
+}
+
+void GFileMap::unmap() {
+#if !defined(__WIN32__) && !defined(NO_MMAP)
+  if (map!=NULL) munmap(map, size);
+#endif
+  map=NULL;
+  size=0;
+}
+
+off_t GFastaScan::scanMapped(int fd, off_t fsize) {
+  GFileMap fmap;
+  if (!fmap.open(fd, fsize)) return -1;
+  //record offsets are just pointer differences from the start of the mapping
+  const char* map=fmap.map;
+  const char* mend=map+fmap.size;
+  const char* p=map;
+  while (p<mend) {
+    const char* wend=(mend-p>GFSCAN_MAPWIN) ? p+GFSCAN_MAPWIN : mend;
+    p=scan(p, wend, p-map, wend==mend);
+    fmap.release(p-map);
+    }
+  finish();
+  return total;
+}
+
+//check for the 4-line FASTQ layout (@header, sequence, +[header], qualities)
+//starting at p
+bool GFastaScan::isFastqRec(const char* p, const char* end) {
+  const char* line[4];
+  int len[4];
+  for (int i=0;i<4;i++) {
+    if (p>=end) return false;
+    const char* e=gfscan_eol(p, end);
+    line[i]=p;
+    len[i]=e-p;
+    p=e;
+    while (p<end && (*p=='\n' || *p=='\r')) p++;
+    }
+  return (len[2]>0 && line[2][0]=='+' && len[1]==len[3] &&
+          (p==end || *p==marker[0]));
+}
+
+off_t GFastaScan::nextRecStart(const char* data, off_t from, off_t dsize) {
+  const char* end=data+dsize;
+  const char* p=data+from;
+  while (p<end) {
+    const char* h=(const char*)memchr(p, marker[0], end-p);
+    if (h==NULL) break;
+    if ((h==data || h[-1]=='\n' || h[-1]=='\r') && end-h>=marker_len &&
+         memcmp(h, marker, marker_len)==0 && (!fastq || isFastqRec(h, end)))
+      return h-data;
+    p=h+1;
+    }
+  return dsize;
+}
+
+bool GFastaScan::scanRange(const char* data, off_t start, off_t end, bool last) {
+  scan(data+start, data+end, start, true);
+  if (last) {
+    finish();
+    return true;
+    }
+  if (bof) return true; //empty range
+  //the serial scanner would only take end as a record start if:
+  if (fastq && fq_lendata[1]>fq_lendata[3]) return false;
+  endRecord(end);
+  return true;
+}
@@ -0,0 +1,142 @@
+#ifndef _GFASCAN_H
+#define _GFASCAN_H
+#include "GBase.h"
+
+//=====================================================
+//-------- block based record boundary scanner --------
+//=====================================================
+// Finds the start of each record (record delimiter at the
+// beginning of a line) in a multi-FASTA/FASTQ stream by working on
+// whole blocks of data: end-of-line and record delimiter searches
+// are done with vectorized/memchr kernels and the per-line work
+// (header parsing, -G and -Q checks) only happens at line starts.
+// FASTQ records with the usual 4-line layout are consumed as a whole,
+// with a single EOL search per line.
+// The record offsets and sizes passed to the record function are
+// the same as the ones computed by the old per-character parser.
+
+//the record function receives the defline (without the record
+//delimiter), the record's file offset, its length and the user data
+//pointer given to the scanner
+typedef void (*GFRecFunc)(char*, off_t, uint32, void*);
+
+//layout of a FASTA record as found by the -G (gseq) scanning
+struct GFSeqGeom {
+  uint32 deflen; //defline length (record delimiter included, EOL excluded)
+  uint32 seqlen; //number of sequence characters
+  uint32 linelen; //sequence line length, 0 if the layout is not uniform
+  int elen; //length of each end-of-line (the one after the defline included)
+};
+
+//returns a pointer to the first end-of-line character ('\n' or '\r')
+//in the [p, end) range, or end if none is found
+const char* gfscan_eol(const char* p, const char* end);
+
+//read-only memory mapping of a whole input file
+class GFileMap {
+ public:
+  char* map;
+  size_t size;
+  GFileMap():map(NULL),size(0) { }
+  ~GFileMap() { unmap(); }
+  //returns false if the file cannot be mapped
+  bool open(int fd, off_t fsize);
+  //drop the pages before offset upto (keeps RSS low for huge files)
+  void release(off_t upto);
+  void unmap();
+ protected:
+  size_t released; //pages before this offset were dropped
+};
+
+class GFastaScan {
+ protected:
+  enum { lkNone=0, lkDefline, lkBody, lkJunk };
+  char* marker; //record delimiter
+  int marker_len;
+  bool fastq;
+  bool gseq; //check for uniform line length within each record
+  bool fullDefline; //pass the whole defline, not just the first token
+  bool fastBody; //no per-line checks needed for the record body
+  GFRecFunc recfunc;
+  void* recdata;
+  //-- data block being scanned
+  const char* bstart;
+  off_t bofs; //file offset of bstart
+  //-- scanner state
+  bool bof; //nothing was consumed yet
+  char c1; //last character consumed
+  char c2; //the character before c1
+  int lkind; //what kind of line we're in (lkNone if in EOL run)
+  off_t recpos; //current record's file offset
+  bool seen_defline;
+  char* key; //defline (or its first token) for the current record
+  int keylen;
+  int keycap;
+  bool keyDone; //first token of the defline completed
+  int curlen; //length of current non-header line
+  int linecounter; //number of non-header lines for current record
+  int first_linelen; //length of the first non-header line in a record
+  int last_linelen; //length of the last non-header line in a record
+  bool mustbeLastLine;
+  int fq_recloc; //0=seq header line, 1=sequence string, 2=q-header line, 3=qvstring, 4=not fastq
+  int fq_lendata[4]; //keep track of fastq seq len, qv len
+  off_t total; //bytes consumed so far
+  //-- record layout tracking (gseq only)
+  GFSeqGeom* geom; //filled in before each record function call
+  off_t deflEnd; //file offset of the end of the current defline
+  off_t lineEndPos; //file offset of the end of the last sequence line
+  uint32 seqlen;
+  int elen;
+  bool geomOK; //uniform layout so far
+
+  off_t ofs(const char* p) { return bofs+(p-bstart); }
+  //update c1,c2 with the last characters of [p, e)
+  void track(const char* p, const char* e) {
+    if (e-p>1) { c2=e[-2]; c1=e[-1]; }
+      else if (e>p) { c2=c1; c1=e[-1]; }
+    }
+  int eolLen() { return (c2=='\n' && c1=='\r') ? 2 : 1; }
+  void addKeyChars(const char* p, int len);
+  const char* lineStart(const char* p, const char* end);
+  void lineData(const char* p, const char* e);
+  void lineEnd(off_t epos);
+  void setGeom(uint32 recsize);
+  const char* skipBody(const char* p, const char* end);
+  void endRecord(off_t mpos);
+  bool isFastqRec(const char* p, const char* end);
+  const char* fastqRecord(const char* p, const char* end, bool last);
+ public:
+  GFastaScan(const char* rmarker, int rmarker_len, bool is_fastq, bool gseq_check,
+             bool full_defline, GFRecFunc rfunc, void* rdata=NULL);
+  ~GFastaScan();
+  //with gseq checking, have the layout of each record stored in *g
+  //right before the record function is called for it
+  void setGeomData(GFSeqGeom* g) { geom=g; }
+  //scan the data block [p, end) found at file offset pofs, continuing
+  //from the state left by the previous block; returns a pointer to the
+  //unconsumed tail (a possible partial record delimiter) which should be
+  //prepended to the next block; when last is true the whole block is consumed
+  const char* scan(const char* p, const char* end, off_t pofs, bool last);
+  //complete the last record (to be called after the last block)
+  void finish();
+  //scan the whole input stream using a buffer of bufsize bytes;
+  //fofs is the file offset where f is positioned (it should be a record
+  //start); returns the file offset where scanning ended
+  off_t scanFile(FILE* f, int bufsize, off_t fofs=0);
+  //scan a regular file of size fsize directly from a read-only memory
+  //mapping (no data copying); returns the number of bytes scanned,
+  //or -1 if the file could not be mapped (scanFile() should be used then)
+  off_t scanMapped(int fd, off_t fsize);
+  //-- parallel indexing support:
+  //offset of the first record start at or after offset from in the
+  //dsize bytes of data (or dsize if there is none); for FASTQ the
+  //4-line record layout is also checked
+  off_t nextRecStart(const char* data, off_t from, off_t dsize);
+  //scan the [start, end) range of data as a separate input where start
+  //is a record start; unless last is true, end should be the start of the
+  //next record: returns false if the scanner state does not allow that
+  //(e.g. end is inside a FASTQ quality string)
+  bool scanRange(const char* data, off_t start, off_t end, bool last);
+};
+
+#endif
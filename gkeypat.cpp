@@ -0,0 +1,514 @@
+#include "gkeypat.h"
+#include <ctype.h>
+
+enum { nEmpty=0, nChar, nAny, nClass, nBol, nEol, nCat, nAlt, nGroup, nRepeat };
+
+struct GKeyPattern::Node {
+  int type;
+  int a, b; //children
+  int c; //char, class index, group number or minimum repeat count
+  int max; //maximum repeat count (-1 if unbounded)
+  bool greedy;
+};
+
+GKeyPattern::GKeyPattern() {
+  prog=NULL;
+  proglen=0;
+  progcap=0;
+  classes=NULL;
+  numclasses=0;
+  ngroups=0;
+  memset(first, 0, sizeof(first));
+  skipStart=false;
+  pat=NULL;
+  pp=NULL;
+  err=NULL;
+  nodes=NULL;
+  numnodes=0;
+  nodecap=0;
+}
+
+GKeyPattern::~GKeyPattern() {
+  GFREE(prog);
+  GFREE(classes);
+  GFREE(nodes);
+  char* p=(char*)pat;
+  GFREE(p);
+}
+
+int GKeyPattern::newNode(int type, int a, int b) {
+  if (numnodes==nodecap) {
+    nodecap=(nodecap==0) ? 64 : nodecap*2;
+    GREALLOC(nodes, nodecap*sizeof(Node));
+    }
+  Node& n=nodes[numnodes];
+  n.type=type;
+  n.a=a;
+  n.b=b;
+  n.c=0;
+  n.max=0;
+  n.greedy=true;
+  return numnodes++;
+}
+
+int GKeyPattern::newClass() {
+  GREALLOC(classes, (numclasses+1)*8*sizeof(uint32));
+  memset(classes+numclasses*8, 0, 8*sizeof(uint32));
+  return numclasses++;
+}
+
+void GKeyPattern::classAddRange(int cls, int from, int to) {
+  for (int c=from;c<=to;c++) classAdd(cls, c);
+}
+
+//the \d \w \s character sets
+static bool escClassHas(char e, int c) {
+  switch (e) {
+    case 'd': return (c>='0' && c<='9');
+    case 'w': return ((c>='a' && c<='z') || (c>='A' && c<='Z') ||
+                      (c>='0' && c<='9') || c=='_');
+    case 's': return (c==' ' || c=='\t' || c=='\n' || c=='\r' || c=='\f' || c=='\v');
+    }
+  return false;
+}
+
+//adds the set of the class escape \c to class cls;
+//returns false if c is not a class escape
+bool GKeyPattern::classEscape(int cls, char c, bool negate) {
+  char e=c;
+  switch (c) {
+    case 'D': e='d'; negate=!negate; break;
+    case 'W': e='w'; negate=!negate; break;
+    case 'S': e='s'; negate=!negate; break;
+    case 'd':
+    case 'w':
+    case 's': break;
+    default: return false;
+    }
+  for (int i=0;i<256;i++)
+    if (escClassHas(e, i)!=negate) classAdd(cls, i);
+  return true;
+}
+
+//character escaped in a pattern (\t, \n, \r or a non-alphanumeric
+//character), or -1 if not a valid escape
+static int escChar(char c) {
+  switch (c) {
+    case 't': return '\t';
+    case 'n': return '\n';
+    case 'r': return '\r';
+    case 'f': return '\f';
+    case 'v': return '\v';
+    }
+  if (c==0 || isalnum((uchar)c)) return -1;
+  return (uchar)c;
+}
+
+int GKeyPattern::parseAlt() {
+  int l=parseConcat();
+  while (err==NULL && *pp=='|') {
+    pp++;
+    int r=parseConcat();
+    l=newNode(nAlt, l, r);
+    }
+  return l;
+}
+
+int GKeyPattern::parseConcat() {
+  int n=-1;
+  while (err==NULL && *pp!=0 && *pp!='|' && *pp!=')') {
+    int a=parseRepeat();
+    n=(n<0) ? a : newNode(nCat, n, a);
+    }
+  if (n<0) n=newNode(nEmpty);
+  return n;
+}
+
+int GKeyPattern::parseRepeat() {
+  int a=parseAtom();
+  while (err==NULL) {
+    int min=0, max=0;
+    if (*pp=='*') { min=0; max=-1; pp++; }
+    else if (*pp=='+') { min=1; max=-1; pp++; }
+    else if (*pp=='?') { min=0; max=1; pp++; }
+    else if (*pp=='{') {
+      const char* p=pp+1;
+      if (!isdigit((uchar)*p)) { err="invalid {} repeat count"; break; }
+      min=strtol(p, (char**)&p, 10);
+      max=min;
+      if (*p==',') {
+        p++;
+        if (*p=='}') max=-1;
+         else {
+          if (!isdigit((uchar)*p)) { err="invalid {} repeat count"; break; }
+          max=strtol(p, (char**)&p, 10);
+          }
+        }
+      if (*p!='}' || (max>=0 && max<min) || min>GKEYPAT_MAX_REPEAT ||
+          max>GKEYPAT_MAX_REPEAT) { err="invalid {} repeat count"; break; }
+      pp=p+1;
+      }
+    else break;
+    a=newNode(nRepeat, a);
+    nodes[a].c=min;
+    nodes[a].max=max;
+    if (*pp=='?') { //lazy
+      nodes[a].greedy=false;
+      pp++;
+      }
+    }
+  return a;
+}
+
+int GKeyPattern::parseClass() {
+  //pp is after '['
+  bool negate=false;
+  if (*pp=='^') { negate=true; pp++; }
+  int cls=newClass();
+  bool firstc=true;
+  while (*pp!=']' || firstc) {
+    firstc=false;
+    if (*pp==0) { err="missing ]"; return -1; }
+    int c=(uchar)*pp++;
+    if (c=='\\') {
+      if (classEscape(cls, *pp)) { pp++; continue; }
+      c=escChar(*pp);
+      if (c<0) { err="invalid escape in []"; return -1; }
+      pp++;
+      }
+    if (*pp=='-' && pp[1]!=']' && pp[1]!=0) { //range
+      pp++;
+      int e=(uchar)*pp++;
+      if (e=='\\') {
+        e=escChar(*pp);
+        if (e<0) { err="invalid range in []"; return -1; }
+        pp++;
+        }
+      if (e<c) { err="invalid range in []"; return -1; }
+      classAddRange(cls, c, e);
+      }
+    else classAdd(cls, c);
+    }
+  pp++;
+  if (negate) for (int i=0;i<8;i++) classes[cls*8+i]=~classes[cls*8+i];
+  int n=newNode(nClass);
+  nodes[n].c=cls;
+  return n;
+}
+
+int GKeyPattern::parseAtom() {
+  int n=-1;
+  char c=*pp++;
+  switch (c) {
+    case '(':
+      if (pp[0]=='?' && pp[1]==':') {
+        pp+=2;
+        n=parseAlt();
+        }
+      else {
+        if (ngroups==GKEYPAT_MAX_GROUPS) { err="too many groups"; return -1; }
+        int g=++ngroups;
+        int a=parseAlt();
+        n=newNode(nGroup, a);
+        nodes[n].c=g;
+        }
+      if (err==NULL) {
+        if (*pp!=')') err="missing )";
+          else pp++;
+        }
+      return n;
+    case '[':
+      return parseClass();
+    case '.':
+      return newNode(nAny);
+    case '^':
+      return newNode(nBol);
+    case '$':
+      return newNode(nEol);
+    case '*':
+    case '+':
+    case '?':
+    case '{':
+      err="nothing to repeat";
+      return -1;
+    case '\\': {
+      int cls=newClass();
+      if (classEscape(cls, *pp)) {
+        pp++;
+        n=newNode(nClass);
+        nodes[n].c=cls;
+        return n;
+        }
+      numclasses--;
+      int e=escChar(*pp);
+      if (e<0) { err="invalid escape"; return -1; }
+      pp++;
+      n=newNode(nChar);
+      nodes[n].c=e;
+      return n;
+      }
+    }
+  n=newNode(nChar);
+  nodes[n].c=(uchar)c;
+  return n;
+}
+
+int GKeyPattern::emit(int op, int x, int y) {
+  if (proglen==GKEYPAT_MAX_PROG) err="pattern too large";
+  if (proglen==progcap) {
+    progcap=(progcap==0) ? 64 : progcap*2;
+    GREALLOC(prog, progcap*sizeof(Inst));
+    }
+  prog[proglen].op=op;
+  prog[proglen].x=x;
+  prog[proglen].y=y;
+  return proglen++;
+}
+
+void GKeyPattern::gen(int ni) {
+  if (err!=NULL) return;
+  Node n=nodes[ni];
+  switch (n.type) {
+    case nEmpty: break;
+    case nChar: emit(opChar, n.c); break;
+    case nAny: emit(opAny); break;
+    case nClass: emit(opClass, n.c); break;
+    case nBol: emit(opBol); break;
+    case nEol: emit(opEol); break;
+    case nCat:
+      gen(n.a);
+      gen(n.b);
+      break;
+    case nAlt: {
+      int s=emit(opSplit);
+      prog[s].x=proglen;
+      gen(n.a);
+      int j=emit(opJmp);
+      prog[s].y=proglen;
+      gen(n.b);
+      prog[j].x=proglen;
+      }
+      break;
+    case nGroup:
+      emit(opSave, 2*n.c);
+      gen(n.a);
+      emit(opSave, 2*n.c+1);
+      break;
+    case nRepeat: {
+      for (int i=0;i<n.c && err==NULL;i++) gen(n.a);
+      if (n.max<0) {
+        int s=emit(opSplit);
+        int body=proglen;
+        gen(n.a);
+        emit(opJmp, s);
+        if (n.greedy) { prog[s].x=body; prog[s].y=proglen; }
+          else { prog[s].x=proglen; prog[s].y=body; }
+        }
+      else if (n.max>n.c) {
+        //nested optional copies, each split exits to the end
+        int* splits=NULL;
+        GMALLOC(splits, (n.max-n.c)*sizeof(int));
+        int ns=0;
+        for (int i=n.c;i<n.max && err==NULL;i++) {
+          splits[ns++]=emit(opSplit);
+          gen(n.a);
+          }
+        for (int i=0;i<ns;i++) {
+          if (n.greedy) { prog[splits[i]].x=splits[i]+1; prog[splits[i]].y=proglen; }
+            else { prog[splits[i]].x=proglen; prog[splits[i]].y=splits[i]+1; }
+          }
+        GFREE(splits);
+        }
+      }
+      break;
+    }
+}
+
+//find the bytes which can start a match
+void GKeyPattern::setFirst() {
+  memset(first, 0, sizeof(first));
+  skipStart=true;
+  int* stack=NULL;
+  bool* seen=NULL;
+  GMALLOC(stack, proglen*sizeof(int));
+  GCALLOC(seen, proglen*sizeof(bool));
+  int ns=0;
+  stack[ns++]=0;
+  seen[0]=true;
+  while (ns>0) {
+    int pc=stack[--ns];
+    Inst& in=prog[pc];
+    int next[2];
+    int nn=0;
+    switch (in.op) {
+      case opChar: first[in.x]=true; break;
+      case opAny: memset(first, 1, sizeof(first)); break;
+      case opClass:
+        for (int c=0;c<256;c++)
+          if (classes[in.x*8+(c>>5)] & (1U<<(c&31))) first[c]=true;
+        break;
+      case opMatch:
+      case opEol: skipStart=false; break;
+      case opSplit: next[nn++]=in.x; next[nn++]=in.y; break;
+      case opJmp: next[nn++]=in.x; break;
+      default: next[nn++]=pc+1; //opSave, opBol
+      }
+    for (int i=0;i<nn;i++) {
+      if (!seen[next[i]]) {
+        seen[next[i]]=true;
+        stack[ns++]=next[i];
+        }
+      }
+    }
+  GFREE(stack);
+  GFREE(seen);
+}
+
+const char* GKeyPattern::compile(const char* pattern) {
+  char* p=(char*)pat;
+  GFREE(p);
+  pat=Gstrdup(pattern);
+  proglen=0;
+  numclasses=0;
+  ngroups=0;
+  numnodes=0;
+  err=NULL;
+  pp=pat;
+  int root=parseAlt();
+  if (err==NULL && *pp!=0) err="unmatched )";
+  if (err==NULL) {
+    emit(opSave, 0);
+    gen(root);
+    emit(opSave, 1);
+    emit(opMatch);
+    }
+  GFREE(nodes);
+  nodecap=0;
+  numnodes=0;
+  if (err==NULL) setFirst();
+  return err;
+}
+
+//-------------------------------------
+GKeyMatcher::GKeyMatcher(const GKeyPattern* pattern) {
+  kp=pattern;
+  nslots=2*(kp->ngroups+1);
+  int n=kp->proglen;
+  for (int l=0;l<2;l++) {
+    pcs[l]=NULL;
+    tcaps[l]=NULL;
+    GMALLOC(pcs[l], n*sizeof(int));
+    GMALLOC(tcaps[l], n*nslots*sizeof(int));
+    nthreads[l]=0;
+    }
+  mark=NULL;
+  GCALLOC(mark, n*sizeof(uint32));
+  gen=0;
+  wcaps=NULL;
+  mcaps=NULL;
+  GMALLOC(wcaps, nslots*sizeof(int));
+  GMALLOC(mcaps, nslots*sizeof(int));
+  for (int i=0;i<nslots;i++) mcaps[i]=-1;
+}
+
+GKeyMatcher::~GKeyMatcher() {
+  for (int l=0;l<2;l++) {
+    GFREE(pcs[l]);
+    GFREE(tcaps[l]);
+    }
+  GFREE(mark);
+  GFREE(wcaps);
+  GFREE(mcaps);
+}
+
+//follow the empty transitions from pc at position sp, adding the threads
+//reaching consuming instructions (or the match) to list l
+void GKeyMatcher::addThread(int l, int pc, int sp, int len) {
+  if (mark[pc]==gen) return;
+  mark[pc]=gen;
+  const GKeyPattern::Inst& in=kp->prog[pc];
+  switch (in.op) {
+    case GKeyPattern::opJmp:
+      addThread(l, in.x, sp, len);
+      return;
+    case GKeyPattern::opSplit:
+      addThread(l, in.x, sp, len);
+      addThread(l, in.y, sp, len);
+      return;
+    case GKeyPattern::opSave: {
+      int old=wcaps[in.x];
+      wcaps[in.x]=sp;
+      addThread(l, pc+1, sp, len);
+      wcaps[in.x]=old;
+      }
+      return;
+    case GKeyPattern::opBol:
+      if (sp==0) addThread(l, pc+1, sp, len);
+      return;
+    case GKeyPattern::opEol:
+      if (sp==len) addThread(l, pc+1, sp, len);
+      return;
+    }
+  int t=nthreads[l]++;
+  pcs[l][t]=pc;
+  memcpy(tcaps[l]+t*nslots, wcaps, nslots*sizeof(int));
+}
+
+bool GKeyMatcher::find(const char* s, int len, int from) {
+  if (kp->proglen==0) return false;
+  bool matched=false;
+  int c=0; //current list
+  int sp=from;
+  if (kp->skipStart) {
+    while (sp<len && !kp->first[(uchar)s[sp]]) sp++;
+    if (sp>=len) return false;
+    }
+  nthreads[c]=0;
+  gen++;
+  for (int i=0;i<nslots;i++) wcaps[i]=-1;
+  addThread(c, 0, sp, len);
+  for (;;sp++) {
+    int nl=1-c;
+    nthreads[nl]=0;
+    gen++;
+    for (int t=0;t<nthreads[c];t++) {
+      const GKeyPattern::Inst& in=kp->prog[pcs[c][t]];
+      int* caps=tcaps[c]+t*nslots;
+      bool adv=false;
+      switch (in.op) {
+        case GKeyPattern::opMatch:
+          matched=true;
+          memcpy(mcaps, caps, nslots*sizeof(int));
+          break;
+        case GKeyPattern::opChar:
+          adv=(sp<len && (uchar)s[sp]==in.x);
+          break;
+        case GKeyPattern::opAny:
+          adv=(sp<len);
+          break;
+        case GKeyPattern::opClass:
+          adv=(sp<len && (kp->classes[in.x*8+((uchar)s[sp]>>5)] & (1U<<((uchar)s[sp]&31))));
+          break;
+        }
+      if (in.op==GKeyPattern::opMatch) break; //lower priority threads are dropped
+      if (adv) {
+        memcpy(wcaps, caps, nslots*sizeof(int));
+        addThread(nl, pcs[c][t]+1, sp+1, len);
+        }
+      }
+    if (sp>=len) break;
+    if (!matched) { //a match could also start at the next position
+      int np=sp+1;
+      if (nthreads[nl]==0 && kp->skipStart) {
+        while (np<len && !kp->first[(uchar)s[np]]) np++;
+        if (np>=len) break;
+        sp=np-1;
+        }
+      for (int i=0;i<nslots;i++) wcaps[i]=-1;
+      addThread(nl, 0, np, len);
+      }
+    c=nl;
+    if (nthreads[c]==0) break;
+    }
+  return matched;
+}
@@ -0,0 +1,92 @@
+#ifndef _GKEYPAT_H
+#define _GKEYPAT_H
+#include "GBase.h"
+
+//=====================================================
+//-------- key extraction patterns (cdbfasta -k) ------
+//=====================================================
+// A regular expression is compiled once into a program for a Pike VM
+// (a Thompson NFA simulation which also tracks the capture groups):
+// every byte of the input is examined at most once per NFA state, so
+// there is no backtracking, and all the matching state is allocated
+// with the matcher, not for each match.
+// Supported syntax: literals, . [] [^] (with ranges and the \d \w \s
+// classes), \d \D \w \W \s \S, escaped special characters, \t \n \r,
+// ^ $, ( ) (?: ), |, and the * + ? {m} {m,} {m,n} quantifiers (which
+// can be made lazy with a trailing ?). Matches are leftmost-first,
+// like in Perl.
+
+#define GKEYPAT_MAX_PROG 8192
+#define GKEYPAT_MAX_GROUPS 32
+#define GKEYPAT_MAX_REPEAT 1000
+
+class GKeyPattern {
+  friend class GKeyMatcher;
+ protected:
+  enum { opChar=0, opAny, opClass, opSplit, opJmp, opSave, opBol, opEol, opMatch };
+  struct Inst {
+    int op;
+    int x; //char, class index, jump target or capture slot
+    int y; //second split target
+  };
+  struct Node; //parse tree
+  Inst* prog;
+  int proglen;
+  int progcap;
+  uint32* classes; //256bit sets for opClass
+  int numclasses;
+  int ngroups; //capture groups
+  bool first[256]; //bytes which can start a match
+  bool skipStart; //matches can only start at bytes in first[]
+  //parsing and code generation
+  const char* pat;
+  const char* pp;
+  const char* err;
+  Node* nodes;
+  int numnodes;
+  int nodecap;
+  int newNode(int type, int a=-1, int b=-1);
+  int newClass();
+  void classAdd(int cls, int c) { classes[cls*8+(c>>5)] |= (1U<<(c&31)); }
+  void classAddRange(int cls, int from, int to);
+  bool classEscape(int cls, char c, bool negate=false);
+  int parseAlt();
+  int parseConcat();
+  int parseRepeat();
+  int parseAtom();
+  int parseClass();
+  int emit(int op, int x=0, int y=0);
+  void gen(int node);
+  void setFirst();
+ public:
+  GKeyPattern();
+  ~GKeyPattern();
+  //returns NULL if the pattern was compiled, or an error message
+  const char* compile(const char* pattern);
+  int numGroups() { return ngroups; }
+  const char* pattern() { return pat; }
+};
+
+//matching state for a compiled pattern (one per thread)
+class GKeyMatcher {
+  const GKeyPattern* kp;
+  int nslots; //capture slots: start and end of the whole match and groups
+  int* pcs[2]; //thread lists: program counters
+  int* tcaps[2]; //                and capture slots
+  int nthreads[2];
+  uint32* mark; //list generation which last visited each instruction
+  uint32 gen;
+  int* wcaps; //working capture slots
+  int* mcaps; //capture slots of the match found
+  void addThread(int l, int pc, int sp, int len);
+ public:
+  GKeyMatcher(const GKeyPattern* pattern);
+  ~GKeyMatcher();
+  //leftmost-first match in s[from..len); returns false if none found
+  bool find(const char* s, int len, int from);
+  //start and end of capture group g (0 for the whole match), -1 if unset
+  int start(int g) { return mcaps[2*g]; }
+  int end(int g) { return mcaps[2*g+1]; }
+};
+
+#endif
@@ -0,0 +1,218 @@
+#include "gmphset.h"
+
+//average number of keys per bucket
+#define GMPH_BUCKET_KEYS 4
+//number of hash seeds to try before giving up
+#define GMPH_MAX_SEEDS 64
+
+GMphSet::GMphSet() {
+  nkeys=0;
+  nbuckets=0;
+  seed=0;
+  disp=NULL;
+  slots=NULL;
+  kdata=NULL;
+  memset(lenbits, 0, sizeof(lenbits));
+  tmpkeys=NULL;
+  tmpofs=NULL;
+  tmplen=0;
+  tmpcap=0;
+  tmpcount=0;
+  tmpofscap=0;
+}
+
+GMphSet::~GMphSet() {
+  clear();
+  GFREE(tmpkeys);
+  GFREE(tmpofs);
+}
+
+void GMphSet::clear() {
+  GFREE(disp);
+  GFREE(slots);
+  GFREE(kdata);
+  nkeys=0;
+  nbuckets=0;
+  memset(lenbits, 0, sizeof(lenbits));
+}
+
+uint64 GMphSet::hash(const char* key, int len, uint32 seed) {
+  const uint64 m=0x9E3779B97F4A7C15ULL;
+  uint64 h=(seed^((uint64)len*m))*m;
+  while (len>=8) {
+    uint64 v;
+    memcpy(&v, key, 8);
+    h=(h^v)*m;
+    h^=h>>29;
+    key+=8;
+    len-=8;
+    }
+  if (len>0) {
+    uint64 v=0;
+    for (int i=0;i<len;i++) v|=((uint64)(uchar)key[i])<<(i*8);
+    h=(h^v)*m;
+    h^=h>>29;
+    }
+  h*=0xBF58476D1CE4E5B9ULL;
+  h^=h>>32;
+  return h;
+}
+
+void GMphSet::add(const char* key, int len) {
+  if (tmplen+len>tmpcap) {
+    tmpcap=(tmplen+len+1024)*2;
+    GREALLOC(tmpkeys, tmpcap);
+    }
+  if (tmpcount+2>tmpofscap) {
+    tmpofscap=(tmpcount+2)*2;
+    GREALLOC(tmpofs, tmpofscap*sizeof(uint32));
+    }
+  memcpy(tmpkeys+tmplen, key, len);
+  tmpofs[tmpcount]=tmplen;
+  tmplen+=len;
+  tmpcount++;
+  tmpofs[tmpcount]=tmplen;
+}
+
+struct GMphKey {
+  uint64 h;
+  uint32 k; //key index
+};
+
+static int cmpMphKey(const void* p1, const void* p2) {
+  const GMphKey* a=(const GMphKey*)p1;
+  const GMphKey* b=(const GMphKey*)p2;
+  if (a->h!=b->h) return (a->h<b->h) ? -1 : 1;
+  return (a->k<b->k) ? -1 : ((a->k>b->k) ? 1 : 0);
+}
+
+//try to place the collected keys using the given hash seed
+bool GMphSet::place(uint32 tryseed) {
+  GMphKey* keys=NULL;
+  GMALLOC(keys, tmpcount*sizeof(GMphKey));
+  for (uint32 i=0;i<tmpcount;i++) {
+    keys[i].h=hash(tmpkeys+tmpofs[i], tmpofs[i+1]-tmpofs[i], tryseed);
+    keys[i].k=i;
+    }
+  qsort(keys, tmpcount, sizeof(GMphKey), cmpMphKey);
+  //drop duplicate keys; a hash collision of different keys needs a new seed
+  uint32 n=0;
+  for (uint32 i=0;i<tmpcount;i++) {
+    if (n>0 && keys[n-1].h==keys[i].h) {
+      uint32 a=keys[n-1].k, b=keys[i].k;
+      uint32 alen=tmpofs[a+1]-tmpofs[a];
+      if (alen==tmpofs[b+1]-tmpofs[b] &&
+          memcmp(tmpkeys+tmpofs[a], tmpkeys+tmpofs[b], alen)==0) continue;
+      GFREE(keys);
+      return false;
+      }
+    keys[n++]=keys[i];
+    }
+  nkeys=n;
+  nbuckets=n/GMPH_BUCKET_KEYS+1;
+  //group the keys by bucket
+  uint32* bstart=NULL; //first key of each bucket in bkeys
+  GCALLOC(bstart, (nbuckets+1)*sizeof(uint32));
+  for (uint32 i=0;i<n;i++) bstart[range((uint32)(keys[i].h>>32), nbuckets)+1]++;
+  uint32 maxbsize=0;
+  for (uint32 b=0;b<nbuckets;b++) {
+    if (bstart[b+1]>maxbsize) maxbsize=bstart[b+1];
+    bstart[b+1]+=bstart[b];
+    }
+  uint32* bkeys=NULL; //indexes in keys[], grouped by bucket
+  uint32* bfill=NULL;
+  GMALLOC(bkeys, n*sizeof(uint32));
+  GMALLOC(bfill, nbuckets*sizeof(uint32));
+  memcpy(bfill, bstart, nbuckets*sizeof(uint32));
+  for (uint32 i=0;i<n;i++) bkeys[bfill[range((uint32)(keys[i].h>>32), nbuckets)]++]=i;
+  //buckets are placed in decreasing size order
+  uint32* border=bfill; //reused
+  uint32* scount=NULL;
+  GCALLOC(scount, (maxbsize+2)*sizeof(uint32));
+  for (uint32 b=0;b<nbuckets;b++) scount[maxbsize-(bstart[b+1]-bstart[b])+1]++;
+  for (uint32 s=0;s<=maxbsize;s++) scount[s+1]+=scount[s];
+  for (uint32 b=0;b<nbuckets;b++) border[scount[maxbsize-(bstart[b+1]-bstart[b])]++]=b;
+  GFREE(scount);
+  GFREE(disp);
+  GCALLOC(disp, nbuckets*sizeof(uint32));
+  uint32* slotkey=NULL; //index in keys[] for each slot, or MAX_UINT
+  GMALLOC(slotkey, n*sizeof(uint32));
+  for (uint32 i=0;i<n;i++) slotkey[i]=MAX_UINT;
+  uint32* pos=NULL;
+  GMALLOC(pos, (maxbsize+1)*sizeof(uint32));
+  uint32 maxdisp=(n<0x1000) ? 0x10000 : n*16;
+  bool ok=true;
+  for (uint32 bi=0;bi<nbuckets && ok;bi++) {
+    uint32 b=border[bi];
+    uint32 bsize=bstart[b+1]-bstart[b];
+    if (bsize==0) break; //only empty buckets left
+    uint32* bk=bkeys+bstart[b];
+    uint32 d=0;
+    for (;d<maxdisp;d++) {
+      uint32 j=0;
+      for (;j<bsize;j++) {
+        uint64 h=keys[bk[j]].h;
+        uint32 hi=(uint32)(h>>32);
+        uint32 p=range((uint32)h+d*(hi|1), n);
+        if (slotkey[p]!=MAX_UINT) break;
+        slotkey[p]=bk[j];
+        pos[j]=p;
+        }
+      if (j==bsize) break; //all the keys of the bucket were placed
+      while (j>0) slotkey[pos[--j]]=MAX_UINT;
+      }
+    if (d==maxdisp) ok=false;
+      else disp[b]=d;
+    }
+  GFREE(pos);
+  GFREE(bstart);
+  GFREE(bkeys);
+  GFREE(bfill);
+  if (ok) {
+    //store the keys in slot order
+    uint32 klen=0;
+    for (uint32 i=0;i<n;i++) {
+      uint32 k=keys[slotkey[i]].k;
+      klen+=tmpofs[k+1]-tmpofs[k];
+      }
+    GFREE(slots);
+    GFREE(kdata);
+    GMALLOC(slots, (n+1)*sizeof(Slot));
+    GMALLOC(kdata, klen+1);
+    klen=0;
+    for (uint32 i=0;i<n;i++) {
+      uint32 k=keys[slotkey[i]].k;
+      uint32 len=tmpofs[k+1]-tmpofs[k];
+      slots[i].fp=(uint32)(keys[slotkey[i]].h>>32);
+      slots[i].ofs=klen;
+      memcpy(kdata+klen, tmpkeys+tmpofs[k], len);
+      klen+=len;
+      uint32 lb=(len<GMPH_LENBITS) ? len : GMPH_LENBITS-1;
+      lenbits[lb>>5] |= (1U<<(lb&31));
+      }
+    slots[n].fp=0;
+    slots[n].ofs=klen;
+    seed=tryseed;
+    }
+  GFREE(slotkey);
+  GFREE(keys);
+  return ok;
+}
+
+int GMphSet::build() {
+  clear();
+  if (tmpcount>0) {
+    uint32 s=0;
+    while (!place(0x9E3779B9U*(s+1)+s)) {
+      if (++s==GMPH_MAX_SEEDS)
+        GError("Error: failed to build the perfect hash for %d keys!\n", tmpcount);
+      }
+    }
+  GFREE(tmpkeys);
+  GFREE(tmpofs);
+  tmplen=0;
+  tmpcap=0;
+  tmpcount=0;
+  tmpofscap=0;
+  return nkeys;
+}
@@ -0,0 +1,66 @@
+#ifndef _GMPHSET_H
+#define _GMPHSET_H
+#include "GBase.h"
+
+//=====================================================
+//------- static string set, minimal perfect hash -----
+//=====================================================
+// A fixed set of strings (e.g. the -w stop words) compiled into a
+// compact lookup structure: the keys are spread into small buckets and
+// each bucket gets a displacement value which places all its keys into
+// distinct slots of a table having one slot per key (hash & displace).
+// Each slot stores a 32bit fingerprint of its key, so most absent keys
+// are rejected without touching the key data, and a bitmap of the key
+// lengths rejects tokens of impossible lengths before any hashing.
+// Lookups take (pointer, length) strings, no terminating '\0' is needed.
+
+#define GMPH_LENBITS 256
+
+class GMphSet {
+ protected:
+  struct Slot {
+    uint32 fp; //key fingerprint
+    uint32 ofs; //key offset in kdata (slot i+1 gives the end of the key)
+  };
+  uint32 nkeys;
+  uint32 nbuckets;
+  uint32 seed;
+  uint32* disp; //displacement of each bucket
+  Slot* slots; //nkeys+1 entries
+  char* kdata; //the keys, in slot order
+  uint32 lenbits[GMPH_LENBITS/32]; //lengths found (the last bit: all longer)
+  //keys collected by add(), before build()
+  char* tmpkeys;
+  uint32* tmpofs;
+  uint32 tmplen, tmpcap, tmpcount, tmpofscap;
+  static uint64 hash(const char* key, int len, uint32 seed);
+  static inline uint32 range(uint32 v, uint32 n) { //v mapped to 0..n-1
+    return (uint32)(((uint64)v*n)>>32);
+    }
+  inline uint32 slotOf(uint64 h) {
+    uint32 hi=(uint32)(h>>32);
+    uint32 d=disp[range(hi, nbuckets)];
+    return range((uint32)h+d*(hi|1), nkeys);
+    }
+  bool place(uint32 tryseed);
+  void clear();
+ public:
+  GMphSet();
+  ~GMphSet();
+  //collect a key (duplicates are ignored by build())
+  void add(const char* key, int len);
+  //compile the keys added so far; returns the number of distinct keys
+  int build();
+  int count() { return nkeys; }
+  bool has(const char* key, int len) {
+    uint32 lb=(len<GMPH_LENBITS) ? len : GMPH_LENBITS-1;
+    if ((lenbits[lb>>5] & (1U<<(lb&31)))==0) return false;
+    uint64 h=hash(key, len, seed);
+    uint32 i=slotOf(h);
+    if (slots[i].fp!=(uint32)(h>>32)) return false;
+    return (slots[i+1].ofs-slots[i].ofs==(uint32)len &&
+            memcmp(kdata+slots[i].ofs, key, len)==0);
+    }
+};
+
+#endif